@@ -2,6 +2,7 @@
 #define  TRM_DMAP_H
 
 #include <string>
+#include <vector>
 #include "trm_array1d.h"
 #include "trm_array2d.h"
 #include "trm_buffer2d.h"
@@ -129,9 +130,27 @@ public:
   //! Calculate the maximum pixel value
   float max() const;
 
+  //! Restricts the map to an annulus of velocities about the origin
+  void set_mask(float vmin, float vmax);
+
+  //! Restricts the map to the pixels where another map is positive
+  void set_mask(const Dmap& mask);
+
+  //! Removes any mask
+  void clear_mask() {mask_.clear();}
+
+  //! Returns true if the map has a mask
+  bool masked() const {return !mask_.empty();}
+
+  //! Returns the mask, non-zero for the pixels in use, or NULL if there is none
+  const char* mask() const {return masked() ? &mask_[0] : NULL;}
+
   //! Static constant to indicate file type
   const static int flag = 1235642;
 
+  //! Static constant marking a mask following the images of a file
+  const static int mask_flag = 1235643;
+
   //! Error class inherited from the string class.
   class Dmap_Error : public std::string {
   public:
@@ -150,6 +169,7 @@ private:
   Subs::Array1D<float>  gamma_;
   Subs::Array1D<double> wzero_;
   Subs::Array2D< Subs::Array2D<float> > image_;
+  std::vector<char> mask_;
 
 };
 
@@ -1,6 +1,7 @@
 #ifndef TRM_TOMOG_H
 #define TRM_TOMOG_H
 
+#include <vector>
 #include "trm_array1d.h"
 
 // Tomog namespace
@@ -9,6 +10,427 @@
 
 namespace Tomog {
 
+  class Workspace;
+
+  //! Ways of projecting map pixels onto the fine buffers
+
+  /** PROJ_POINT adds each pixel into the fine pixel containing its centre,
+   * relying upon over-sampling (ndiv) to reduce the resulting noise. 
+   * PROJ_FOURIER uses the projection-slice theorem: each image is Fourier
+   * transformed once per call and each sub-exposure's spectrum is read off
+   * along a line through the origin of the transform, multiplied by the 
+   * transform of the line profile and binning, and transformed back. The 
+   * cost goes as the number of sub-exposures times the length of the spectra
+   * rather than times the number of map pixels, plus the 2D transforms, so 
+   * it wins for large maps with many spectra. It treats the pixels as points
+   * as PROJ_POINT does but without binning them into fine pixels, so it is 
+   * free of the noise that this causes and agrees with PROJ_POINT to the
+   * level of that noise. It computes the projection of points to a relative
+   * accuracy of about 1e-5. It also
+   * includes light from pixels that project just beyond the ends of the
+   * spectra, which PROJ_POINT drops.
+   * PROJ_FOOTPRINT spreads each pixel over the fine pixels overlapped by its
+   * projected outline, which is exact for square pixels and so works well 
+   * at lower ndiv, at a higher cost per pixel.
+   */
+  enum Projector {PROJ_POINT, PROJ_FOOTPRINT, PROJ_FOURIER};
+
+  //! Geometry of the projections between a map and a trail
+
+  /** A Plan stores everything needed by op and tr that depends only upon 
+   * the format of the map and trail and the ephemeris, and not on the
+   * pixel values: the blurring function, the phases of every sub-exposure
+   * with their weights, cosines and sines and the offsets needed for each image 
+   * of the map. op and tr are called many times with the same geometry during
+   * MEM iterations so it pays to construct a Plan once and pass it to them.
+   */
+  class Plan {
+  public:
+
+    //! Default constructor
+    Plan() : nside_(0), nwave_(0), ngamma_(0), ndiv_(0), npixd_(0), nspec_(0), nfine_(0), 
+	     sigma_(0.f), proj_(PROJ_POINT), repro_(false), fgrid_(0), fline_(0), fos_(0), fsign_(1), flen_(0.), nlive_(0), 
+	     period_(0.), vpixd_(0.f), scale_(0.f) {}
+
+    //! Constructor from the map and trail formats and the ephemeris
+    Plan(const Subs::Array1D<double>& wave, const Subs::Array1D<float>& gamma, 
+	 size_t nside, float vpix, float fwhm, int ndiv, int ntdiv, int npixd, 
+	 int nspec, float vpixd, double waved, const Subs::Array1D<double>& time, 
+	 const Subs::Array1D<float>& expose, double tzero, double period);
+
+    //! Constructor with a different number of sub-exposures for each spectrum
+    Plan(const Subs::Array1D<double>& wave, const Subs::Array1D<float>& gamma, 
+	 size_t nside, float vpix, float fwhm, int ndiv, const Subs::Array1D<int>& ntdiv, 
+	 int npixd, int nspec, float vpixd, double waved, const Subs::Array1D<double>& time, 
+	 const Subs::Array1D<float>& expose, double tzero, double period);
+
+    //! Returns the number of pixels along a side of each image
+    size_t nside() const {return nside_;}
+
+    //! Returns the number of wavelengths
+    int nwave() const {return nwave_;}
+
+    //! Returns the number of systemic velocities
+    int ngamma() const {return ngamma_;}
+
+    //! Returns the number of images (wavelengths times systemic velocities)
+    int nimage() const {return nwave_*ngamma_;}
+
+    //! Returns the total number of map pixels
+    size_t nmap() const {return nimage()*nside_*nside_;}
+
+    //! Returns the number of pixels per spectrum
+    int npixd() const {return npixd_;}
+
+    //! Returns the number of spectra
+    int nspec() const {return nspec_;}
+
+    //! Returns the total number of data pixels
+    size_t ndata() const {return size_t(nspec_)*npixd_;}
+
+    //! Returns the number of pixels in the fine buffers
+    int nfine() const {return nfine_;}
+
+    //! Returns the over-sampling factor of the fine buffers
+    int ndiv() const {return ndiv_;}
+
+    //! Returns the half-width of the blurring function in fine pixels
+    int nblurr() const {return (int(blurr_.size())-1)/2;}
+
+    //! Returns the blurring function, normalised to unit sum
+    const float* blurr() const {return &blurr_[0];}
+
+    //! Returns the number of elements of the combined blurring and binning kernel
+    int nbkern() const {return bkern_.size();}
+
+    //! Returns the combined blurring and binning kernel
+    const float* bkern() const {return &bkern_[0];}
+
+    //! Selects FFTs or direct summation for the blurring and binning
+    void set_fft_blurr(bool fft);
+
+    //! Returns true if the blurring and binning is carried out with FFTs
+    bool fft_blurr() const {return !bfft_.empty();}
+
+    //! Returns the number of elements of workspace needed by blurr_op and blurr_tr
+    size_t nfft() const {return bfft_.size();}
+
+    //! Blurrs and bins the fine buffer of a spectrum
+    void blurr_op(const double fine[], float spec[], float work[]) const;
+
+    //! Transposed version of blurr_op
+    void blurr_tr(const float spec[], double fine[], float work[]) const;
+
+    //! Returns the number of sub-exposures of spectrum ns
+    int nsub(int ns) const {return sfirst_[ns+1]-sfirst_[ns];}
+
+    //! Returns the index of the first sub-exposure of spectrum ns
+    int sfirst(int ns) const {return sfirst_[ns];}
+
+    //! Returns the total number of sub-exposures
+    int nsub() const {return sfirst_[nspec_];}
+
+    //! Returns the cosine of the orbital phase of sub-exposure ns
+    double cosp(int ns) const {return cosp_[ns];}
+
+    //! Returns the sine of the orbital phase of sub-exposure ns
+    double sinp(int ns) const {return sinp_[ns];}
+
+    //! Returns the orbital phase of sub-exposure ns, counting cycles from the zero point
+    double phase(int ns) const {return phase_[ns];}
+
+    //! Returns the period of the ephemeris
+    double period() const {return period_;}
+
+    //! Returns the km/s/pixel of the spectra
+    float vpixd() const {return vpixd_;}
+
+    //! Returns the fine pixel step per map pixel in X of sub-exposure ns
+    float pxscale(int ns) const {return pxscale_[ns];}
+
+    //! Returns the fine pixel step per map pixel in Y of sub-exposure ns
+    float pyscale(int ns) const {return pyscale_[ns];}
+
+    //! Returns the weight of sub-exposure ns
+    float weight(int ns) const {return weight_[ns];}
+
+    //! Returns the fine pixel offset of the first pixel of image nim for sub-exposure ns
+    float fpcon(int ns, int nim) const {return fpcon_[size_t(nimage())*ns+nim];}
+
+    //! Changes the systemic velocities of the images
+    void set_gamma(const Subs::Array1D<float>& gamma);
+
+    //! Shares fine pixel patterns between systemic velocities a whole number of fine pixels apart
+    bool set_snap(bool snap);
+
+    //! Returns true if the systemic velocities have been snapped by set_snap
+    bool snapped() const {return !gshift_.empty();}
+
+    //! Returns the shift in fine pixels of the images at systemic velocity ng relative to the first
+    int gshift(int ng) const {return gshift_[ng];}
+
+    //! Selects the projection method; removes any sparse matrix
+    void set_projector(Projector proj);
+
+    //! Returns the projection method
+    Projector projector() const {return proj_;}
+
+    //! Selects fixed-point point projection that gives the same bits on any machine
+    void set_reproducible(bool repro);
+
+    //! Returns true if the projections are reproducible
+    bool reproducible() const {return repro_;}
+
+    //! Restricts op and tr to the map pixels with non-zero mask values
+    void set_mask(const char mask[]);
+
+    //! Returns true if op and tr are restricted by a mask
+    bool masked() const {return !mask_.empty();}
+
+    //! Returns the number of map pixels that op and tr use
+    size_t nlive() const {return masked() ? nlive_ : nmap();}
+
+    //! Returns true if map pixel i is used by op and tr
+    bool live(size_t i) const {return mask_.empty() || mask_[i];}
+
+    //! Returns the number of runs of used pixels in row nr of the map, counting rows through all the images
+    int nrun(size_t nr) const {return mrow_.empty() ? 1 : int(mrow_[nr+1]-mrow_[nr]);}
+
+    //! Returns the first pixel of run k of row nr
+    size_t run_first(size_t nr, int k) const {return mrow_.empty() ? 0 : mrun_[2*(mrow_[nr]+k)];}
+
+    //! Returns one more than the last pixel of run k of row nr
+    size_t run_last(size_t nr, int k) const {return mrow_.empty() ? nside_ : mrun_[2*(mrow_[nr]+k)+1];}
+
+    //! Copies the used pixels of a map into an array of nlive() elements
+    void pack(const float map[], float live[]) const;
+
+    //! Copies an array of nlive() elements into the used pixels of a map
+    void unpack(const float live[], float map[]) const;
+
+    //! Returns the size along each side of the 2D transforms of PROJ_FOURIER
+    size_t ngrid() const {return fgrid_;}
+
+    //! Returns the length of the 1D transforms of PROJ_FOURIER
+    size_t nline() const {return fline_;}
+
+    //! Returns the number of frequencies per spectrum used by PROJ_FOURIER
+    int nfreq() const {return fwfac_.size()/2;}
+
+    //! Returns the number of samples per data pixel of the 1D transforms of PROJ_FOURIER
+    int nover() const {return fos_;}
+
+    //! Returns the number of floats of FFT workspace per thread needed by PROJ_FOURIER
+    size_t nfwork() const;
+
+    //! Computes model data from a map with PROJ_FOURIER
+    void fourier_op(const float map[], float data[], Workspace& work) const;
+
+    //! Transposed version of fourier_op
+    void fourier_tr(const float data[], float map[], Workspace& work) const;
+
+    //! Builds the projection as a sparse matrix if it will fit in memory
+    bool set_sparse(size_t maxmem);
+
+    //! Returns true if the projection has been stored as a sparse matrix
+    bool sparse() const {return grouped() ? gplan_[0].sparse() : !srow_.empty();}
+
+    //! Projects a map into the fine buffer of spectrum ns using the sparse matrix
+    void sparse_op(int ns, const float map[], double fine[]) const;
+
+    //! Transposed version of sparse_op
+    void sparse_tr(int ns, const double fine[], float map[]) const;
+
+    //! Groups spectra that share their geometry to within a tolerance in phase
+    int set_groups(double dphase);
+
+    //! Returns true if op and tr project one spectrum per group of spectra
+    bool grouped() const {return !gplan_.empty();}
+
+    //! Returns the number of groups
+    int ngroup() const {return grouped() ? gplan_[0].nspec() : nspec_;}
+
+    //! Returns the group of spectrum ns
+    int group(int ns) const {return grouped() ? group_[ns] : ns;}
+
+    //! Returns the Plan of the spectra representing each group
+    const Plan& group_plan() const {return grouped() ? gplan_[0] : *this;}
+
+    //! Pairs spectra half an orbit apart for op and tr to project together
+    int set_mirror(double dphase);
+
+    //! Returns true if any spectra have been paired by set_mirror
+    bool paired() const {return !porder_.empty();}
+
+    //! Returns the spectrum paired with spectrum ns, or -1 if it has none
+    int mirror(int ns) const {return mirror_.empty() ? -1 : mirror_[ns];}
+
+    //! Returns the spectrum at position k of the order in which op and tr take them
+    int pair_order(int k) const {return porder_.empty() ? k : porder_[k];}
+
+  private:
+
+    // Work of the constructors
+    void init(const Subs::Array1D<double>& wave, const Subs::Array1D<float>& gamma, 
+	      float vpix, float fwhm, float vpixd, double waved, const int ntdiv[], 
+	      const Subs::Array1D<double>& time, const Subs::Array1D<float>& expose, 
+	      double tzero, double period);
+
+    // Computes the offsets of the images from the systemic velocities
+    void set_offsets(const Subs::Array1D<float>& gamma);
+
+    // Cost model choosing between FFTs and direct summation
+    bool fft_cheaper() const;
+
+    // Sets up PROJ_FOURIER
+    void set_fourier();
+
+    // Sets up the parts of PROJ_FOURIER that depend upon the offsets of the images
+    void set_fourier_line();
+
+    size_t nside_;
+    int nwave_, ngamma_, ndiv_, npixd_, nspec_, nfine_;
+    float sigma_;
+    Projector proj_;
+    bool repro_;
+    std::vector<float> blurr_, bkern_, bfft_;
+    std::vector<int> sfirst_;
+    std::vector<double> cosp_, sinp_, phase_;
+    std::vector<float> pxscale_, pyscale_, weight_, fpcon_;
+    std::vector<int> gshift_;
+
+    // Offsets in fine pixels of the systemic velocities from the first, and
+    // the offsets of the images from before they were snapped
+    std::vector<double> gfine_;
+    std::vector<float> fpsave_;
+
+    // Fourier-slice projection
+    size_t fgrid_, fline_;
+    int fos_, fsign_;
+    double flen_;
+    std::vector<float> fkern_, fdeap_;
+    std::vector<double> fwfac_;
+
+    // Sparse matrix: start of each fine pixel's row, column steps and values
+    std::vector<size_t> srow_;
+    std::vector<unsigned short> sdelta_;
+    std::vector<float> sval_;
+
+    // Groups of spectra: the group of each spectrum and, if grouped, the Plan
+    // of one spectrum per group
+    std::vector<int> group_;
+    std::vector<Plan> gplan_;
+
+    // Spectra half an orbit apart: the partner of each spectrum and an order
+    // of the spectra with each pair together
+    std::vector<int> mirror_, porder_;
+
+    // Mask: non-zero for each map pixel used, the number used, the start
+    // of each row's runs of used pixels, and the first and one more than
+    // the last pixel of each run
+    std::vector<char> mask_;
+    size_t nlive_;
+    std::vector<size_t> mrow_, mrun_;
+
+    // Period and data pixel size, needed for derivatives by op_deriv
+    double period_;
+    float vpixd_;
+
+    // Velocity offsets of the wavelengths (km/s) and the scale factor map/fine,
+    // from which set_gamma recomputes the offsets of the images
+    std::vector<double> vwave_;
+    float scale_;
+
+  };
+
+  //! Number of sub-exposures for each spectrum to keep the smearing within a tolerance
+  Subs::Array1D<int> sub_exposures(const Subs::Array1D<float>& expose, double period, 
+				   size_t nside, float smear, int nmax);
+
+  //! Re-usable memory for op, tr and gaussdef
+
+  /** A Workspace holds heap buffers that op, tr and gaussdef would otherwise
+   * allocate on every call. Each is identified by a slot number and grows 
+   * as needed but never shrinks, so once a Workspace has been used (or sized
+   * with reserve), further calls with the same geometry allocate nothing.
+   * Buffers start on ALIGN-byte boundaries. Slots from USER onwards are free
+   * for the caller. A Workspace must not be used by two calls at once.
+   */
+  class Workspace {
+  public:
+
+    //! Alignment of buffers in bytes
+    static const size_t ALIGN = 64;
+
+    //! Slots used by op, tr and gaussdef
+    enum {FINE, FFT, MAP, INDEX, BATCH, GAUSS, PREFIX, GRID, GROUP, USER};
+
+    //! Default constructor
+    Workspace() {}
+
+    //! Constructor sized for op and tr with a given Plan
+    Workspace(const Plan& plan, int nbatch=1) {reserve(plan, nbatch);}
+
+    //! Destructor
+    ~Workspace();
+
+    //! Makes sure the buffers are big enough for op and tr with a given Plan
+    void reserve(const Plan& plan, int nbatch=1);
+
+    //! Returns a buffer of at least n elements of type T
+    template <class T>
+    T* get(int slot, size_t n) {return static_cast<T*>(get_bytes(slot, n*sizeof(T)));}
+
+    //! Number of elements of type T needed to hold n of them and keep the alignment
+    template <class T>
+    static size_t stride(size_t n) {return (n*sizeof(T)+ALIGN-1)/ALIGN*(ALIGN/sizeof(T));}
+
+    //! Returns the total number of bytes allocated
+    size_t nbytes() const;
+
+  private:
+
+    void* get_bytes(int slot, size_t nbytes);
+
+    // Prevent copying
+    Workspace(const Workspace&);
+    Workspace& operator=(const Workspace&);
+
+    std::vector<void*> buff_;
+    std::vector<size_t> nbytes_;
+
+  };
+
+  //! Computes model data from a map using a pre-computed Plan
+  void op(const Plan& plan, const float map[], float data[]);
+
+  //! Computes model data from a map using a pre-computed Plan and a Workspace
+  void op(const Plan& plan, const float map[], float data[], Workspace& work);
+
+  //! Transposed version of op using a pre-computed Plan
+  void tr(const Plan& plan, const float data[], float map[]);
+
+  //! Transposed version of op using a pre-computed Plan and a Workspace
+  void tr(const Plan& plan, const float data[], float map[], Workspace& work);
+
+  //! Computes model data from several maps at once
+  void op_batch(const Plan& plan, int nbatch, const float map[], float data[], Workspace& work);
+
+  //! Transposed version of op_batch
+  void tr_batch(const Plan& plan, int nbatch, const float data[], float map[], Workspace& work);
+
+  //! Computes model data and their derivatives with respect to the ephemeris and systemic velocity
+  void op_deriv(const Plan& plan, const float map[], float data[], float dtzero[], 
+		float dperiod[], float dgamma[], Workspace& work);
+
+  //! Adds the projection of changes to a few map pixels to existing model data
+  void op_delta(const Plan& plan, size_t npix, const size_t pix[], const float dval[], 
+		float data[], Workspace& work);
+
+  //! Adds the projection of changes to a rectangular patch of one image to existing model data
+  void op_delta(const Plan& plan, int nim, size_t x1, size_t y1, size_t nx, size_t ny, 
+		const float patch[], float data[], Workspace& work);
+
   //! Computes model data from a map
   void op(const float map[], const Subs::Array1D<double>& wave, 
 	  const Subs::Array1D<float>& gamma, size_t nside, float vpix, 
@@ -23,10 +445,38 @@ namespace Tomog {
 	  float vpixd, double waved, const Subs::Array1D<double>& time, 
 	  const Subs::Array1D<float>& expose, double tzero, double period, float map[]);
   
+  //! Sets the number of threads used by op and tr
+  void set_nthread(int nthread);
+
+  //! Returns the number of threads used by op and tr
+  int get_nthread();
+
+  //! Sets the cache size used to choose the block sizes of op
+  void set_cache_size(size_t nbytes);
+
+  //! Returns the cache size used to choose the block sizes of op
+  size_t get_cache_size();
+
+  //! Instruction set extensions available to the projections of op and tr
+  enum Simd {SIMD_NONE, SIMD_SSE2, SIMD_AVX2, SIMD_AVX512};
+
+  //! Sets the instruction set extensions used by op and tr
+  void set_simd(Simd simd);
+
+  //! Returns the instruction set extensions used by op and tr
+  Simd get_simd();
+
   //! Computes default image
   void gaussdef(const float input[], size_t nwave, size_t ngamma, 
 		size_t nside, float fwhm, float gfwhm, float output[]);
 
+  //! Computes default image using a Workspace
+  void gaussdef(const float input[], size_t nwave, size_t ngamma, 
+		size_t nside, float fwhm, float gfwhm, float output[], Workspace& work);
+
+  //! Applies the filter of filtered back-projection to a set of spectra
+  void fbp_filter(float data[], int npix, int nspec, float fwhm);
+
   //! Tomog_Error is the base class for exceptions.
   class Tomog_Error : public std::string {
   public:
@@ -58,6 +508,12 @@ namespace Tomog {
   //! Standard name of directory for default files if environment variable not set.
   const char TOMOG_DIR[]         = ".tomog";
 
+  //! Name of environment variable which can be set to specify the number of threads
+  const char TOMOG_NTHREAD[]     = "TOMOG_NTHREAD";
+
+  //! Name of environment variable which can be set to limit the instruction set extensions used
+  const char TOMOG_SIMD[]        = "TOMOG_SIMD";
+
 }
 
 #endif
@@ -0,0 +1,199 @@
+//
+// Blurring and binning of the fine buffers into spectra, the last stage
+// of op and the first of tr.
+//
+
+#include <cmath>
+#include <algorithm>
+#include "trm_subs.h"
+#include "trm_tomog.h"
+
+// Relative cost of an FFT of n points per n*log2(n), compared to one
+// multiply-add of the direct summation. Set by timing the two.
+static const double FFT_COST = 4.;
+
+// Direct summation for blurr_op. Spectrum pixel i is centred on fine pixel
+// ndiv*i and the kernel starts nblurr fine pixels below that. NDIV is the
+// number of fine pixels per spectrum pixel fixed at compile time for the
+// common values so that the indexing reduces to shifts, or 0 to take it
+// from ndiv.
+template <int NDIV>
+static void blurr_direct_op(int ndiv, const float kern[], int nk, int nblurr, int nfine, 
+			    int npixd, const double fine[], float spec[]){
+  if(NDIV) ndiv = NDIV;
+  int d, d1, d2, j;
+  double sum;
+  for(int i=0; i<npixd; i++){
+    j    = ndiv*i - nblurr;
+    d1   = std::max(0, -j);
+    d2   = std::min(nk, nfine-j);
+    sum  = 0.;
+    for(d=d1; d<d2; d++)
+      sum += kern[d]*fine[j+d];
+    spec[i] = sum;
+  }
+}
+
+// Direct summation for blurr_tr. Rather than spreading each spectrum pixel
+// over the fine buffer, each fine pixel gathers the spectrum pixels that
+// reach it, in increasing order as the spreading would add them, so that
+// the sums build up in a register but the result is unchanged.
+template <int NDIV>
+static void blurr_direct_tr(int ndiv, const float kern[], int nk, int nblurr, int nfine, 
+			    int npixd, const float spec[], double fine[]){
+  if(NDIV) ndiv = NDIV;
+  int i, i1, i2, x;
+  double sum;
+  for(int j=0; j<nfine; j++){
+
+    // Spectrum pixels i with 0 <= x - ndiv*i < nk
+    x   = j + nblurr;
+    i1  = x < nk ? 0 : (x - nk)/ndiv + 1;
+    i2  = std::min(npixd, x/ndiv + 1);
+    sum = 0.;
+    for(i=i1; i<i2; i++)
+      sum += kern[x-ndiv*i]*spec[i];
+    fine[j] = sum;
+  }
+}
+
+/** Chooses between FFTs and direct summation for the blurring and binning.
+ * The direct method costs npixd times the kernel length per spectrum (less any part
+ * that overhangs the fine buffer), which becomes
+ * large for wide line profiles combined with high over-sampling, while a pair of FFTs
+ * goes as the buffer size times its logarithm.
+ */
+bool Tomog::Plan::fft_cheaper() const {
+  size_t nfft = 2;
+  while(nfft < size_t(nfine_ + nbkern())) nfft *= 2;
+  return FFT_COST*nfft*log(double(nfft))/log(2.) < double(npixd_)*std::min(nfine_, nbkern());
+}
+
+/** Sets whether the blurring and binning stage is carried out by FFTs or
+ * by direct summation. By default the Plan picks whichever should be faster.
+ * The FFTs are of real arrays at least as long as the fine buffer plus the
+ * kernel, padded with zeroes to a power of 2 to avoid wrap-around. The
+ * transform of the kernel is stored, already normalised for the inverse
+ * transform.
+ * \param fft true for FFTs, false for direct summation
+ */
+void Tomog::Plan::set_fft_blurr(bool fft){
+
+  if(grouped()) gplan_[0].set_fft_blurr(fft);
+  bfft_.clear();
+  if(!fft) return;
+
+  size_t nfft = 2;
+  while(nfft < size_t(nfine_ + nbkern())) nfft *= 2;
+
+  // Spectrum pixel i is centred on fine pixel ndiv*i, so the
+  // kernel is stored as a function of offset from there,
+  // wrapping negative offsets to the end of the array.
+  bfft_.resize(nfft, 0.f);
+  const int nblurr = this->nblurr();
+  for(int d=0; d<nbkern(); d++)
+    bfft_[(nfft + nblurr - d) % nfft] = 2.*bkern_[d]/nfft;
+
+  Subs::fftr(&bfft_[0], nfft, 1);
+}
+
+/** Blurrs and bins the fine buffer of a spectrum, i.e. convolves it with the
+ * line profile and sums each group of ndiv fine pixels.
+ * \param fine the fine buffer, nfine() elements
+ * \param spec the spectrum, npixd() elements
+ * \param work workspace of nfft() elements, only needed for FFTs
+ */
+void Tomog::Plan::blurr_op(const double fine[], float spec[], float work[]) const {
+
+  const int nblurr = this->nblurr();
+  const int nk     = nbkern();
+  int i, j;
+
+  if(fft_blurr()){
+
+    const size_t nfft = bfft_.size();
+    size_t k;
+    for(j=0; j<nfine_; j++) work[j] = fine[j];
+    for(k=nfine_; k<nfft; k++) work[k] = 0.f;
+
+    Subs::fftr(work, nfft, 1);
+
+    // Multiply transforms. First two elements are real.
+    float a, b, c;
+    work[0] *= bfft_[0];
+    work[1] *= bfft_[1];
+    for(k=2; k<nfft; k+=2){
+      a = bfft_[k];
+      b = bfft_[k+1];
+      c = work[k];
+      work[k]   = a*c - b*work[k+1];
+      work[k+1] = a*work[k+1] + b*c;
+    }
+
+    Subs::fftr(work, nfft, -1);
+
+    for(i=0; i<npixd_; i++)
+      spec[i] = work[ndiv_*i];
+
+  }else{
+
+    const float *kern = &bkern_[0];
+    switch(ndiv_){
+    case 1: blurr_direct_op<1>(ndiv_, kern, nk, nblurr, nfine_, npixd_, fine, spec); break;
+    case 2: blurr_direct_op<2>(ndiv_, kern, nk, nblurr, nfine_, npixd_, fine, spec); break;
+    case 4: blurr_direct_op<4>(ndiv_, kern, nk, nblurr, nfine_, npixd_, fine, spec); break;
+    case 8: blurr_direct_op<8>(ndiv_, kern, nk, nblurr, nfine_, npixd_, fine, spec); break;
+    default: blurr_direct_op<0>(ndiv_, kern, nk, nblurr, nfine_, npixd_, fine, spec);
+    }
+  }
+}
+
+/** Transposed version of blurr_op.
+ * \param spec the spectrum, npixd() elements
+ * \param fine the fine buffer, nfine() elements, set on output
+ * \param work workspace of nfft() elements, only needed for FFTs
+ */
+void Tomog::Plan::blurr_tr(const float spec[], double fine[], float work[]) const {
+
+  const int nblurr = this->nblurr();
+  const int nk     = nbkern();
+  int i, j;
+
+  if(fft_blurr()){
+
+    const size_t nfft = bfft_.size();
+    size_t k;
+    for(k=0; k<nfft; k++) work[k] = 0.f;
+    for(i=0; i<npixd_; i++) work[ndiv_*i] = spec[i];
+
+    Subs::fftr(work, nfft, 1);
+
+    // Multiply by the complex conjugate of the kernel transform
+    float a, b, c;
+    work[0] *= bfft_[0];
+    work[1] *= bfft_[1];
+    for(k=2; k<nfft; k+=2){
+      a = bfft_[k];
+      b = bfft_[k+1];
+      c = work[k];
+      work[k]   = a*c + b*work[k+1];
+      work[k+1] = a*work[k+1] - b*c;
+    }
+
+    Subs::fftr(work, nfft, -1);
+
+    for(j=0; j<nfine_; j++)
+      fine[j] = work[j];
+
+  }else{
+
+    const float *kern = &bkern_[0];
+    switch(ndiv_){
+    case 1: blurr_direct_tr<1>(ndiv_, kern, nk, nblurr, nfine_, npixd_, spec, fine); break;
+    case 2: blurr_direct_tr<2>(ndiv_, kern, nk, nblurr, nfine_, npixd_, spec, fine); break;
+    case 4: blurr_direct_tr<4>(ndiv_, kern, nk, nblurr, nfine_, npixd_, spec, fine); break;
+    case 8: blurr_direct_tr<8>(ndiv_, kern, nk, nblurr, nfine_, npixd_, spec, fine); break;
+    default: blurr_direct_tr<0>(ndiv_, kern, nk, nblurr, nfine_, npixd_, spec, fine);
+    }
+  }
+}
@@ -0,0 +1,81 @@
+//
+// Fixed-point projection of rows for reproducible results. Positions are
+// held as 64-bit integers with DDA_BITS bits after the binary point and
+// stepped along each row by integer addition, so they come out the same
+// whatever the machine, compiler or instruction set. The range of pixels
+// within the fine buffer is found exactly by integer division.
+//
+
+#include <cmath>
+#include <algorithm>
+#include "trm_tomog.h"
+#include "tomog_kernels.h"
+
+/** Converts a position or step in fine pixels to fixed point.
+ * \param value the value to convert
+ * \return the value times 2**DDA_BITS, rounded to the nearest integer
+ */
+long long Tomog::dda_fixed(float value){
+  return (long long)(floor(ldexp(double(value), DDA_BITS) + 0.5));
+}
+
+/** Works out the range of pixels along a row that land within the fine buffer
+ * for fixed-point positions.
+ * \param nside number of pixels in the row
+ * \param pos   fixed-point position of the first pixel
+ * \param step  fixed-point step per pixel
+ * \param nfine number of fine pixels
+ * \param x1    first pixel in range (returned)
+ * \param x2    one more than the last pixel in range (returned)
+ */
+void Tomog::dda_clip(size_t nside, long long pos, long long step, int nfine, size_t& x1, size_t& x2){
+
+  const long long top = (long long)(nfine) << DDA_BITS, n = nside;
+  long long lo, hi;
+  if(step == 0){
+    lo = 0;
+    hi = pos >= 0 && pos < top ? n : 0;
+  }else if(step > 0){
+    lo = pos >= 0   ? 0 : (step - 1 - pos)/step;
+    hi = pos >= top ? 0 : (top - pos + step - 1)/step;
+  }else{
+    lo = pos < top ? 0 : (pos - top)/(-step) + 1;
+    hi = pos < 0   ? 0 : pos/(-step) + 1;
+  }
+  x1 = size_t(std::min(lo, n));
+  x2 = size_t(std::max(std::min(hi, n), (long long)(x1)));
+}
+
+/** Fixed-point version of op_row.
+ * \param row   the row
+ * \param nside number of pixels in the row
+ * \param pos   fixed-point position of the first pixel
+ * \param step  fixed-point step per pixel
+ * \param nfine number of fine pixels
+ * \param tfine the fine buffer to add to
+ */
+void Tomog::dda_op_row(const float row[], size_t nside, long long pos, long long step, 
+		       int nfine, double tfine[]){
+  size_t x1, x2;
+  dda_clip(nside, pos, step, nfine, x1, x2);
+  long long p = pos + (long long)(x1)*step;
+  for(size_t xp=x1; xp<x2; xp++, p+=step)
+    tfine[p >> DDA_BITS] += row[xp];
+}
+
+/** Fixed-point version of tr_row, the transpose of dda_op_row.
+ * \param tfine the fine buffer
+ * \param nside number of pixels in the row
+ * \param pos   fixed-point position of the first pixel
+ * \param step  fixed-point step per pixel
+ * \param nfine number of fine pixels
+ * \param row   the row to add to
+ */
+void Tomog::dda_tr_row(const double tfine[], size_t nside, long long pos, long long step, 
+		       int nfine, float row[]){
+  size_t x1, x2;
+  dda_clip(nside, pos, step, nfine, x1, x2);
+  long long p = pos + (long long)(x1)*step;
+  for(size_t xp=x1; xp<x2; xp++, p+=step)
+    row[xp] += tfine[p >> DDA_BITS];
+}
@@ -0,0 +1,168 @@
+//
+// Projection of changes to a few pixels of a map, for fitting models such
+// as spots and discs that only alter a small part of it. Rather than
+// projecting the whole map again, the changes are projected on their own
+// and added to model data already computed from the old map.
+//
+
+#include <algorithm>
+#include <vector>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "trm_tomog.h"
+#include "tomog_kernels.h"
+
+/** Adds the projection of changes to some of the pixels of a map to model
+ * data already computed from it, so that the data become those of the changed
+ * map. The cost goes as the number of changed pixels times the number of
+ * sub-exposures plus the blurring of each spectrum that they reach, rather
+ * than as the number of map pixels times the number of sub-exposures. The
+ * pixels are located in the spectra in the same way as by set_sparse, so the
+ * result differs from projecting the whole of the changed map only through
+ * rounding. Reproducible projections are located exactly as op does. There
+ * is no Fourier-slice version, so PROJ_FOURIER plans are refused rather than
+ * mixing two projections in the same data. Pixels excluded by set_mask are
+ * ignored, as they are by op.
+ * \param plan  the geometry
+ * \param npix  the number of changed pixels
+ * \param pix   the changed pixels as indices into the map, npix elements
+ * \param dval  the changes in their values, npix elements
+ * \param data  the model data to add to, plan.ndata() elements
+ * \param work  workspace
+ */
+void Tomog::op_delta(const Plan& plan, size_t npix, const size_t pix[], const float dval[],
+		     float data[], Workspace& work){
+
+  if(plan.projector() == PROJ_FOURIER)
+    throw Tomog_Error("Tomog::op_delta -- PROJ_FOURIER plans are not supported");
+
+  for(size_t i=0; i<npix; i++)
+    if(pix[i] >= plan.nmap())
+      throw Tomog_Error("Tomog::op_delta -- pixel index out of range");
+
+  // Grouped spectra are projected once per group and added to each member
+  if(plan.grouped()){
+    const Plan& gplan = plan.group_plan();
+    float *gdata = work.get<float>(Workspace::GROUP, gplan.ndata());
+    for(size_t i=0; i<gplan.ndata(); i++) gdata[i] = 0.f;
+    op_delta(gplan, npix, pix, dval, gdata, work);
+    const int npixd = plan.npixd();
+    for(int ns=0; ns<plan.nspec(); ns++){
+      const float *gp = gdata + size_t(npixd)*plan.group(ns);
+      float *dp = data + size_t(npixd)*ns;
+      for(int np=0; np<npixd; np++) dp[np] += gp[np];
+    }
+    return;
+  }
+
+  const int nfine    = plan.nfine();
+  const int npixd    = plan.npixd();
+  const int nspec    = plan.nspec();
+  const size_t nside = plan.nside();
+  const bool foot    = plan.projector() == PROJ_FOOTPRINT;
+  const bool dda     = !foot && plan.reproducible();
+  const long long top = (long long)(nfine) << DDA_BITS;
+
+  // Each thread has a fine buffer, FFT workspace and a spectrum
+  const size_t fstep = Workspace::stride<double>(nfine);
+  const size_t wstep = Workspace::stride<float>(plan.nfft());
+  const size_t sstep = Workspace::stride<float>(npixd);
+  const int nthread = std::max(1, std::min(get_nthread(), nspec));
+  double *fbuff = work.get<double>(Workspace::FINE, nthread*fstep);
+  float  *wbuff = work.get<float>(Workspace::FFT, nthread*(wstep+sstep));
+
+#ifdef _OPENMP
+#pragma omp parallel num_threads(nthread)
+#endif
+  {
+#ifdef _OPENMP
+    const int ithread = omp_get_thread_num();
+#else
+    const int ithread = 0;
+#endif
+    double *fine = fbuff + ithread*fstep;
+    float *bwork = wbuff + ithread*(wstep+sstep);
+    float *spec  = bwork + wstep;
+    std::vector<double> w(1);
+    size_t nim, yp, xp;
+    int j1, nw, k;
+
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+    for(int ns=0; ns<nspec; ns++){
+
+      for(int j=0; j<nfine; j++) fine[j] = 0.;
+      bool hit = false;
+
+      for(int nt=plan.sfirst(ns); nt<plan.sfirst(ns+1); nt++){
+	const float pxscale = plan.pxscale(nt);
+	const float pyscale = plan.pyscale(nt);
+	const double weight = plan.weight(nt);
+	const Footprint footv(pxscale, pyscale);
+	if(foot && int(w.size()) < footv.max_width()) w.resize(footv.max_width());
+
+	for(size_t i=0; i<npix; i++){
+	  if(!plan.live(pix[i])) continue;
+	  nim = pix[i] / (nside*nside);
+	  yp  = pix[i] / nside - nside*nim;
+	  xp  = pix[i] - nside*(pix[i] / nside);
+	  if(dda){
+	    const long long p = dda_fixed(plan.fpcon(nt,nim)) + (long long)(yp)*dda_fixed(pyscale) +
+	      (long long)(xp)*dda_fixed(pxscale);
+	    if(p >= 0 && p < top){
+	      fine[p >> DDA_BITS] += weight*dval[i];
+	      hit = true;
+	    }
+	    continue;
+	  }
+	  const float fpoff = fine_position(plan.fpcon(nt,nim) + float(yp)*pyscale, pxscale, xp);
+	  if(foot){
+	    if((nw = footv.weights(fpoff, nfine, j1, &w[0]))){
+	      for(k=0; k<nw; k++)
+		fine[j1+k] += weight*w[k]*dval[i];
+	      hit = true;
+	    }
+	  }else if(fpoff >= 0.f && fpoff < nfine){
+	    fine[int(fpoff)] += weight*dval[i];
+	    hit = true;
+	  }
+	}
+      }
+
+      // Spectra that none of the pixels reach are left alone
+      if(!hit) continue;
+      plan.blurr_op(fine, spec, bwork);
+      float *dp = data + size_t(npixd)*ns;
+      for(int np=0; np<npixd; np++) dp[np] += spec[np];
+    }
+  }
+}
+
+/** Version of op_delta for changes confined to a rectangular patch of one
+ * image of the map, such as the box around a spot.
+ * \param plan  the geometry
+ * \param nim   the image
+ * \param x1    the X pixel of the bottom-left corner of the patch
+ * \param y1    the Y pixel of the bottom-left corner of the patch
+ * \param nx    the number of pixels of the patch in X
+ * \param ny    the number of pixels of the patch in Y
+ * \param patch the changes in the values of the pixels of the patch, nx*ny elements
+ * with X varying fastest
+ * \param data  the model data to add to, plan.ndata() elements
+ * \param work  workspace
+ */
+void Tomog::op_delta(const Plan& plan, int nim, size_t x1, size_t y1, size_t nx, size_t ny,
+		     const float patch[], float data[], Workspace& work){
+
+  const size_t nside = plan.nside();
+  if(nim < 0 || nim >= plan.nimage() || x1+nx > nside || y1+ny > nside)
+    throw Tomog_Error("Tomog::op_delta -- patch lies outside the map");
+
+  size_t *pix = work.get<size_t>(Workspace::MAP, nx*ny);
+  for(size_t iy=0, i=0; iy<ny; iy++)
+    for(size_t ix=0; ix<nx; ix++, i++)
+      pix[i] = nside*(nside*nim+y1+iy) + x1+ix;
+  op_delta(plan, nx*ny, pix, patch, data, work);
+}
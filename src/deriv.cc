@@ -0,0 +1,177 @@
+//
+// Derivatives of the model data with respect to the zero point and period
+// of the ephemeris and the systemic velocity, for fitting them by gradient
+// methods such as Levenberg-Marquardt rather than by grids of op calls.
+//
+
+#include <algorithm>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "trm_constants.h"
+#include "trm_tomog.h"
+#include "tomog_kernels.h"
+
+// Adds row nr of a map, counting rows through all the images, into the fine
+// buffer of sub-exposure nt, over the runs of pixels left by any mask. The
+// pixels land where they do in op for the usual point projection of single
+// rows, footprints and fixed-point positions.
+static void deriv_row(const Tomog::Plan& plan, int nt, size_t nr, const float row[], double tfine[]){
+  const size_t nside = plan.nside();
+  const size_t nim = nr / nside, yp = nr - nside*nim;
+  const float pxscale = plan.pxscale(nt);
+  const float pyscale = plan.pyscale(nt);
+  const float fpcon = plan.fpcon(nt,nim) + float(yp)*pyscale;
+  size_t x1, x2;
+  for(int nu=0; nu<plan.nrun(nr); nu++){
+    x1 = plan.run_first(nr,nu);
+    x2 = plan.run_last(nr,nu);
+    if(plan.projector() == Tomog::PROJ_FOOTPRINT)
+      Tomog::footprint_op_row(row + x1, x2-x1, fpcon + float(x1)*pxscale, pxscale, pyscale,
+			      plan.nfine(), tfine);
+    else if(plan.reproducible())
+      Tomog::dda_op_row(row + x1, x2-x1, Tomog::dda_fixed(plan.fpcon(nt,nim)) +
+			(long long)(yp)*Tomog::dda_fixed(pyscale) + (long long)(x1)*Tomog::dda_fixed(pxscale),
+			Tomog::dda_fixed(pxscale), plan.nfine(), tfine);
+    else
+      Tomog::op_row(row + x1, x2-x1, fpcon + float(x1)*pxscale, pxscale, plan.nfine(), tfine);
+  }
+}
+
+// Derivative of a fine buffer with respect to fine pixel position by central
+// differences, times a factor, taking the buffer to be zero beyond its ends.
+static void fine_slope(const double fine[], int nfine, double fac, double slope[]){
+  for(int j=0; j<nfine; j++)
+    slope[j] = fac*((j < nfine-1 ? fine[j+1] : 0.) - (j > 0 ? fine[j-1] : 0.))/2.;
+}
+
+/** Computes model data from a map along with their derivatives with respect
+ * to the zero point and period of the ephemeris and a shift of all the
+ * systemic velocities, in a single pass through the map. A map pixel at
+ * fine pixel position p contributes the blurring function centred on p to
+ * each spectrum, so the derivative of the spectrum is minus the slope of
+ * the blurring function times the rate of change of p. For the systemic
+ * velocity that rate is the same for every pixel, and the derivative is
+ * minus the slope of the model spectrum. For the ephemeris, p moves with
+ * orbital phase at a rate that depends upon the pixel's velocity, so the
+ * map is projected a second time with each pixel weighted by dp/dphase into
+ * a second fine buffer per sub-exposure, whose slope is then blurred. The
+ * slopes are taken by central differences on the fine pixels, which the
+ * blurring smooths. The derivatives are those of the smooth model of which
+ * the projection is a sampled version, rather than of the steps that come
+ * from pixels crossing from one fine pixel to the next, which is what
+ * gradient-based fitting needs. Each spectrum is projected with its own
+ * sub-exposures, with pixels located as for a single map in op; the
+ * short-cuts of set_groups, set_mirror and sparse matrices are not used,
+ * and PROJ_FOURIER plans are projected as PROJ_POINT. The cost is two to
+ * three times that of op.
+ * \param plan    the geometry
+ * \param map     the map, plan.nmap() pixels
+ * \param data    the model data, plan.ndata() pixels (returned)
+ * \param dtzero  derivative of the model data with respect to the zero point of the
+ * ephemeris, plan.ndata() pixels (returned). Not computed if NULL.
+ * \param dperiod derivative with respect to the period (returned). Not computed if NULL.
+ * \param dgamma  derivative with respect to the systemic velocities, per km/s (returned).
+ * Not computed if NULL.
+ * \param work    workspace
+ */
+void Tomog::op_deriv(const Plan& plan, const float map[], float data[], float dtzero[],
+		     float dperiod[], float dgamma[], Workspace& work){
+
+  if(plan.period() <= 0.)
+    throw Tomog_Error("Tomog::op_deriv -- the plan has no ephemeris");
+
+  // The row kernels must be chosen before any threads start
+  get_simd();
+
+  const int nfine    = plan.nfine();
+  const int npixd    = plan.npixd();
+  const int nspec    = plan.nspec();
+  const size_t nside = plan.nside();
+  const size_t nrow  = plan.nimage()*nside;
+  const double cen   = (nside-1)/2.;
+  const double pfac  = 1./plan.period();
+  const double gfac  = -plan.ndiv()/double(plan.vpixd());
+
+  // Each thread has five fine buffers: the spectrum, the phase-weighted
+  // spectra for tzero and the period, and one each for the sub-exposures.
+  // It also has FFT workspace and a weighted row of the map.
+  const size_t fstep = Workspace::stride<double>(nfine);
+  const size_t wstep = Workspace::stride<float>(plan.nfft());
+  const size_t rstep = Workspace::stride<float>(nside);
+  const int nthread = std::max(1, std::min(get_nthread(), nspec));
+  double *fbuff = work.get<double>(Workspace::FINE, nthread*5*fstep);
+  float  *wbuff = work.get<float>(Workspace::FFT, nthread*wstep);
+  float  *rbuff = work.get<float>(Workspace::BATCH, nthread*rstep);
+
+#ifdef _OPENMP
+#pragma omp parallel num_threads(nthread)
+#endif
+  {
+#ifdef _OPENMP
+    const int ithread = omp_get_thread_num();
+#else
+    const int ithread = 0;
+#endif
+    double *fine  = fbuff + ithread*5*fstep;
+    double *tfine = fine  + fstep;
+    double *pfine = tfine + fstep;
+    double *sfine = pfine + fstep;
+    double *dfine = sfine + fstep;
+    float  *bwork = wbuff + ithread*wstep;
+    float  *wrow  = rbuff + ithread*rstep;
+    size_t nr, nim, yp, xp;
+    int j;
+
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+    for(int ns=0; ns<nspec; ns++){
+
+      for(j=0; j<nfine; j++) fine[j] = tfine[j] = pfine[j] = 0.;
+
+      for(int nt=plan.sfirst(ns); nt<plan.sfirst(ns+1); nt++){
+
+	// dp/dphase is 2 pi (pyscale (x-c) - pxscale (y-c)) for a pixel at
+	// x, y relative to the centre c of the image
+	const double xfac = Constants::TWOPI*plan.pyscale(nt);
+	const double yfac = Constants::TWOPI*plan.pxscale(nt);
+	for(j=0; j<nfine; j++) sfine[j] = dfine[j] = 0.;
+	for(nr=0; nr<nrow; nr++){
+	  nim = nr / nside;
+	  yp  = nr - nside*nim;
+	  const float *row = map + nside*nr;
+	  const double ydp = yfac*(yp-cen);
+	  for(xp=0; xp<nside; xp++)
+	    wrow[xp] = row[xp]*(xfac*(xp-cen) - ydp);
+	  deriv_row(plan, nt, nr, row, sfine);
+	  deriv_row(plan, nt, nr, wrow, dfine);
+	}
+
+	const double weight = plan.weight(nt), pweight = weight*plan.phase(nt);
+	for(j=0; j<nfine; j++){
+	  fine[j]  += weight*sfine[j];
+	  tfine[j] += weight*dfine[j];
+	  pfine[j] += pweight*dfine[j];
+	}
+      }
+
+      // p changes by -dp/dphase/period per unit tzero and by -phase
+      // times that per unit period
+      const size_t doff = size_t(npixd)*ns;
+      plan.blurr_op(fine, data + doff, bwork);
+      if(dtzero){
+	fine_slope(tfine, nfine, pfac, sfine);
+	plan.blurr_op(sfine, dtzero + doff, bwork);
+      }
+      if(dperiod){
+	fine_slope(pfine, nfine, pfac, sfine);
+	plan.blurr_op(sfine, dperiod + doff, bwork);
+      }
+      if(dgamma){
+	fine_slope(fine, nfine, gfac, sfine);
+	plan.blurr_op(sfine, dgamma + doff, bwork);
+      }
+    }
+  }
+}
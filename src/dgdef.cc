@@ -65,10 +65,12 @@ int main(int argc, char* argv[]){
     std::string outfile;
     input.get_value("output", outfile, "output", "output file");
 
-    float ibuf[map.size()], obuf[map.size()];
+    Tomog::Workspace work;
+    float *ibuf = work.get<float>(Tomog::Workspace::USER,   map.size());
+    float *obuf = work.get<float>(Tomog::Workspace::USER+1, map.size());
     map.get(ibuf);
 
-    Tomog::gaussdef(ibuf,map.nwave(),map.ngamma(),map.nside(), fwhm, gfwhm, obuf);
+    Tomog::gaussdef(ibuf,map.nwave(),map.ngamma(),map.nside(), fwhm, gfwhm, obuf, work);
 
     map.set(obuf);
     map.write(outfile);
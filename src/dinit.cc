@@ -18,7 +18,7 @@ file. Use !!ref{dspot.html}{dspot} to add in features.
 
 !!head2 Invocation
 
-dinit npix vpix wzero ngamma gamma (dgamma) output!!break
+dinit npix vpix wzero ngamma gamma (dgamma) output (gsnap)!!break
 
 !!head2 Arguments
 
@@ -30,6 +30,12 @@ dinit npix vpix wzero ngamma gamma (dgamma) output!!break
 !!arg{ mgamma }{ mean gamma velocity (km/s).}
 !!arg{ dgamma }{ spacing of gamma velocities (km/s) if ngamma > 1.}
 !!arg{ output }{ output file name '-' for standard output.}
+!!arg{ gsnap  }{ if greater than 0 and ngamma > 1, dgamma is rounded to a whole multiple of gsnap
+(km/s). Setting gsnap to the km/s per pixel of the data divided by the over-sampling factor
+ndiv of !!ref{dtmem.html}{dtmem} and the like puts the systemic velocities a whole number of
+fine pixels apart. With snap set in !!ref{dtmem.html}{dtmem}, all the images of a wavelength
+then land in the same pattern of fine pixels, shifted, which the projections compute once for
+all of them. This speeds up maps with many systemic velocities. Hidden parameter, default 0.}
 !!table
 
 !!end
@@ -38,6 +44,7 @@ dinit npix vpix wzero ngamma gamma (dgamma) output!!break
 
 #include <cstdlib>
 #include <cmath>
+#include <algorithm>
 #include <cfloat>
 #include <iostream>
 #include "trm_subs.h"
@@ -61,6 +68,7 @@ int main(int argc, char* argv[]){
     input.sign_in("mgamma",  Subs::Input::LOCAL, Subs::Input::PROMPT);
     input.sign_in("dgamma",  Subs::Input::LOCAL, Subs::Input::PROMPT);
     input.sign_in("output",  Subs::Input::LOCAL, Subs::Input::PROMPT);
+    input.sign_in("gsnap",   Subs::Input::LOCAL, Subs::Input::NOPROMPT);
 
     int nside;
     input.get_value("nside", nside, 100, 1, 2000, "number of pixels on a side of the images");
@@ -75,6 +83,14 @@ int main(int argc, char* argv[]){
     float dgamma;
     if(ngamma > 1)
       input.get_value("dgamma",  dgamma, 50.f, 0.001f, 1000.f, "step size in systemic velocity (km/s)");
+    std::string outfile;
+    input.get_value("output", outfile, "output", "output file");
+    float gsnap;
+    input.get_value("gsnap", gsnap, 0.f, 0.f, 1000.f, "step that dgamma is rounded to a multiple of (km/s), 0 to leave it alone");
+    if(ngamma > 1 && gsnap > 0.f){
+      dgamma = gsnap*std::max(1.f, float(floor(dgamma/gsnap+0.5)));
+      std::cerr << "Systemic velocity step = " << dgamma << " km/s" << std::endl;
+    }
     std::vector<float> gamma(ngamma);
     if(ngamma == 1){
       gamma[0] = mgamma;
@@ -82,8 +98,6 @@ int main(int argc, char* argv[]){
       for(int i=0; i<ngamma; i++)
 	gamma[i] = mgamma+dgamma*(i-(ngamma-1)/2.);
     }
-    std::string outfile;
-    input.get_value("output", outfile, "output", "output file");
 
     // Create uninitialised image, set to zero, dump.
     Dmap dmap(nside,vpix,gamma,wzero);
@@ -0,0 +1,113 @@
+/*
+
+!!begin
+!!title  Mask Doppler images
+!!author T.R.Marsh
+!!created 17 October 2026
+!!root   dmask
+!!index  dmask
+!!descr  Restricts Doppler images to a region of interest
+!!css   style.css
+!!class  Doppler images
+!!class  Inversion
+!!head1  dmask - restricts a Doppler image to a region of interest
+
+dmask attaches a mask to a Doppler image which restricts !!ref{dtmem.html}{dtmem},
+!!ref{dtscl.html}{dtscl} and !!ref{tgen.html}{tgen} to the pixels within it. The
+others take no part in the projections and are not MEM unknowns, saving time and
+memory. The most common use is to leave out the corners of the map beyond the largest
+velocity of the system, which saves about 21% of the work; an annulus to cover the
+velocities of an accretion disc saves more. The mask can also be taken from another
+map of the same format, in which case the pixels where it is positive are kept.
+The pixel values are not changed. The mask is stored at the end of the map file,
+where older versions of the software ignore it.
+
+!!head2 Invocation
+
+dmask input method (vmin vmax)/(mask) output!!break
+
+!!head2 Arguments
+
+!!table
+!!arg{ input  }{ name of Doppler image file.}
+!!arg{ method }{ 'c' for a circle, 'a' for an annulus, 'm' for a mask map, 'n' to remove any mask.}
+!!arg{ vmin   }{ inner radius of the annulus (km/s).}
+!!arg{ vmax   }{ outer radius of the circle or annulus (km/s).}
+!!arg{ mask   }{ Doppler image of the same format as the input, positive for the pixels to keep.}
+!!arg{ output }{ output Doppler image}
+!!table
+
+!!end
+
+*/
+
+#include <cstdlib>
+#include <cfloat>
+#include <cctype>
+#include <algorithm>
+#include <iostream>
+#include "trm_subs.h"
+#include "trm_input.h"
+#include "trm_tomog.h"
+#include "trm_dmap.h"
+
+int main(int argc, char* argv[]){
+
+  try{
+
+    // Construct Input object
+    Subs::Input input(argc, argv, Tomog::TOMOG_ENV, Tomog::TOMOG_DIR);
+
+    // Define inputs
+    input.sign_in("input",  Subs::Input::GLOBAL, Subs::Input::PROMPT);
+    input.sign_in("method", Subs::Input::LOCAL,  Subs::Input::PROMPT);
+    input.sign_in("vmin",   Subs::Input::LOCAL,  Subs::Input::PROMPT);
+    input.sign_in("vmax",   Subs::Input::LOCAL,  Subs::Input::PROMPT);
+    input.sign_in("mask",   Subs::Input::LOCAL,  Subs::Input::PROMPT);
+    input.sign_in("output", Subs::Input::LOCAL,  Subs::Input::PROMPT);
+
+    std::string infile;
+    input.get_value("input",  infile, "input", "input file");
+    Dmap map(infile);
+    char method;
+    input.get_value("method", method, 'c', "cCaAmMnN", "mask type [c(ircle), a(nnulus), m(ap), n(one)]");
+    method = toupper(method);
+    if(method == 'C' || method == 'A'){
+      float vmin = 0.f;
+      if(method == 'A')
+	input.get_value("vmin", vmin, 0.f, 0.f, FLT_MAX, "inner radius of annulus (km/s)");
+      float vmax;
+      input.get_value("vmax", vmax, std::max(vmin, 1000.f), vmin, FLT_MAX, "outer radius (km/s)");
+      map.set_mask(vmin, vmax);
+    }else if(method == 'M'){
+      std::string mfile;
+      input.get_value("mask", mfile, "mask", "mask map, positive for the pixels to keep");
+      Dmap mask(mfile);
+      map.set_mask(mask);
+    }else{
+      map.clear_mask();
+    }
+    std::string outfile;
+    input.get_value("output", outfile, "output", "output file");
+
+    if(map.masked()){
+      int nlive = 0;
+      for(int i=0; i<map.size(); i++)
+	if(map.mask()[i]) nlive++;
+      std::cout << nlive << " out of " << map.size() << " pixels are within the mask" << std::endl;
+    }
+    map.write(outfile);
+  }
+
+  catch(const Dmap::Dmap_Error& err){
+    std::cerr << "Dmap_Error: " << err << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  catch(const std::string& err){
+    std::cerr << "Unrecognised std::string exception: " << err << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  exit(EXIT_SUCCESS);
+}
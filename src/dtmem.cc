@@ -18,6 +18,14 @@ of entropy in the C++ dtom routines. It allows the user to specify a
 number of iterations and a parameter representing the difference in directions
 of the Chi**2 and entropy metrics.
 
+If the map has a mask, as set by !!ref{dmask.html}{dmask}, only the pixels within
+it are reconstructed: the others take no part in the projections and are not MEM
+unknowns, which saves time, e.g. in the corners of the map beyond the largest
+velocity of the system. They are written out unchanged. Similarly data masked
+by negative errors are dropped from the MEM data vector altogether, although the
+normalisation of Chi**2 still counts them so that bootstrapped trails give
+comparable values.
+
 !!head2 Invocation
 
 dtmem map trail niter caim rmax default (blurr) tlim fwhm ndiv tzero period output!!break
@@ -41,6 +49,40 @@ to the X,Y directions (i.e. the images).}
 !!arg{tzero} {zero point of ephemeris}
 !!arg{period}{period of ephemeris}
 !!arg{output}{output Doppler map file}
+!!arg{nthread}{number of threads to use for the projections, 0 for the default
+which is set by the environment variable TOMOG_NTHREAD or failing that by OpenMP.
+Hidden parameter, default 0.}
+!!arg{sparse}{maximum memory (MB) to devote to storing the projections as a sparse
+matrix, which is faster than computing them on the fly for small maps and trails. If
+the matrix would need more than this the projections are computed on the fly as usual.
+0 to disable. Hidden parameter, default 0.}
+!!arg{project}{projection method: 'p' to add each map pixel into the fine pixel containing
+its centre, 'f' to spread it over the fine pixels covered by its footprint. The footprint
+method is exact and gives accurate results with a smaller ndiv, but costs more per pixel.
+'s' projects by Fourier slices, which avoids binning into fine pixels altogether and is
+the fastest for large maps with hundreds of spectra. Hidden parameter, default 'p'.}
+!!arg{smear}{if greater than 0, the number of points per exposure is chosen spectrum by
+spectrum so that no part of the map moves by more than this many pixels from one point
+to the next, up to a maximum of ntdiv, so that short exposures cost less than long ones.
+Hidden parameter, default 0 to use ntdiv points for every exposure.}
+!!arg{dphase}{if 0 or more, spectra whose points all fall at the same orbital phases to within
+this many cycles are projected once for all of them, which saves time when many orbits
+cover the same phases. 0 only groups exact repeats; a small value such as 1.e-4 allows for
+rounding and jitter in the times, at the cost of treating the spectra as if they were at
+the same phase. Hidden parameter, default -1 to project every spectrum.}
+!!arg{mirror}{tolerance in phase (cycles) for pairing spectra half an orbit apart, which are
+then projected together with one pass over the map rather than two, e.g. 0.01. The model
+data are unchanged, but the back-projections differ at the level of rounding. Hidden parameter,
+default -1 to leave the spectra unpaired.}
+!!arg{reproducible}{if true, point projections are carried out in fixed point so that the results
+are the same to the last bit whatever the number of threads, the instruction set or the
+machine, for regression tests. They are a little slower than usual. Hidden parameter,
+default false.}
+!!arg{snap}{if true and the systemic velocities of the map are a whole number of fine pixels
+apart, as !!ref{dinit.html}{dinit} can arrange with gsnap, the images of each wavelength are
+taken to land in the same pattern of fine pixels, shifted, which point projection computes once
+for all of them. This speeds up maps with many systemic velocities, and moves the images by at
+most 0.001 fine pixels. Hidden parameter, default false.}
 !!table
 
 It is possible to specify the same file on output as used for
@@ -55,6 +97,7 @@ be terminated without corrupting the file.
 #include <cstdlib>
 #include <cfloat>
 #include <string>
+#include <vector>
 #include "trm_subs.h"
 #include "trm_input.h"
 #include "trm_tomog.h"
@@ -62,37 +105,52 @@ be terminated without corrupting the file.
 #include "trm_trail.h"
 #include "trm_memsys.h"
 
-// Global variables to get through to opus and tropus
+// Global variables to get through to opus and tropus. The projection 
+// geometry and workspace are set up once and re-used on every call. If
+// the map is masked, the MEM buffers hold only the pixels in use and
+// full holds the whole map for op and tr. Likewise if any data are masked
+// the MEM buffers hold only those with positive errors, whose positions in
+// the trail are listed in dlive, and dfull holds the whole trail.
 namespace Dtom {
-  size_t nside;
-  int ndiv, ntdiv, npixd, nspec;
-  float vpix, vpixd, fwhm;
-  double waved, tzero, period;
-  Subs::Array1D<float> gamma, expose;
-  Subs::Array1D<double> wave, time;
+  Tomog::Plan plan;
+  Tomog::Workspace work;
+  float *full, *dfull;
+  std::vector<size_t> dlive;
 }
 
 void Mem::opus(const int j, const int k){
 
   std::cerr << "    OPUS " << j+1 << " ---> " << k+1 << std::endl;
 
-  Tomog::op(Mem::Gbl::st+Mem::Gbl::kb[j], Dtom::wave, Dtom::gamma, 
-	      Dtom::nside, Dtom::vpix, Dtom::fwhm, Dtom::ndiv, Dtom::ntdiv, 
-	      Dtom::npixd, Dtom::nspec, Dtom::vpixd, Dtom::waved, 
-	      Dtom::time, Dtom::expose, Dtom::tzero, Dtom::period, 
-	      Mem::Gbl::st+Mem::Gbl::kb[k]);
+  const float *map = Mem::Gbl::st+Mem::Gbl::kb[j];
+  float *data = Mem::Gbl::st+Mem::Gbl::kb[k];
+  if(Dtom::plan.masked()){
+    Dtom::plan.unpack(map, Dtom::full);
+    map = Dtom::full;
+  }
+  Tomog::op(Dtom::plan, map, Dtom::dlive.empty() ? data : Dtom::dfull, Dtom::work);
+  for(size_t i=0; i<Dtom::dlive.size(); i++)
+    data[i] = Dtom::dfull[Dtom::dlive[i]];
 }
 
 void Mem::tropus(const int k, const int j){
 
   std::cerr << "  TROPUS " << j+1 << " <--- " << k+1 << std::endl;
   
-  Tomog::tr(Mem::Gbl::st+Mem::Gbl::kb[k], Dtom::wave, Dtom::gamma, 
-	      Dtom::nside, Dtom::vpix, Dtom::fwhm, Dtom::ndiv, Dtom::ntdiv, 
-	      Dtom::npixd, Dtom::nspec, Dtom::vpixd, Dtom::waved, 
-	      Dtom::time, Dtom::expose, Dtom::tzero, Dtom::period, 
-	      Mem::Gbl::st+Mem::Gbl::kb[j]);
- 
+  const float *data = Mem::Gbl::st+Mem::Gbl::kb[k];
+  float *map = Mem::Gbl::st+Mem::Gbl::kb[j];
+  if(!Dtom::dlive.empty()){
+    for(size_t i=0; i<Dtom::plan.ndata(); i++) Dtom::dfull[i] = 0.;
+    for(size_t i=0; i<Dtom::dlive.size(); i++)
+      Dtom::dfull[Dtom::dlive[i]] = data[i];
+    data = Dtom::dfull;
+  }
+  if(Dtom::plan.masked()){
+    Tomog::tr(Dtom::plan, data, Dtom::full, Dtom::work);
+    Dtom::plan.pack(Dtom::full, map);
+  }else{
+    Tomog::tr(Dtom::plan, data, map, Dtom::work);
+  }
 }
 
 int main(int argc, char* argv[]){
@@ -122,6 +180,14 @@ int main(int argc, char* argv[]){
     input.sign_in("tzero",   Subs::Input::GLOBAL, Subs::Input::PROMPT);
     input.sign_in("period",  Subs::Input::GLOBAL, Subs::Input::PROMPT);
     input.sign_in("output",  Subs::Input::LOCAL,  Subs::Input::PROMPT);
+    input.sign_in("nthread", Subs::Input::LOCAL,  Subs::Input::NOPROMPT);
+    input.sign_in("sparse",  Subs::Input::LOCAL,  Subs::Input::NOPROMPT);
+    input.sign_in("project", Subs::Input::LOCAL,  Subs::Input::NOPROMPT);
+    input.sign_in("smear",   Subs::Input::LOCAL,  Subs::Input::NOPROMPT);
+    input.sign_in("dphase",  Subs::Input::LOCAL,  Subs::Input::NOPROMPT);
+    input.sign_in("mirror",  Subs::Input::LOCAL,  Subs::Input::NOPROMPT);
+    input.sign_in("reproducible", Subs::Input::LOCAL,  Subs::Input::NOPROMPT);
+    input.sign_in("snap",    Subs::Input::LOCAL,  Subs::Input::NOPROMPT);
 
     std::string inmap;
     input.get_value("map",   inmap,   "map",   "input Doppler map");
@@ -145,37 +211,98 @@ int main(int argc, char* argv[]){
     }
     float tlim;
     input.get_value("tlim",   tlim, 0.f, 0.0001f, 1.f, "limiting value of 'test' to terminate iterations");
-    input.get_value("fwhm",   Dtom::fwhm, 100.f, 0.0001f, 100000.f, "FWHM of local line profile (km/s)");
-    input.get_value("ndiv",   Dtom::ndiv, 1, 1, 200, "over-sampling factor for map/data computations");
-    input.get_value("ntdiv",  Dtom::ntdiv, 1, 1, 200, "number of points per spectrum to simulate finite exposure times");
-    input.get_value("tzero",  Dtom::tzero, 0.,  -DBL_MAX, DBL_MAX, "zero-crossing time");
-    input.get_value("period", Dtom::period, 0.1, 1.e-6, DBL_MAX, "period");
+    float fwhm;
+    input.get_value("fwhm",   fwhm, 100.f, 0.0001f, 100000.f, "FWHM of local line profile (km/s)");
+    int ndiv;
+    input.get_value("ndiv",   ndiv, 1, 1, 200, "over-sampling factor for map/data computations");
+    int ntdiv;
+    input.get_value("ntdiv",  ntdiv, 1, 1, 200, "number of points per spectrum to simulate finite exposure times");
+    double tzero;
+    input.get_value("tzero",  tzero, 0.,  -DBL_MAX, DBL_MAX, "zero-crossing time");
+    double period;
+    input.get_value("period", period, 0.1, 1.e-6, DBL_MAX, "period");
     std::string outfile;
     input.get_value("output", outfile, "map", "output Doppler map");
+    int nthread;
+    input.get_value("nthread", nthread, 0, 0, 1024, "number of threads (0 for default)");
+    Tomog::set_nthread(nthread);
+    int sparse;
+    input.get_value("sparse", sparse, 0, 0, INT_MAX, "maximum memory for sparse projection matrix (MB)");
+    char project;
+    input.get_value("project", project, 'p', "pPfFsS", "projection method [p(oint), f(ootprint), s(lice)]");
+    project = toupper(project);
+    float smear;
+    input.get_value("smear", smear, 0.f, 0.f, FLT_MAX, "maximum smearing between sub-exposures (pixels), 0 for ntdiv every time");
+    double dphase;
+    input.get_value("dphase", dphase, -1., -1., 0.5, "tolerance in phase for projecting spectra together (cycles), -1 to disable");
+    double mirror;
+    input.get_value("mirror", mirror, -1., -1., 0.5, "tolerance in phase for pairing spectra half a cycle apart (cycles), -1 to disable");
+    bool repro;
+    input.get_value("reproducible", repro, false, "reproducible projections?");
+    bool snap;
+    input.get_value("snap", snap, false, "share fine pixel patterns between systemic velocities?");
     
-    // Create and load buffers for data and model. 
-    Dtom::nside  = map.nside();
-    Dtom::npixd  = trail.npix();
-    Dtom::nspec  = trail.nspec();
+    // Compute projection geometry
+    const Subs::Array1D<int> nsub = Tomog::sub_exposures(trail.expose(), period, map.nside(), smear, ntdiv);
+    Dtom::plan = Tomog::Plan(map.wave(), map.gamma(), map.nside(), map.vpix(), fwhm, 
+			     ndiv, nsub, trail.npix(), trail.nspec(), trail.vpix(), 
+			     trail.wzero(), trail.time(), trail.expose(), tzero, period);
+    if(project == 'F') Dtom::plan.set_projector(Tomog::PROJ_FOOTPRINT);
+    else if(project == 'S') Dtom::plan.set_projector(Tomog::PROJ_FOURIER);
+    if(dphase >= 0.)
+      std::cerr << "Number of distinct spectrum geometries = " << Dtom::plan.set_groups(dphase) << std::endl;
+    Dtom::plan.set_mirror(mirror);
+    Dtom::plan.set_reproducible(repro);
+    if(snap && !Dtom::plan.set_snap(true))
+      std::cerr << "The systemic velocities are not a whole number of fine pixels apart" << std::endl;
+    Dtom::plan.set_mask(map.mask());
+    if(map.masked())
+      std::cerr << "Number of map pixels within the mask = " << Dtom::plan.nlive() 
+		<< " out of " << map.size() << std::endl;
+    if(smear > 0.f)
+      std::cerr << "Average number of points per exposure = " 
+		<< float(Dtom::plan.nsub())/trail.nspec() << std::endl;
+    if(sparse){
+      if(Dtom::plan.set_sparse(size_t(sparse)*1024*1024))
+	std::cerr << "Projections will be carried out with a sparse matrix" << std::endl;
+      else
+	std::cerr << "Sparse projection matrix would need more than " << sparse 
+		  << " MB; projections will be computed on the fly" << std::endl;
+    }
+    Dtom::work.reserve(Dtom::plan);
+
+    // Load the data and find those that are masked by negative errors
+    const int ntot = trail.size();
+    Dtom::dfull = Dtom::work.get<float>(Tomog::Workspace::USER+1, ntot);
+    float *derr = Dtom::work.get<float>(Tomog::Workspace::USER+2, ntot);
+    trail.get_data(Dtom::dfull);
+    trail.get_error(derr);
+    for(int i = 0; i < ntot; i++)
+      if(derr[i] > 0.) Dtom::dlive.push_back(i);
+    if(int(Dtom::dlive.size()) == ntot){
+      Dtom::dlive.clear();
+    }else{
+      std::cerr << "Number of unmasked data = " << Dtom::dlive.size() 
+		<< " out of " << ntot << std::endl;
+    }
 
-    int ndat = trail.size();
-    int nmod = map.size();
+    // Create and load buffers for data and model. Only the pixels
+    // within any mask and the unmasked data take part.
+    int ndat = Dtom::dlive.empty() ? ntot : Dtom::dlive.size();
+    int nmod = Dtom::plan.nlive();
 
     // Generate mem buffer pointers
     Mem::memcore(MXBUFF,nmod,ndat);
 
-    Dtom::wave   = map.wave();
-    Dtom::gamma  = map.gamma();
-    Dtom::vpix   = map.vpix();
-    Dtom::vpixd  = trail.vpix();
-    Dtom::waved  = trail.wzero();
-    Dtom::time   = trail.time();
-    Dtom::expose = trail.expose();
-
     // Transfer data to mem buffer
-    map.get(Mem::Gbl::st+Mem::Gbl::kb[0]);
-    trail.get_data(Mem::Gbl::st+Mem::Gbl::kb[20]);
-    trail.get_error(Mem::Gbl::st+Mem::Gbl::kb[21]);
+    Dtom::full = Dtom::work.get<float>(Tomog::Workspace::USER, map.size());
+    map.get(Dtom::full);
+    Dtom::plan.pack(Dtom::full, Mem::Gbl::st+Mem::Gbl::kb[0]);
+    for(int i = 0; i < ndat; i++){
+      const int n = Dtom::dlive.empty() ? i : Dtom::dlive[i];
+      Mem::Gbl::st[Mem::Gbl::kb[20]+i] = Dtom::dfull[n];
+      Mem::Gbl::st[Mem::Gbl::kb[21]+i] = derr[n];
+    }
 
     for(int i = 0; i < nmod; i++){
       if(Mem::Gbl::st[Mem::Gbl::kb[0]+i] <= 0.){
@@ -185,16 +312,29 @@ int main(int argc, char* argv[]){
       }
     }
 
-    // note that we divide by the number of data points
+    // note that we divide by the total number of data points
     // even though many may be masked. this is to ensure
     // bootstrapping works
 
     for(int i = 0; i < ndat; i++){
       if(Mem::Gbl::st[Mem::Gbl::kb[21]+i] > 0.)
 	Mem::Gbl::st[Mem::Gbl::kb[21]+i] = 
-	  2./Subs::sqr(Mem::Gbl::st[Mem::Gbl::kb[21]+i])/ndat;
+	  2./Subs::sqr(Mem::Gbl::st[Mem::Gbl::kb[21]+i])/ntot;
     }    
 
+    // With a mask, the gaussian default is the blurred map divided by the
+    // blurred mask, so that the pixels left out do not drag down the
+    // default near the edge of the mask.
+    float *gmap = NULL, *gdef = NULL, *gnorm = NULL;
+    if(def == 'G' && map.masked()){
+      gmap  = Dtom::work.get<float>(Tomog::Workspace::USER+3, map.size());
+      gdef  = Dtom::work.get<float>(Tomog::Workspace::USER+4, map.size());
+      gnorm = Dtom::work.get<float>(Tomog::Workspace::USER+5, nmod);
+      for(int i=0; i<map.size(); i++) gmap[i] = map.mask()[i] ? 1. : 0.;
+      Tomog::gaussdef(gmap,map.nwave(),map.ngamma(),map.nside(),blurr,gblurr,gdef,Dtom::work);
+      Dtom::plan.pack(gdef, gnorm);
+    }
+
     float c, test, acc=1., cnew, s, rnew, snew, sumf;
     int mode;
     if(def == 'U'){
@@ -208,16 +348,27 @@ int main(int argc, char* argv[]){
       std::cerr << "\nIteration " << it+1 << std::endl;
       if(def == 'G'){
 	std::cerr << "Computing gaussian default ..." << std::endl;
-	Tomog::gaussdef(Mem::Gbl::st+Mem::Gbl::kb[0],map.nwave(),map.ngamma(),
-			  Dtom::nside,blurr,gblurr,Mem::Gbl::st+Mem::Gbl::kb[19]);
+	if(map.masked()){
+	  for(int i=0; i<map.size(); i++) gmap[i] = 0.;
+	  Dtom::plan.unpack(Mem::Gbl::st+Mem::Gbl::kb[0], gmap);
+	  Tomog::gaussdef(gmap,map.nwave(),map.ngamma(),map.nside(),blurr,gblurr,gdef,Dtom::work);
+	  Dtom::plan.pack(gdef, Mem::Gbl::st+Mem::Gbl::kb[19]);
+	  for(int i=0; i<nmod; i++) Mem::Gbl::st[Mem::Gbl::kb[19]+i] /= gnorm[i];
+	}else{
+	  Tomog::gaussdef(Mem::Gbl::st+Mem::Gbl::kb[0],map.nwave(),map.ngamma(),
+			  map.nside(),blurr,gblurr,Mem::Gbl::st+Mem::Gbl::kb[19],Dtom::work);
+	}
       }
       Mem::memprm(mode,20,caim,rmax,1.,acc,c,test,cnew,s,rnew,snew,sumf);
       if(test < tlim && c <= caim) break;
     }
 
-    // transfer and write out map
+    // transfer and write out map, leaving any pixels outside the mask
+    // as they were
 
-    map.set(Mem::Gbl::st+Mem::Gbl::kb[0]);
+    map.get(Dtom::full);
+    Dtom::plan.unpack(Mem::Gbl::st+Mem::Gbl::kb[0], Dtom::full);
+    map.set(Dtom::full);
     map.write(outfile);
 
     // Clear 
@@ -15,7 +15,8 @@
 !!emph{dtscl} takes an image and a trailed spectrum and scales the
 image to minimise the chi**2 relative to the data. This is
 a simple overall scaling; at some point I will need to optimise
-different lines separately.
+different lines separately. If the map has a mask (see !!ref{dmask.html}{dmask}),
+only the pixels within it contribute to the model.
 
 !!head2 Invocation
 
@@ -32,6 +33,17 @@ dtscl map trail fwhm ndiv tzero period output!!break
 !!arg{ tzero  }{ ephemeris zero-point.}
 !!arg{ period }{ orbital period.}
 !!arg{ output }{ output scaled image.}
+!!arg{ project}{projection method, as in !!ref{dtmem.html}{dtmem}. Hidden parameter, default 'p'.}
+!!arg{ smear  }{smearing tolerance (pixels) for choosing the number of points per exposure, as in
+!!ref{dtmem.html}{dtmem}. Hidden parameter, default 0 to use ntdiv points for every exposure.}
+!!arg{ dphase }{tolerance in phase (cycles) for projecting spectra at the same phases once, as in
+!!ref{dtmem.html}{dtmem}. Hidden parameter, default -1 to project every spectrum.}
+!!arg{ mirror }{tolerance in phase (cycles) for pairing spectra half an orbit apart, as in
+!!ref{dtmem.html}{dtmem}. Hidden parameter, default -1 to leave the spectra unpaired.}
+!!arg{reproducible}{if true, point projections give the same bits on any machine, as in
+!!ref{dtmem.html}{dtmem}. Hidden parameter, default false.}
+!!arg{ snap   }{if true, systemic velocities a whole number of fine pixels apart share their pattern
+of fine pixels, as in !!ref{dtmem.html}{dtmem}. Hidden parameter, default false.}
 !!table
 
 !!end
@@ -62,6 +74,12 @@ int main(int argc, char* argv[]){
     input.sign_in("tzero",   Subs::Input::GLOBAL, Subs::Input::PROMPT);
     input.sign_in("period",  Subs::Input::GLOBAL, Subs::Input::PROMPT);
     input.sign_in("output",  Subs::Input::LOCAL,  Subs::Input::PROMPT);
+    input.sign_in("project", Subs::Input::LOCAL,  Subs::Input::NOPROMPT);
+    input.sign_in("smear",   Subs::Input::LOCAL,  Subs::Input::NOPROMPT);
+    input.sign_in("dphase",  Subs::Input::LOCAL,  Subs::Input::NOPROMPT);
+    input.sign_in("mirror",  Subs::Input::LOCAL,  Subs::Input::NOPROMPT);
+    input.sign_in("reproducible", Subs::Input::LOCAL,  Subs::Input::NOPROMPT);
+    input.sign_in("snap",    Subs::Input::LOCAL,  Subs::Input::NOPROMPT);
 
     std::string inmap;
     input.get_value("map",   inmap,   "map",   "input Doppler map");
@@ -81,6 +99,19 @@ int main(int argc, char* argv[]){
     input.get_value("period", period, 0.1, 1.e-6, DBL_MAX, "period");
     std::string outfile;
     input.get_value("output", outfile, "map", "output Doppler map");
+    char project;
+    input.get_value("project", project, 'p', "pPfFsS", "projection method [p(oint), f(ootprint), s(lice)]");
+    project = toupper(project);
+    float smear;
+    input.get_value("smear", smear, 0.f, 0.f, FLT_MAX, "maximum smearing between sub-exposures (pixels), 0 for ntdiv every time");
+    double dphase;
+    input.get_value("dphase", dphase, -1., -1., 0.5, "tolerance in phase for projecting spectra together (cycles), -1 to disable");
+    double mirror;
+    input.get_value("mirror", mirror, -1., -1., 0.5, "tolerance in phase for pairing spectra half a cycle apart (cycles), -1 to disable");
+    bool repro;
+    input.get_value("reproducible", repro, false, "reproducible projections?");
+    bool snap;
+    input.get_value("snap", snap, false, "share fine pixel patterns between systemic velocities?");
 
     // Create and load buffers for data and model. 
 
@@ -90,19 +121,28 @@ int main(int argc, char* argv[]){
     float   vpixd  = trail.vpix();
     double  wzerod = trail.wzero();
 
-    float model[dmap.size()];
+    const Subs::Array1D<int> nsub = Tomog::sub_exposures(trail.expose(), period, dmap.nside(), smear, ntdiv);
+    Tomog::Plan plan(dmap.wave(), dmap.gamma(), dmap.nside(), vpix, fwhm, ndiv, nsub, 
+		     npixd, nspec, vpixd, wzerod, trail.time(), trail.expose(), tzero, period);
+    if(project == 'F') plan.set_projector(Tomog::PROJ_FOOTPRINT);
+    else if(project == 'S') plan.set_projector(Tomog::PROJ_FOURIER);
+    if(dphase >= 0.)
+      std::cerr << "Number of distinct spectrum geometries = " << plan.set_groups(dphase) << std::endl;
+    plan.set_mirror(mirror);
+    plan.set_reproducible(repro);
+    plan.set_snap(snap);
+    plan.set_mask(dmap.mask());
+    Tomog::Workspace work(plan);
+
+    float *model = work.get<float>(Tomog::Workspace::USER, dmap.size());
     dmap.get(model);
-    Subs::Array1D<float>  gamma  = dmap.gamma();
-    Subs::Array1D<double> wave   = dmap.wave();
-    Subs::Array1D<double> time   = trail.time();
-    Subs::Array1D<float>  expose = trail.expose();
-
-    size_t ndat       = trail.size();
-    float data[ndat], errors[ndat], calc[ndat];
-    size_t nside = dmap.nside();
+
+    size_t ndat   = trail.size();
+    float *data   = work.get<float>(Tomog::Workspace::USER+1, ndat);
+    float *errors = work.get<float>(Tomog::Workspace::USER+2, ndat);
+    float *calc   = work.get<float>(Tomog::Workspace::USER+3, ndat);
  
-    Tomog::op(model, wave, gamma, nside, vpix, fwhm, ndiv, ntdiv, npixd, 
-		nspec, vpixd, wzerod, time, expose, tzero, period, calc);
+    Tomog::op(plan, model, calc, work);
 
     trail.get_data(data);
     trail.get_error(errors);
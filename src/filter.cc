@@ -0,0 +1,110 @@
+//
+// The filter of filtered back-projection, as applied by tfilt and tfbp
+//
+
+#include <cmath>
+#include <algorithm>
+#include <vector>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "trm_subs.h"
+#include "trm_constants.h"
+#include "trm_tomog.h"
+
+/** Applies the filter part of filtered back-projection to a set of spectra.
+ * This consists of a part rising linearly with frequency times a gaussian
+ * window for suppressing noise. The spectra are filtered independently, in
+ * parallel, with the number of threads set by set_nthread.
+ * \param data  the spectra, one after the other, replaced by their filtered versions
+ * \param npix  number of pixels per spectrum
+ * \param nspec number of spectra
+ * \param fwhm  FWHM of the gaussian window in cycles/pixel, in which units
+ * the Nyquist frequency is 0.5
+ */
+void Tomog::fbp_filter(float data[], int npix, int nspec, float fwhm){
+
+  const int nmin = int(floor(pow(2,ceil(log(float(2*npix-1))/log(2.)))+0.1));
+  const int ntot = 2*nmin;
+
+  const float PI2  = -1./Subs::sqr(Constants::PI);
+  const float efac =  Subs::sqr(Constants::EFAC/fwhm)/2.;
+
+  // Set convolving function which is FT of ABS(S) truncated at
+  // Nyquist frequency and sampled onto same period as data.
+  // This has values 0.25 for zero frequency, 0 for
+  // all even frequencies and -1/pi**2/k**2 for all odd k.
+  // It is a real array. The maximum lag is npix-1.
+  // Note that the more obvious direct implementation is
+  // avoided because of Rowland's work
+  std::vector<float> filter(ntot, 0.f);
+  filter[0] = 0.25;
+  int i2;
+  for(int ix = 1; ix < npix; ix++){
+    i2 = 2*ix;
+    filter[i2]      = ix % 2 ? PI2/(ix*ix) : 0.; // +ve lag
+    filter[ntot-i2] = filter[i2];                // -ve lag
+  }
+
+  // FFT of convolving function to get filter function
+  Subs::fft(&filter[0], ntot, 1);
+
+  // Fold in Gaussian window function. The filter is real and symmetrical
+  // so most of it is ignored
+  float x;
+  for(int ix = 1; ix <= nmin/2; ix++){
+    i2 = 2*ix;
+    x  = i2/float(nmin);
+    filter[i2] *= exp(-efac*x*x);
+  }
+
+  const int nthread = std::max(1, std::min(get_nthread(), nspec));
+
+#ifdef _OPENMP
+#pragma omp parallel num_threads(nthread)
+#endif
+  {
+    std::vector<float> buff(ntot);
+    float *dbuff = &buff[0];
+    float fac;
+    int ix, i2;
+
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+    for(int ns = 0; ns < nspec; ns++){
+
+      // Transfer data, pad with zeroes and FFT
+      float *spec = data + size_t(npix)*ns;
+      for(ix = 0; ix < npix; ix++){
+	dbuff[2*ix]   = spec[ix];
+	dbuff[2*ix+1] = 0.;
+      }
+      for(ix = 2*npix; ix < ntot; ix++) dbuff[ix] = 0.;
+
+      Subs::fft(dbuff, ntot, 1);
+
+      // Apply filter (which is real and symmetric) with gaussian
+      // window function, then inverse fft. First deal with zero and
+      // Nyquist frequencies
+      dbuff[0]      *= filter[0];
+      dbuff[1]      *= filter[0];
+      dbuff[nmin]   *= filter[nmin];
+      dbuff[nmin+1] *= filter[nmin];
+
+      for(ix = 1; ix < nmin/2; ix++){
+	i2    = 2*ix;
+	fac   = filter[i2];
+	dbuff[i2]        *= fac;
+	dbuff[i2+1]      *= fac;
+	dbuff[ntot-i2]   *= fac;
+	dbuff[ntot-i2+1] *= fac;
+      }
+      Subs::fft(dbuff, ntot, -1);
+
+      // transfer data back
+      for(ix = 0; ix < npix; ix++)
+	spec[ix] = dbuff[2*ix]/nmin;
+    }
+  }
+}
@@ -0,0 +1,144 @@
+//
+// Exact pixel footprint projection. Rather than dropping each map pixel
+// into the fine pixel containing its centre, its square outline is
+// projected onto the velocity axis, which gives a trapezoid, and this is
+// integrated over each fine pixel that it overlaps.
+//
+
+#include <cmath>
+#include <algorithm>
+#include <vector>
+#include "trm_tomog.h"
+#include "tomog_kernels.h"
+
+// Below this fraction of the larger side, the smaller side of a
+// trapezoid is treated as zero.
+static const double FOOTPRINT_EPS = 1.e-5;
+
+// Size of the weight buffers of the row routines, above which
+// they have to allocate memory.
+static const int WBUFF = 64;
+
+// Cumulative integral of a trapezoid of unit area centred on 0, made by
+// convolving boxcars of widths a >= b, evaluated at u. s = (a+b)/2,
+// d = (a-b)/2, f = 1/(2ab).
+static inline double trap_cdf(double u, double s, double d, double f){
+  double sum = 0., t;
+  if((t = u + s) > 0.) sum += t*t;
+  if((t = u + d) > 0.) sum -= t*t;
+  if((t = u - d) > 0.) sum -= t*t;
+  if((t = u - s) > 0.) sum += t*t;
+  return f*sum;
+}
+
+/** Sets up the footprint of map pixels for a given projection.
+ * \param pxscale fine pixel step per map pixel in X
+ * \param pyscale fine pixel step per map pixel in Y
+ */
+Tomog::Footprint::Footprint(float pxscale, float pyscale){
+  a_ = std::max(fabs(pxscale), fabs(pyscale));
+  b_ = std::min(fabs(pxscale), fabs(pyscale));
+  if(b_ < FOOTPRINT_EPS*a_) b_ = 0.;
+  s_ = (a_+b_)/2.;
+  d_ = (a_-b_)/2.;
+  f_ = b_ > 0. ? 1./(2.*a_*b_) : 0.;
+}
+
+/** Computes the fraction of a map pixel's footprint falling in each fine pixel.
+ * Fine pixel j runs from j to j+1 in the same units as the position. Only fine
+ * pixels from 0 to nfine-1 are included.
+ * \param p      the position of the centre of the pixel
+ * \param nfine  number of fine pixels
+ * \param j1     the first fine pixel (returned)
+ * \param w      the fractions, max_width() elements (returned)
+ * \return the number of fine pixels, 0 if the footprint misses the buffer
+ */
+int Tomog::Footprint::weights(double p, int nfine, int& j1, double w[]) const {
+
+  const double lo = p - s_, hi = p + s_;
+  if(hi <= 0. || lo >= nfine) return 0;
+
+  j1 = std::max(0, int(floor(lo)));
+  const int j2 = std::min(nfine-1, int(floor(hi)));
+
+  // Integrate by differencing the cumulative integral at the
+  // edges of the fine pixels
+  double c1 = cdf(j1 - p), c2;
+  for(int j=j1; j<=j2; j++){
+    c2 = cdf(j + 1 - p);
+    w[j-j1] = c2 - c1;
+    c1 = c2;
+  }
+  return j2-j1+1;
+}
+
+/** Cumulative integral of the footprint of a pixel centred on 0
+ * \param u the position
+ */
+double Tomog::Footprint::cdf(double u) const {
+  if(f_ > 0.) return trap_cdf(u, s_, d_, f_);
+  if(a_ > 0.) return std::min(1., std::max(0., (u+s_)/a_));
+  return u >= 0. ? 1. : 0.;
+}
+
+/** Footprint version of op_row. Adds the pixels of one row of a map into the
+ * fine pixels that their footprints overlap.
+ * \param row     the row
+ * \param nside   number of pixels in the row
+ * \param fpcon   fine pixel position of the first pixel
+ * \param pxscale fine pixel step per pixel in X
+ * \param pyscale fine pixel step per pixel in Y
+ * \param nfine   number of fine pixels
+ * \param tfine   the fine buffer to add to
+ */
+void Tomog::footprint_op_row(const float row[], size_t nside, float fpcon, float pxscale,
+			     float pyscale, int nfine, double tfine[]){
+
+  const Footprint foot(pxscale, pyscale);
+  double wbuff[WBUFF], *w = wbuff;
+  std::vector<double> wvec;
+  if(foot.max_width() > WBUFF){
+    wvec.resize(foot.max_width());
+    w = &wvec[0];
+  }
+  int j1, nw, k;
+  double val;
+  for(size_t xp=0; xp<nside; xp++){
+    if((nw = foot.weights(fine_position(fpcon, pxscale, xp), nfine, j1, w))){
+      val = row[xp];
+      for(k=0; k<nw; k++)
+	tfine[j1+k] += w[k]*val;
+    }
+  }
+}
+
+/** Footprint version of tr_row, the transpose of footprint_op_row.
+ * \param tfine   the fine buffer
+ * \param nside   number of pixels in the row
+ * \param fpcon   fine pixel position of the first pixel
+ * \param pxscale fine pixel step per pixel in X
+ * \param pyscale fine pixel step per pixel in Y
+ * \param nfine   number of fine pixels
+ * \param row     the row to add to
+ */
+void Tomog::footprint_tr_row(const double tfine[], size_t nside, float fpcon, float pxscale,
+			     float pyscale, int nfine, float row[]){
+
+  const Footprint foot(pxscale, pyscale);
+  double wbuff[WBUFF], *w = wbuff;
+  std::vector<double> wvec;
+  if(foot.max_width() > WBUFF){
+    wvec.resize(foot.max_width());
+    w = &wvec[0];
+  }
+  int j1, nw, k;
+  double sum;
+  for(size_t xp=0; xp<nside; xp++){
+    if((nw = foot.weights(fine_position(fpcon, pxscale, xp), nfine, j1, w))){
+      sum = 0.;
+      for(k=0; k<nw; k++)
+	sum += w[k]*tfine[j1+k];
+      row[xp] += sum;
+    }
+  }
+}
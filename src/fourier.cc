@@ -0,0 +1,531 @@
+//
+// Fourier-slice projection. By the projection-slice theorem, the Fourier
+// transform of the projection of an image at a given orbital phase is the
+// 2D transform of the image along a line through the origin at the same
+// angle. op transforms each image once, interpolates each sub-exposure's
+// line from it, multiplies by the transform of the line profile and binning
+// and transforms back. tr reverses each step, gridding the lines onto the
+// 2D transform. The interpolation and gridding are those of the non-uniform
+// FFT, with a Kaiser-Bessel kernel on a grid over-sampled by a factor of 2.
+//
+// Positions along the spectra are measured in fine pixels as for the other
+// projections, so pixel (x,y) of image nim projects to
+// p = fpcon + x*pxscale + y*pyscale and data pixel i is the integral of the
+// projection times the line profile over p from ndiv*i to ndiv*(i+1).
+//
+
+#include <cmath>
+#include <algorithm>
+#include <vector>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "trm_subs.h"
+#include "trm_constants.h"
+#include "trm_tomog.h"
+
+// Over-sampling of the 2D transforms and width of the gridding kernel
+// in grid points, which between them set the relative accuracy of the
+// interpolation at about 1e-5.
+static const int FOURIER_OVER  = 2;
+static const int FOURIER_WIDTH = 6;
+
+// Number of points per grid point in the table of the gridding kernel
+static const int FOURIER_NTAB = 2048;
+
+// Level relative to its peak beyond which the transform of the line
+// profile is taken to be zero
+static const double FOURIER_EPS = 1.e-6;
+
+// Finest sampling of the 1D transforms in fine pixels, which only
+// matters for line profiles narrower than this.
+static const double FOURIER_HMIN = 0.25;
+
+// Modified Bessel function of order 0
+static double bessel_i0(double x){
+  const double y = x*x/4.;
+  double sum = 1., term = 1.;
+  for(int k=1; term > 1.e-17*sum; k++){
+    term *= y/(double(k)*k);
+    sum  += term;
+  }
+  return sum;
+}
+
+// Sign to give Subs::fft for a transform with a positive exponent,
+// found by transforming a spike.
+static int fft_sign(){
+  float test[8] = {0., 0., 1., 0., 0., 0., 0., 0.};
+  Subs::fft(test, 8, 1);
+  return test[3] > 0. ? 1 : -1;
+}
+
+/** Sets up the Fourier-slice projection. The 2D transforms are over-sampled
+ * by FOURIER_OVER and the images are centred in them, with the deapodisation
+ * of the gridding kernel applied to the pixels. The 1D transforms sample the
+ * spectra at fos_ points per data pixel, enough that the transform of the line
+ * profile is negligible beyond their Nyquist frequency, and are long enough
+ * that light wrapping around from either end cannot reach the spectra.
+ */
+void Tomog::Plan::set_fourier(){
+
+  const int W = FOURIER_WIDTH;
+  const double over = FOURIER_OVER;
+  const double beta = Constants::PI*sqrt(Subs::sqr(W/over*(over-0.5)) - 0.8);
+  const double norm = bessel_i0(beta);
+
+  fsign_ = fft_sign();
+
+  fgrid_ = 2;
+  while(fgrid_ < FOURIER_OVER*nside_) fgrid_ *= 2;
+
+  // Kernel against distance in grid points, zero at the edge
+  const int ntab = W*FOURIER_NTAB/2 + 2;
+  fkern_.resize(ntab);
+  for(int k=0; k<ntab; k++){
+    const double d = 2.*k/FOURIER_NTAB/W;
+    fkern_[k] = d < 1. ? bessel_i0(beta*sqrt(1.-d*d))/norm : 0.;
+  }
+
+  // Deapodisation, the inverse of the kernel's transform
+  const int nc = nside_/2;
+  fdeap_.resize(nside_);
+  for(size_t x=0; x<nside_; x++){
+    const double a = Constants::PI*W*(double(x)-nc)/fgrid_;
+    const double z2 = beta*beta - a*a;
+    double ft = W;
+    if(z2 > 0.)
+      ft = W*sinh(sqrt(z2))/sqrt(z2);
+    else if(z2 < 0.)
+      ft = W*sin(sqrt(-z2))/sqrt(-z2);
+    fdeap_[x] = norm/ft;
+  }
+
+  set_fourier_line();
+}
+
+/** Sets up the 1D transforms of the Fourier-slice projection, whose length
+ * depends upon where the images land and so has to be found again when their
+ * offsets change, unlike the 2D tables of set_fourier.
+ */
+void Tomog::Plan::set_fourier_line(){
+
+  // Sampling of the spectra and extent of the transform of the line profile
+  const double gcut = sqrt(2.*log(1./FOURIER_EPS));
+  const double h = std::max(FOURIER_HMIN, Constants::PI*sigma_/gcut);
+  fos_ = int(ceil(ndiv_/h));
+  const double step = double(ndiv_)/fos_;
+
+  // Range of positions over which the spectra have any light
+  double pmin = 0., pmax = nfine_;
+  for(int nt=0; nt<nsub(); nt++){
+    const double xext = (nside_-1)*double(pxscale_[nt]);
+    const double yext = (nside_-1)*double(pyscale_[nt]);
+    for(int nim=0; nim<nimage(); nim++){
+      pmin = std::min(pmin, fpcon(nt,nim) + std::min(0.,xext) + std::min(0.,yext) - ndiv_ - gcut*sigma_);
+      pmax = std::max(pmax, fpcon(nt,nim) + std::max(0.,xext) + std::max(0.,yext) + gcut*sigma_);
+    }
+  }
+  fline_ = 2;
+  while(fline_*step < pmax - pmin) fline_ *= 2;
+  flen_ = fline_*step;
+
+  // Transform of the line profile and binning at each frequency n/flen_, with the
+  // factors of the inverse transform folded in. Frequencies from 1 up stand
+  // for their negatives too, and so count twice.
+  const double kcut = gcut/(Constants::TWOPI*std::max(sigma_, 1.e-30f));
+  const int nk = int(std::min(double(fline_/2), floor(kcut*flen_)+1));
+  fwfac_.resize(2*nk);
+  for(int n=0; n<nk; n++){
+    const double k = n/flen_, kd = k*ndiv_;
+    const double sinc = n ? sin(Constants::PI*kd)/(Constants::PI*kd) : 1.;
+    const double amp = (n ? 2. : 1.)/flen_*exp(-2.*Subs::sqr(Constants::PI*sigma_*k))*ndiv_*sinc;
+    fwfac_[2*n]   = amp*cos(Constants::PI*kd);
+    fwfac_[2*n+1] = amp*sin(Constants::PI*kd);
+  }
+}
+
+// Weights of the gridding kernel for a point at grid position g. Returns the
+// first of the FOURIER_WIDTH grid points covered.
+static inline int grid_weights(const float kern[], double g, double w[]){
+  const int q1 = int(floor(g - FOURIER_WIDTH/2.)) + 1;
+  double d, f;
+  int k;
+  for(int i=0; i<FOURIER_WIDTH; i++){
+    d = fabs(g - (q1+i))*FOURIER_NTAB;
+    k = int(d);
+    f = d - k;
+    w[i] = kern[k] + f*(kern[k+1]-kern[k]);
+  }
+  return q1;
+}
+
+// Interval at which the phase factors of the shifts are recomputed
+// directly rather than by recurrence
+static const int FOURIER_SEED = 64;
+
+// Phase factors exp(2*pi*i*sign*shift*n/flen) for successive n. The
+// recurrence is re-seeded every FOURIER_SEED steps, from the same n
+// whatever n it starts at, so the factors do not depend upon which
+// thread computes them or where it starts.
+class Rotation {
+public:
+  Rotation(double shift, double flen, int sign) : 
+    f_(shift/flen), sign_(sign), c_(cos(Constants::TWOPI*f_)), s_(sign*sin(Constants::TWOPI*f_)) {}
+
+  // Starts at frequency n
+  void start(int n){
+    for(n_ = n - n % FOURIER_SEED, seed(); n_ < n; ) next();
+  }
+
+  // Moves on to the next frequency
+  void next(){
+    if(++n_ % FOURIER_SEED == 0){
+      seed();
+    }else{
+      const double t = re*c_ - im*s_;
+      im = re*s_ + im*c_;
+      re = t;
+    }
+  }
+
+  double re, im;
+
+private:
+  void seed(){
+    const double phi = Constants::TWOPI*(f_*n_ - floor(f_*n_));
+    re = cos(phi);
+    im = sign_*sin(phi);
+  }
+  double f_;
+  int sign_, n_;
+  double c_, s_;
+};
+
+// Ranges of frequencies n from 0 to nk-1 whose gridding kernels can touch
+// rows qy1 to qy2-1 of a grid of size ng, the kernels being centred on
+// row n*slope. The ranges are returned as pairs of first and last+1 in
+// lims, in order and without overlaps. They may include frequencies that
+// miss the rows, but no frequency that touches them is left out.
+static void row_ranges(double slope, int nk, size_t qy1, size_t qy2, size_t ng, std::vector<int>& lims){
+
+  const double half = FOURIER_WIDTH/2. + 1.;
+  lims.clear();
+  if(nk == 0) return;
+  if(fabs(slope)*nk < 1.e-6){
+    lims.push_back(0);
+    lims.push_back(nk);
+    return;
+  }
+  const double glo = std::min(0., slope*(nk-1)), ghi = std::max(0., slope*(nk-1));
+  const int m1 = int(floor((glo - qy2 - half)/ng)), m2 = int(floor((ghi - qy1 + half)/ng));
+  std::vector<int> raw;
+  for(int m=m1; m<=m2; m++){
+    const double lo = (double(qy1) + double(m)*ng - half)/slope;
+    const double hi = (double(qy2) + double(m)*ng + half)/slope;
+    const int n1 = std::max(0,  int(floor(std::min(lo,hi))));
+    const int n2 = std::min(nk, int(ceil(std::max(lo,hi))) + 1);
+    if(n2 > n1){
+      raw.push_back(n1);
+      raw.push_back(n2);
+    }
+  }
+  // The ranges come in order of m, which is the order of n if the slope is
+  // positive and the reverse otherwise; merge any that overlap.
+  const int nr = raw.size()/2;
+  for(int k=0; k<nr; k++){
+    const int r = slope > 0. ? k : nr-1-k;
+    if(!lims.empty() && raw[2*r] <= lims.back()){
+      lims.back() = std::max(lims.back(), raw[2*r+1]);
+    }else{
+      lims.push_back(raw[2*r]);
+      lims.push_back(raw[2*r+1]);
+    }
+  }
+}
+
+// Number of columns of the 2D transforms handled together, to keep the
+// column pass within the cache.
+static const int FOURIER_BLOCK = 8;
+
+// Grid row holding row y of an image with centre nc
+static inline size_t grid_row(size_t y, int nc, size_t ng){
+  return (y + ng - nc) & (ng-1);
+}
+
+// 2D transform of an ng by ng complex grid to be called from inside a
+// parallel region. Only the nside rows that hold an image are transformed
+// along X, which are all that are non-zero for the forward transform and
+// all that are needed from the inverse, so the rows are done first for the
+// former (isign = dir) and last for the latter. work is per-thread workspace
+// of 2*ng*FOURIER_BLOCK floats.
+static void grid_fft(float grid[], size_t ng, size_t nside, int nc, int isign, int dir, float work[]){
+
+  if(isign == dir){
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+    for(size_t y=0; y<nside; y++)
+      Subs::fft(grid + 2*ng*grid_row(y,nc,ng), 2*ng, isign);
+  }
+
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+  for(size_t qx1=0; qx1<ng; qx1+=FOURIER_BLOCK){
+    const size_t nb = std::min(size_t(FOURIER_BLOCK), ng-qx1);
+    size_t qy, b;
+    for(qy=0; qy<ng; qy++){
+      const float *g = grid + 2*(ng*qy+qx1);
+      for(b=0; b<nb; b++){
+	work[2*(ng*b+qy)]   = g[2*b];
+	work[2*(ng*b+qy)+1] = g[2*b+1];
+      }
+    }
+    for(b=0; b<nb; b++)
+      Subs::fft(work + 2*ng*b, 2*ng, isign);
+    for(qy=0; qy<ng; qy++){
+      float *g = grid + 2*(ng*qy+qx1);
+      for(b=0; b<nb; b++){
+	g[2*b]   = work[2*(ng*b+qy)];
+	g[2*b+1] = work[2*(ng*b+qy)+1];
+      }
+    }
+  }
+
+  if(isign != dir){
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+    for(size_t y=0; y<nside; y++)
+      Subs::fft(grid + 2*ng*grid_row(y,nc,ng), 2*ng, isign);
+  }
+}
+
+/** Returns the number of floats of workspace per thread needed by the transforms
+ * of fourier_op and fourier_tr.
+ */
+size_t Tomog::Plan::nfwork() const {
+  return 2*std::max(FOURIER_BLOCK*fgrid_, fline_);
+}
+
+/** Equivalent of op for PROJ_FOURIER. The data are computed in one go
+ * rather than spectrum by spectrum. Uses the FINE, FFT and GRID slots of
+ * the Workspace.
+ * \param map  the map
+ * \param data the data computed from the map
+ * \param work workspace
+ */
+void Tomog::Plan::fourier_op(const float map[], float data[], Workspace& work) const {
+
+  const size_t ng = fgrid_, nl = fline_, mask = ng-1;
+  const int nk = nfreq(), nc = nside_/2;
+  const int nthread = std::max(1, get_nthread());
+
+  const size_t dstep = Workspace::stride<double>(2*nk);
+  const size_t wstep = Workspace::stride<float>(nfwork());
+  double *dhat  = work.get<double>(Workspace::FINE, nspec_*dstep);
+  float  *wbuff = work.get<float>(Workspace::FFT, nthread*wstep);
+  float  *grid  = work.get<float>(Workspace::GRID, 2*ng*ng);
+
+#ifdef _OPENMP
+#pragma omp parallel num_threads(nthread)
+#endif
+  {
+#ifdef _OPENMP
+    const int ithread = omp_get_thread_num();
+#else
+    const int ithread = 0;
+#endif
+    float *fwork = wbuff + wstep*ithread;
+    double wx[FOURIER_WIDTH], wy[FOURIER_WIDTH];
+    int ns, n, i, j;
+
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+    for(ns=0; ns<nspec_; ns++)
+      for(n=0; n<2*nk; n++) dhat[dstep*ns+n] = 0.;
+
+    for(int nim=0; nim<nimage(); nim++){
+
+      // Load the deapodised image, centred on the origin
+      const float *image = map + nside_*nside_*nim;
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+      for(size_t qy=0; qy<ng; qy++){
+	float *row = grid + 2*ng*qy;
+	for(size_t q=0; q<2*ng; q++) row[q] = 0.f;
+	const int y = (qy < ng/2 ? int(qy) : int(qy) - int(ng)) + nc;
+	if(y >= 0 && y < int(nside_)){
+	  for(size_t x=0; x<nside_; x++)
+	    if(live(nside_*(nside_*nim+y)+x))
+	      row[2*((x + ng - nc) & mask)] = fdeap_[x]*fdeap_[y]*image[nside_*y+x];
+	}
+      }
+
+      grid_fft(grid, ng, nside_, nc, -fsign_, -fsign_, fwork);
+
+      // Interpolate along the line of each sub-exposure, shift to the
+      // position of the image and accumulate with the line profile and
+      // the weights.
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+      for(ns=0; ns<nspec_; ns++){
+	double *dh = dhat + dstep*ns;
+	for(int nt=sfirst_[ns]; nt<sfirst_[ns+1]; nt++){
+	  const double px = pxscale_[nt], py = pyscale_[nt];
+	  const double w = weight_[nt];
+	  Rotation rot(fpcon(nt,nim) + nc*(px + py), flen_, -1);
+	  for(n=0, rot.start(0); n<nk; n++, rot.next()){
+	    const double k = n/flen_;
+	    const int qx1 = grid_weights(&fkern_[0], k*px*ng, wx);
+	    const int qy1 = grid_weights(&fkern_[0], k*py*ng, wy);
+	    double sr = 0., si = 0., tr, ti;
+	    for(j=0; j<FOURIER_WIDTH; j++){
+	      const float *row = grid + 2*ng*((qy1+j) & mask);
+	      tr = ti = 0.;
+	      for(i=0; i<FOURIER_WIDTH; i++){
+		const size_t q = 2*((qx1+i) & mask);
+		tr += wx[i]*row[q];
+		ti += wx[i]*row[q+1];
+	      }
+	      sr += wy[j]*tr;
+	      si += wy[j]*ti;
+	    }
+	    // Times the shift and weight, then the line profile
+	    tr = w*(rot.re*sr - rot.im*si);
+	    ti = w*(rot.re*si + rot.im*sr);
+	    dh[2*n]   += fwfac_[2*n]*tr - fwfac_[2*n+1]*ti;
+	    dh[2*n+1] += fwfac_[2*n]*ti + fwfac_[2*n+1]*tr;
+	  }
+	}
+      }
+    }
+
+    // Transform back and pick out the data pixels
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+    for(ns=0; ns<nspec_; ns++){
+      const double *dh = dhat + dstep*ns;
+      for(n=0; n<2*nk; n++) fwork[n] = dh[n];
+      for(size_t q=2*nk; q<2*nl; q++) fwork[q] = 0.f;
+      Subs::fft(fwork, 2*nl, fsign_);
+      for(i=0; i<npixd_; i++)
+	data[size_t(npixd_)*ns+i] = fwork[2*fos_*i];
+    }
+  }
+}
+
+/** Equivalent of tr for PROJ_FOURIER. Each thread grids onto its own band of
+ * rows of the 2D transforms so that the result does not depend upon the number
+ * of threads. Uses the FINE, FFT and GRID slots of the Workspace.
+ * \param data the data
+ * \param map  the map computed from the data
+ * \param work workspace
+ */
+void Tomog::Plan::fourier_tr(const float data[], float map[], Workspace& work) const {
+
+  const size_t ng = fgrid_, nl = fline_, mask = ng-1;
+  const int nk = nfreq(), nc = nside_/2;
+  const int nthread = std::max(1, get_nthread());
+
+  const size_t astep = Workspace::stride<double>(2*nk);
+  const size_t wstep = Workspace::stride<float>(nfwork());
+  double *ahat  = work.get<double>(Workspace::FINE, nsub()*astep);
+  float  *wbuff = work.get<float>(Workspace::FFT, nthread*wstep);
+  float  *grid  = work.get<float>(Workspace::GRID, 2*ng*ng);
+
+#ifdef _OPENMP
+#pragma omp parallel num_threads(nthread)
+#endif
+  {
+#ifdef _OPENMP
+    const int ithread = omp_get_thread_num();
+#else
+    const int ithread = 0;
+#endif
+    float *fwork = wbuff + wstep*ithread;
+    double wx[FOURIER_WIDTH], wy[FOURIER_WIDTH];
+    int n, i, j;
+
+    // Transform each spectrum, then apply the transposed line profile
+    // and the weight of each sub-exposure.
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+    for(int ns=0; ns<nspec_; ns++){
+      for(size_t q=0; q<2*nl; q++) fwork[q] = 0.f;
+      for(i=0; i<npixd_; i++)
+	fwork[2*fos_*i] = data[size_t(npixd_)*ns+i];
+      Subs::fft(fwork, 2*nl, -fsign_);
+      for(int nt=sfirst_[ns]; nt<sfirst_[ns+1]; nt++){
+	double *ah = ahat + astep*nt;
+	for(n=0; n<nk; n++){
+	  ah[2*n]   = weight_[nt]*(fwfac_[2*n]*fwork[2*n] + fwfac_[2*n+1]*fwork[2*n+1]);
+	  ah[2*n+1] = weight_[nt]*(fwfac_[2*n]*fwork[2*n+1] - fwfac_[2*n+1]*fwork[2*n]);
+	}
+      }
+    }
+
+    const size_t qy1 = (ng*ithread)/nthread, qy2 = (ng*(ithread+1))/nthread;
+    std::vector<int> lims;
+
+    for(int nim=0; nim<nimage(); nim++){
+
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+      for(size_t q=0; q<2*ng*ng; q++) grid[q] = 0.f;
+
+      // Grid every sub-exposure, shifted back from the position of
+      // the image, onto this thread's rows.
+      for(int nt=0; nt<nsub(); nt++){
+	const double *ah = ahat + astep*nt;
+	const double px = pxscale_[nt], py = pyscale_[nt];
+	Rotation rot(fpcon(nt,nim) + nc*(px + py), flen_, 1);
+	row_ranges(py*ng/flen_, nk, qy1, qy2, ng, lims);
+	for(size_t nr=0; nr<lims.size(); nr+=2){
+	  for(n=lims[nr], rot.start(n); n<lims[nr+1]; n++, rot.next()){
+	    const double k = n/flen_;
+	    const int qy = grid_weights(&fkern_[0], k*py*ng, wy);
+	    const double br = rot.re*ah[2*n] - rot.im*ah[2*n+1];
+	    const double bi = rot.re*ah[2*n+1] + rot.im*ah[2*n];
+	    const int qx1 = grid_weights(&fkern_[0], k*px*ng, wx);
+	    for(j=0; j<FOURIER_WIDTH; j++){
+	      const size_t r = (qy+j) & mask;
+	      if(r < qy1 || r >= qy2) continue;
+	      float *row = grid + 2*ng*r;
+	      for(i=0; i<FOURIER_WIDTH; i++){
+		const size_t q = 2*((qx1+i) & mask);
+		row[q]   += wx[i]*wy[j]*br;
+		row[q+1] += wx[i]*wy[j]*bi;
+	      }
+	    }
+	  }
+	}
+      }
+
+#ifdef _OPENMP
+#pragma omp barrier
+#endif
+
+      grid_fft(grid, ng, nside_, nc, fsign_, -fsign_, fwork);
+
+      // Deapodise and copy out the image
+      float *image = map + nside_*nside_*nim;
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+      for(size_t y=0; y<nside_; y++){
+	const float *row = grid + 2*ng*grid_row(y,nc,ng);
+	for(size_t x=0; x<nside_; x++)
+	  image[nside_*y+x] = live(nside_*(nside_*nim+y)+x) ? 
+	    fdeap_[x]*fdeap_[y]*row[2*((x + ng - nc) & mask)] : 0.f;
+      }
+    }
+  }
+}
@@ -0,0 +1,525 @@
+//
+// Projection row kernels with run-time selection of the instruction set.
+//
+// The kernels work along a row of a map. The range of pixels that lands
+// inside the fine buffer is found first, so no bounds test is needed per
+// pixel and, since every position within that range is >= 0, truncation
+// to an integer is the same as rounding down. This means that the 128-bit
+// kernels need nothing beyond SSE2. The AVX2 and AVX-512 kernels of tr
+// gather from the fine buffer. In op, the indices are computed with
+// vector instructions but the fine buffer is added to one pixel at a time
+// as neighbouring pixels often land in the same fine pixel. Every kernel
+// computes positions with exactly the same single precision operations,
+// so all give identical results.
+//
+
+#include <cmath>
+#include <cstdlib>
+#include <string>
+#include <algorithm>
+#include "trm_tomog.h"
+#include "tomog_kernels.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TOMOG_X86 1
+#include <immintrin.h>
+#endif
+
+#ifdef __GNUC__
+// Fused multiply-adds would change the positions from one kernel to another
+#pragma GCC optimize ("fp-contract=off")
+#endif
+
+// Kernel types
+typedef void (*Op_kernel)(const float row[], size_t x1, size_t x2, float fpcon,
+			  float pxscale, int nfine, double tfine[]);
+
+typedef void (*Tr_kernel)(const double tfine[], size_t x1, size_t x2, float fpcon,
+			  float pxscale, int nfine, float row[]);
+
+typedef void (*Index_kernel)(size_t x1, size_t x2, float fpcon, float pxscale, 
+			     int nfine, int index[]);
+
+typedef void (*Op_pair_kernel)(const float row[], size_t x1, size_t x2, float fpcon1, float pxscale1,
+			       float fpcon2, float pxscale2, int nfine, double tfine1[], double tfine2[]);
+
+typedef void (*Tr_pair_kernel)(const double tfine1[], const double tfine2[], size_t x1, size_t x2, 
+			       float fpcon1, float pxscale1, float fpcon2, float pxscale2, 
+			       int nfine, float row[]);
+
+// Clips a position to the last fine pixel. It has no effect unless
+// the compiler has evaluated fine_position differently in clip_row.
+static inline float clip_top(float fpoff, int nfine){
+  return std::min(fpoff, float(nfine-1));
+}
+
+// Generic kernels. These are also used for the ends of rows by the others,
+// so they are kept out of line to stop them picking up other instructions.
+
+static void op_generic(const float row[], size_t x1, size_t x2, float fpcon,
+		       float pxscale, int nfine, double tfine[]) __attribute__((noinline));
+
+static void op_generic(const float row[], size_t x1, size_t x2, float fpcon,
+		       float pxscale, int nfine, double tfine[]){
+  for(size_t xp=x1; xp<x2; xp++)
+    tfine[int(clip_top(Tomog::fine_position(fpcon, pxscale, xp), nfine))] += row[xp];
+}
+
+static void tr_generic(const double tfine[], size_t x1, size_t x2, float fpcon,
+		       float pxscale, int nfine, float row[]) __attribute__((noinline));
+
+static void tr_generic(const double tfine[], size_t x1, size_t x2, float fpcon,
+		       float pxscale, int nfine, float row[]){
+  for(size_t xp=x1; xp<x2; xp++)
+    row[xp] += tfine[int(clip_top(Tomog::fine_position(fpcon, pxscale, xp), nfine))];
+}
+
+static void index_generic(size_t x1, size_t x2, float fpcon, float pxscale, 
+			  int nfine, int index[]) __attribute__((noinline));
+
+static void index_generic(size_t x1, size_t x2, float fpcon, float pxscale, 
+			  int nfine, int index[]){
+  for(size_t xp=x1; xp<x2; xp++)
+    index[xp-x1] = int(clip_top(Tomog::fine_position(fpcon, pxscale, xp), nfine));
+}
+
+// Generic kernels for two sub-exposures at once
+
+static void op_pair_generic(const float row[], size_t x1, size_t x2, float fpcon1, float pxscale1,
+			    float fpcon2, float pxscale2, int nfine, double tfine1[], double tfine2[]){
+  for(size_t xp=x1; xp<x2; xp++){
+    tfine1[int(clip_top(Tomog::fine_position(fpcon1, pxscale1, xp), nfine))] += row[xp];
+    tfine2[int(clip_top(Tomog::fine_position(fpcon2, pxscale2, xp), nfine))] += row[xp];
+  }
+}
+
+static void tr_pair_generic(const double tfine1[], const double tfine2[], size_t x1, size_t x2, 
+			    float fpcon1, float pxscale1, float fpcon2, float pxscale2, 
+			    int nfine, float row[]){
+  for(size_t xp=x1; xp<x2; xp++)
+    row[xp] += tfine1[int(clip_top(Tomog::fine_position(fpcon1, pxscale1, xp), nfine))] +
+      tfine2[int(clip_top(Tomog::fine_position(fpcon2, pxscale2, xp), nfine))];
+}
+
+#ifdef TOMOG_X86
+
+// SSE2, 4 pixels at a time
+
+__attribute__((target("sse2")))
+static void op_sse2(const float row[], size_t x1, size_t x2, float fpcon,
+		    float pxscale, int nfine, double tfine[]){
+  const __m128 step = _mm_set1_ps(pxscale), con = _mm_set1_ps(fpcon);
+  const __m128 top  = _mm_set1_ps(float(nfine-1)), lane = _mm_setr_ps(0.f,1.f,2.f,3.f);
+  int idx[4] __attribute__((aligned(16)));
+  size_t xp = x1;
+  for(; xp+4<=x2; xp+=4){
+    __m128 pos = _mm_add_ps(con, _mm_mul_ps(_mm_add_ps(_mm_set1_ps(float(xp)), lane), step));
+    _mm_store_si128((__m128i*)idx, _mm_cvttps_epi32(_mm_min_ps(pos, top)));
+    tfine[idx[0]] += row[xp];
+    tfine[idx[1]] += row[xp+1];
+    tfine[idx[2]] += row[xp+2];
+    tfine[idx[3]] += row[xp+3];
+  }
+  op_generic(row, xp, x2, fpcon, pxscale, nfine, tfine);
+}
+
+__attribute__((target("sse2")))
+static void tr_sse2(const double tfine[], size_t x1, size_t x2, float fpcon,
+		    float pxscale, int nfine, float row[]){
+  const __m128 step = _mm_set1_ps(pxscale), con = _mm_set1_ps(fpcon);
+  const __m128 top  = _mm_set1_ps(float(nfine-1)), lane = _mm_setr_ps(0.f,1.f,2.f,3.f);
+  int idx[4] __attribute__((aligned(16)));
+  size_t xp = x1;
+  for(; xp+4<=x2; xp+=4){
+    __m128 pos = _mm_add_ps(con, _mm_mul_ps(_mm_add_ps(_mm_set1_ps(float(xp)), lane), step));
+    _mm_store_si128((__m128i*)idx, _mm_cvttps_epi32(_mm_min_ps(pos, top)));
+    row[xp]   += tfine[idx[0]];
+    row[xp+1] += tfine[idx[1]];
+    row[xp+2] += tfine[idx[2]];
+    row[xp+3] += tfine[idx[3]];
+  }
+  tr_generic(tfine, xp, x2, fpcon, pxscale, nfine, row);
+}
+
+__attribute__((target("sse2")))
+static void index_sse2(size_t x1, size_t x2, float fpcon, float pxscale, 
+		       int nfine, int index[]){
+  const __m128 step = _mm_set1_ps(pxscale), con = _mm_set1_ps(fpcon);
+  const __m128 top  = _mm_set1_ps(float(nfine-1)), lane = _mm_setr_ps(0.f,1.f,2.f,3.f);
+  size_t xp = x1;
+  for(; xp+4<=x2; xp+=4){
+    __m128 pos = _mm_add_ps(con, _mm_mul_ps(_mm_add_ps(_mm_set1_ps(float(xp)), lane), step));
+    _mm_storeu_si128((__m128i*)(index+xp-x1), _mm_cvttps_epi32(_mm_min_ps(pos, top)));
+  }
+  index_generic(xp, x2, fpcon, pxscale, nfine, index+xp-x1);
+}
+
+__attribute__((target("sse2")))
+static void op_pair_sse2(const float row[], size_t x1, size_t x2, float fpcon1, float pxscale1,
+			 float fpcon2, float pxscale2, int nfine, double tfine1[], double tfine2[]){
+  const __m128 step1 = _mm_set1_ps(pxscale1), con1 = _mm_set1_ps(fpcon1);
+  const __m128 step2 = _mm_set1_ps(pxscale2), con2 = _mm_set1_ps(fpcon2);
+  const __m128 top   = _mm_set1_ps(float(nfine-1)), lane = _mm_setr_ps(0.f,1.f,2.f,3.f);
+  int idx1[4] __attribute__((aligned(16)));
+  int idx2[4] __attribute__((aligned(16)));
+  size_t xp = x1;
+  for(; xp+4<=x2; xp+=4){
+    const __m128 x = _mm_add_ps(_mm_set1_ps(float(xp)), lane);
+    _mm_store_si128((__m128i*)idx1, _mm_cvttps_epi32(_mm_min_ps(_mm_add_ps(con1, _mm_mul_ps(x, step1)), top)));
+    _mm_store_si128((__m128i*)idx2, _mm_cvttps_epi32(_mm_min_ps(_mm_add_ps(con2, _mm_mul_ps(x, step2)), top)));
+    for(int l=0; l<4; l++){
+      tfine1[idx1[l]] += row[xp+l];
+      tfine2[idx2[l]] += row[xp+l];
+    }
+  }
+  op_pair_generic(row, xp, x2, fpcon1, pxscale1, fpcon2, pxscale2, nfine, tfine1, tfine2);
+}
+
+__attribute__((target("sse2")))
+static void tr_pair_sse2(const double tfine1[], const double tfine2[], size_t x1, size_t x2, 
+			 float fpcon1, float pxscale1, float fpcon2, float pxscale2, 
+			 int nfine, float row[]){
+  const __m128 step1 = _mm_set1_ps(pxscale1), con1 = _mm_set1_ps(fpcon1);
+  const __m128 step2 = _mm_set1_ps(pxscale2), con2 = _mm_set1_ps(fpcon2);
+  const __m128 top   = _mm_set1_ps(float(nfine-1)), lane = _mm_setr_ps(0.f,1.f,2.f,3.f);
+  int idx1[4] __attribute__((aligned(16)));
+  int idx2[4] __attribute__((aligned(16)));
+  size_t xp = x1;
+  for(; xp+4<=x2; xp+=4){
+    const __m128 x = _mm_add_ps(_mm_set1_ps(float(xp)), lane);
+    _mm_store_si128((__m128i*)idx1, _mm_cvttps_epi32(_mm_min_ps(_mm_add_ps(con1, _mm_mul_ps(x, step1)), top)));
+    _mm_store_si128((__m128i*)idx2, _mm_cvttps_epi32(_mm_min_ps(_mm_add_ps(con2, _mm_mul_ps(x, step2)), top)));
+    for(int l=0; l<4; l++)
+      row[xp+l] += tfine1[idx1[l]] + tfine2[idx2[l]];
+  }
+  tr_pair_generic(tfine1, tfine2, xp, x2, fpcon1, pxscale1, fpcon2, pxscale2, nfine, row);
+}
+
+// AVX2, 8 pixels at a time. Only tr and the indices have versions of their
+// own as the scattered additions limit op to the speed of the SSE2 kernel.
+
+__attribute__((target("avx2")))
+static void index_avx2(size_t x1, size_t x2, float fpcon, float pxscale, 
+		       int nfine, int index[]){
+  const __m256 step = _mm256_set1_ps(pxscale), con = _mm256_set1_ps(fpcon);
+  const __m256 top  = _mm256_set1_ps(float(nfine-1));
+  const __m256 lane = _mm256_setr_ps(0.f,1.f,2.f,3.f,4.f,5.f,6.f,7.f);
+  size_t xp = x1;
+  for(; xp+8<=x2; xp+=8){
+    __m256 pos = _mm256_add_ps(con, _mm256_mul_ps(_mm256_add_ps(_mm256_set1_ps(float(xp)), lane), step));
+    _mm256_storeu_si256((__m256i*)(index+xp-x1), _mm256_cvttps_epi32(_mm256_min_ps(pos, top)));
+  }
+  index_generic(xp, x2, fpcon, pxscale, nfine, index+xp-x1);
+}
+
+__attribute__((target("avx2")))
+static void tr_avx2(const double tfine[], size_t x1, size_t x2, float fpcon,
+		    float pxscale, int nfine, float row[]){
+  const __m256 step = _mm256_set1_ps(pxscale), con = _mm256_set1_ps(fpcon);
+  const __m256 top  = _mm256_set1_ps(float(nfine-1));
+  const __m256 lane = _mm256_setr_ps(0.f,1.f,2.f,3.f,4.f,5.f,6.f,7.f);
+  size_t xp = x1;
+  for(; xp+8<=x2; xp+=8){
+    __m256 pos  = _mm256_add_ps(con, _mm256_mul_ps(_mm256_add_ps(_mm256_set1_ps(float(xp)), lane), step));
+    __m256i idx = _mm256_cvttps_epi32(_mm256_min_ps(pos, top));
+    __m256d lo  = _mm256_i32gather_pd(tfine, _mm256_castsi256_si128(idx), 8);
+    __m256d hi  = _mm256_i32gather_pd(tfine, _mm256_extracti128_si256(idx, 1), 8);
+    lo = _mm256_add_pd(lo, _mm256_cvtps_pd(_mm_loadu_ps(row+xp)));
+    hi = _mm256_add_pd(hi, _mm256_cvtps_pd(_mm_loadu_ps(row+xp+4)));
+    _mm_storeu_ps(row+xp,   _mm256_cvtpd_ps(lo));
+    _mm_storeu_ps(row+xp+4, _mm256_cvtpd_ps(hi));
+  }
+  tr_generic(tfine, xp, x2, fpcon, pxscale, nfine, row);
+}
+
+__attribute__((target("avx2")))
+static void tr_pair_avx2(const double tfine1[], const double tfine2[], size_t x1, size_t x2, 
+			 float fpcon1, float pxscale1, float fpcon2, float pxscale2, 
+			 int nfine, float row[]){
+  const __m256 step1 = _mm256_set1_ps(pxscale1), con1 = _mm256_set1_ps(fpcon1);
+  const __m256 step2 = _mm256_set1_ps(pxscale2), con2 = _mm256_set1_ps(fpcon2);
+  const __m256 top   = _mm256_set1_ps(float(nfine-1));
+  const __m256 lane  = _mm256_setr_ps(0.f,1.f,2.f,3.f,4.f,5.f,6.f,7.f);
+  size_t xp = x1;
+  for(; xp+8<=x2; xp+=8){
+    const __m256 x = _mm256_add_ps(_mm256_set1_ps(float(xp)), lane);
+    __m256i idx1 = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_add_ps(con1, _mm256_mul_ps(x, step1)), top));
+    __m256i idx2 = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_add_ps(con2, _mm256_mul_ps(x, step2)), top));
+    __m256d lo = _mm256_add_pd(_mm256_i32gather_pd(tfine1, _mm256_castsi256_si128(idx1), 8),
+			       _mm256_i32gather_pd(tfine2, _mm256_castsi256_si128(idx2), 8));
+    __m256d hi = _mm256_add_pd(_mm256_i32gather_pd(tfine1, _mm256_extracti128_si256(idx1, 1), 8),
+			       _mm256_i32gather_pd(tfine2, _mm256_extracti128_si256(idx2, 1), 8));
+    lo = _mm256_add_pd(lo, _mm256_cvtps_pd(_mm_loadu_ps(row+xp)));
+    hi = _mm256_add_pd(hi, _mm256_cvtps_pd(_mm_loadu_ps(row+xp+4)));
+    _mm_storeu_ps(row+xp,   _mm256_cvtpd_ps(lo));
+    _mm_storeu_ps(row+xp+4, _mm256_cvtpd_ps(hi));
+  }
+  tr_pair_generic(tfine1, tfine2, xp, x2, fpcon1, pxscale1, fpcon2, pxscale2, nfine, row);
+}
+
+// AVX-512, 16 pixels at a time, tr only
+
+__attribute__((target("avx512f")))
+static void tr_avx512(const double tfine[], size_t x1, size_t x2, float fpcon,
+		      float pxscale, int nfine, float row[]){
+  const __m512 step = _mm512_set1_ps(pxscale), con = _mm512_set1_ps(fpcon);
+  const __m512 top  = _mm512_set1_ps(float(nfine-1));
+  const __m512 lane = _mm512_setr_ps(0.f,1.f,2.f,3.f,4.f,5.f,6.f,7.f,8.f,9.f,10.f,11.f,12.f,13.f,14.f,15.f);
+  size_t xp = x1;
+  for(; xp+16<=x2; xp+=16){
+    __m512 pos  = _mm512_add_ps(con, _mm512_mul_ps(_mm512_add_ps(_mm512_set1_ps(float(xp)), lane), step));
+    __m512i idx = _mm512_cvttps_epi32(_mm512_min_ps(pos, top));
+    __m512d lo  = _mm512_i32gather_pd(_mm512_castsi512_si256(idx), tfine, 8);
+    __m512d hi  = _mm512_i32gather_pd(_mm512_extracti64x4_epi64(idx, 1), tfine, 8);
+    lo = _mm512_add_pd(lo, _mm512_cvtps_pd(_mm256_loadu_ps(row+xp)));
+    hi = _mm512_add_pd(hi, _mm512_cvtps_pd(_mm256_loadu_ps(row+xp+8)));
+    _mm256_storeu_ps(row+xp,   _mm512_cvtpd_ps(lo));
+    _mm256_storeu_ps(row+xp+8, _mm512_cvtpd_ps(hi));
+  }
+  tr_generic(tfine, xp, x2, fpcon, pxscale, nfine, row);
+}
+
+#endif
+
+// Returns the best instruction set supported by the CPU
+static Tomog::Simd cpu_simd(){
+#ifdef TOMOG_X86
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx512f")) return Tomog::SIMD_AVX512;
+  if(__builtin_cpu_supports("avx2"))    return Tomog::SIMD_AVX2;
+  if(__builtin_cpu_supports("sse2"))    return Tomog::SIMD_SSE2;
+#endif
+  return Tomog::SIMD_NONE;
+}
+
+// The instruction set in use and the corresponding kernels.
+static Tomog::Simd simd_used = Tomog::SIMD_NONE;
+static Op_kernel op_kernel   = op_generic;
+static Tr_kernel tr_kernel   = tr_generic;
+static Index_kernel index_kernel = index_generic;
+static Op_pair_kernel op_pair_kernel = op_pair_generic;
+static Tr_pair_kernel tr_pair_kernel = tr_pair_generic;
+static bool simd_set         = false;
+
+// Selects the kernels for an instruction set. The flag is only set once
+// the kernels are in place. Called within the critical section of
+// set_simd and get_simd.
+static void choose_simd(Tomog::Simd simd){
+
+  simd_used = std::min(simd, cpu_simd());
+
+  switch(simd_used){
+#ifdef TOMOG_X86
+  case Tomog::SIMD_AVX512:
+    op_kernel = op_sse2;
+    tr_kernel = tr_avx512;
+    index_kernel = index_avx2;
+    op_pair_kernel = op_pair_sse2;
+    tr_pair_kernel = tr_pair_avx2;
+    break;
+  case Tomog::SIMD_AVX2:
+    op_kernel = op_sse2;
+    tr_kernel = tr_avx2;
+    index_kernel = index_avx2;
+    op_pair_kernel = op_pair_sse2;
+    tr_pair_kernel = tr_pair_avx2;
+    break;
+  case Tomog::SIMD_SSE2:
+    op_kernel = op_sse2;
+    tr_kernel = tr_sse2;
+    index_kernel = index_sse2;
+    op_pair_kernel = op_pair_sse2;
+    tr_pair_kernel = tr_pair_sse2;
+    break;
+#endif
+  default:
+    simd_used = Tomog::SIMD_NONE;
+    op_kernel = op_generic;
+    tr_kernel = tr_generic;
+    index_kernel = index_generic;
+    op_pair_kernel = op_pair_generic;
+    tr_pair_kernel = tr_pair_generic;
+  }
+  simd_set = true;
+}
+
+/** Sets the instruction set extensions used by the projections in op and tr.
+ * If the CPU does not support the requested set, the best that it does support
+ * is used instead. The default is the best supported by the CPU, unless the
+ * environment variable TOMOG_SIMD is set to one of "none", "sse2", "avx2" or
+ * "avx512". All choices give identical results. This must not be called while
+ * op or tr are running in another thread.
+ * \param simd the instruction set extensions to use
+ */
+void Tomog::set_simd(Simd simd){
+#ifdef _OPENMP
+#pragma omp critical(tomog_simd)
+#endif
+  choose_simd(simd);
+}
+
+/** Returns the instruction set extensions used by the projections
+ * in op and tr, choosing them the first time it is called. The row
+ * kernels rely upon this having been called before they run, which
+ * op, tr and the other projection routines do on entry, before they
+ * start any threads. It is safe to call from several threads at once.
+ */
+Tomog::Simd Tomog::get_simd(){
+  Simd simd;
+#ifdef _OPENMP
+#pragma omp critical(tomog_simd)
+#endif
+  {
+    if(!simd_set){
+      Simd req = SIMD_AVX512;
+      const char* env = getenv(TOMOG_SIMD);
+      if(env != NULL){
+	std::string senv(env);
+	if(senv == "none"){
+	  req = SIMD_NONE;
+	}else if(senv == "sse2"){
+	  req = SIMD_SSE2;
+	}else if(senv == "avx2"){
+	  req = SIMD_AVX2;
+	}
+      }
+      choose_simd(req);
+    }
+    simd = simd_used;
+  }
+  return simd;
+}
+
+/** Works out the range of pixels along a row that land within the fine buffer, i.e.
+ * those for which 0 <= fine_position < nfine. The position varies monotonically
+ * along the row so this is a contiguous range. It is estimated directly and then
+ * adjusted by evaluating the positions exactly as the kernels do.
+ * \param nside   number of pixels in the row
+ * \param fpcon   fine pixel position of the first pixel
+ * \param pxscale fine pixel step per pixel
+ * \param nfine   number of fine pixels
+ * \param x1      first pixel in range (returned)
+ * \param x2      one more than the last pixel in range (returned)
+ */
+void Tomog::clip_row(size_t nside, float fpcon, float pxscale, int nfine, size_t& x1, size_t& x2){
+
+  if(pxscale == 0.f){
+    x1 = 0;
+    x2 = (fpcon >= 0.f && fpcon < nfine) ? nside : 0;
+    return;
+  }
+
+  // Pixels are in range between the crossings of the ends of the buffer
+  double xlo = -fpcon/double(pxscale), xhi = (nfine-fpcon)/double(pxscale);
+  if(pxscale < 0.f) std::swap(xlo, xhi);
+  x1 = size_t(std::min(double(nside), std::max(0., ceil(xlo))));
+  x2 = size_t(std::min(double(nside), std::max(0., ceil(xhi))));
+
+  // Fix any rounding problems.
+  float pos;
+  while(x1 > 0 && (pos = fine_position(fpcon, pxscale, x1-1)) >= 0.f && pos < nfine) x1--;
+  while(x1 < nside && !((pos = fine_position(fpcon, pxscale, x1)) >= 0.f && pos < nfine)) x1++;
+  if(x2 < x1) x2 = x1;
+  while(x2 > x1 && !((pos = fine_position(fpcon, pxscale, x2-1)) >= 0.f && pos < nfine)) x2--;
+  while(x2 < nside && (pos = fine_position(fpcon, pxscale, x2)) >= 0.f && pos < nfine) x2++;
+}
+
+/** Adds the pixels of one row of a map into the fine pixels they land in.
+ * \param row     the row
+ * \param nside   number of pixels in the row
+ * \param fpcon   fine pixel position of the first pixel
+ * \param pxscale fine pixel step per pixel
+ * \param nfine   number of fine pixels
+ * \param tfine   the fine buffer to add to
+ */
+void Tomog::op_row(const float row[], size_t nside, float fpcon, float pxscale, int nfine, double tfine[]){
+  size_t x1, x2;
+  clip_row(nside, fpcon, pxscale, nfine, x1, x2);
+  if(x2 > x1){
+    op_kernel(row, x1, x2, fpcon, pxscale, nfine, tfine);
+  }
+}
+
+/** Adds fine buffer pixels into the row pixels that land in them. This is the
+ * transpose of op_row.
+ * \param tfine   the fine buffer
+ * \param nside   number of pixels in the row
+ * \param fpcon   fine pixel position of the first pixel
+ * \param pxscale fine pixel step per pixel
+ * \param nfine   number of fine pixels
+ * \param row     the row to add to
+ */
+void Tomog::tr_row(const double tfine[], size_t nside, float fpcon, float pxscale, int nfine, float row[]){
+  size_t x1, x2;
+  clip_row(nside, fpcon, pxscale, nfine, x1, x2);
+  if(x2 > x1){
+    tr_kernel(tfine, x1, x2, fpcon, pxscale, nfine, row);
+  }
+}
+
+/** Computes the fine pixels that a range of pixels along a row land in. The
+ * range should come from clip_row. This allows the indices to be computed
+ * once and applied to several maps.
+ * \param x1      first pixel of the range
+ * \param x2      one more than the last pixel of the range
+ * \param fpcon   fine pixel position of the first pixel of the row
+ * \param pxscale fine pixel step per pixel
+ * \param nfine   number of fine pixels
+ * \param index   the fine pixels of pixels x1 to x2-1 (returned)
+ */
+void Tomog::row_index(size_t x1, size_t x2, float fpcon, float pxscale, int nfine, int index[]){
+  if(x2 > x1){
+    index_kernel(x1, x2, fpcon, pxscale, nfine, index);
+  }
+}
+
+/** Adds one row of a map into the fine buffers of two sub-exposures in a single
+ * pass along the row. The pixels land in exactly the same fine pixels as they
+ * do with op_row for each sub-exposure in turn, in the same order.
+ * \param row      the row
+ * \param nside    number of pixels in the row
+ * \param fpcon1   fine pixel position of the first pixel, first sub-exposure
+ * \param pxscale1 fine pixel step per pixel, first sub-exposure
+ * \param fpcon2   fine pixel position of the first pixel, second sub-exposure
+ * \param pxscale2 fine pixel step per pixel, second sub-exposure
+ * \param nfine    number of fine pixels
+ * \param tfine1   the fine buffer of the first sub-exposure to add to
+ * \param tfine2   the fine buffer of the second sub-exposure to add to
+ */
+void Tomog::op_row_pair(const float row[], size_t nside, float fpcon1, float pxscale1, 
+			float fpcon2, float pxscale2, int nfine, double tfine1[], double tfine2[]){
+  size_t x11, x21, x12, x22;
+  clip_row(nside, fpcon1, pxscale1, nfine, x11, x21);
+  clip_row(nside, fpcon2, pxscale2, nfine, x12, x22);
+  const size_t xlo = std::max(x11, x12), xhi = std::max(xlo, std::min(x21, x22));
+  if(xlo > x11) op_kernel(row, x11, std::min(xlo, x21), fpcon1, pxscale1, nfine, tfine1);
+  if(xlo > x12) op_kernel(row, x12, std::min(xlo, x22), fpcon2, pxscale2, nfine, tfine2);
+  if(xhi > xlo) op_pair_kernel(row, xlo, xhi, fpcon1, pxscale1, fpcon2, pxscale2, nfine, tfine1, tfine2);
+  if(x21 > xhi) op_kernel(row, std::max(xhi, x11), x21, fpcon1, pxscale1, nfine, tfine1);
+  if(x22 > xhi) op_kernel(row, std::max(xhi, x12), x22, fpcon2, pxscale2, nfine, tfine2);
+}
+
+/** Adds the fine buffers of two sub-exposures into a row in a single pass along
+ * the row. This is the transpose of op_row_pair.
+ * \param tfine1   the fine buffer of the first sub-exposure
+ * \param tfine2   the fine buffer of the second sub-exposure
+ * \param nside    number of pixels in the row
+ * \param fpcon1   fine pixel position of the first pixel, first sub-exposure
+ * \param pxscale1 fine pixel step per pixel, first sub-exposure
+ * \param fpcon2   fine pixel position of the first pixel, second sub-exposure
+ * \param pxscale2 fine pixel step per pixel, second sub-exposure
+ * \param nfine    number of fine pixels
+ * \param row      the row to add to
+ */
+void Tomog::tr_row_pair(const double tfine1[], const double tfine2[], size_t nside, float fpcon1, 
+			float pxscale1, float fpcon2, float pxscale2, int nfine, float row[]){
+  size_t x11, x21, x12, x22;
+  clip_row(nside, fpcon1, pxscale1, nfine, x11, x21);
+  clip_row(nside, fpcon2, pxscale2, nfine, x12, x22);
+  const size_t xlo = std::max(x11, x12), xhi = std::max(xlo, std::min(x21, x22));
+  if(xlo > x11) tr_kernel(tfine1, x11, std::min(xlo, x21), fpcon1, pxscale1, nfine, row);
+  if(xlo > x12) tr_kernel(tfine2, x12, std::min(xlo, x22), fpcon2, pxscale2, nfine, row);
+  if(xhi > xlo) tr_pair_kernel(tfine1, tfine2, xlo, xhi, fpcon1, pxscale1, fpcon2, pxscale2, nfine, row);
+  if(x21 > xhi) tr_kernel(tfine1, std::max(xhi, x11), x21, fpcon1, pxscale1, nfine, row);
+  if(x22 > xhi) tr_kernel(tfine2, std::max(xhi, x12), x22, fpcon2, pxscale2, nfine, row);
+}
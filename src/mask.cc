@@ -0,0 +1,72 @@
+//
+// Masks restricting op and tr to a region of interest of the map, such as
+// the circle of velocities within the maximum that the data can reach.
+// The pixels used are held as runs along each row so that the row
+// projections simply skip the rest.
+//
+
+#include "trm_tomog.h"
+
+/** Restricts op and tr to part of the map. op ignores the other pixels,
+ * treating them as zero, and tr sets them to zero, so op and tr remain
+ * each other's transpose on the pixels in use, and pack and unpack convert
+ * between maps and vectors of just those pixels, e.g. to cut down the
+ * number of MEM unknowns. Any sparse matrix is removed since it would
+ * include the masked pixels. With the point projection, positions along
+ * each run of pixels are stepped from the start of the run, so they can
+ * differ from those of an unmasked map by rounding.
+ * \param mask nmap() values, non-zero for the pixels to use. NULL to remove an existing mask.
+ */
+void Tomog::Plan::set_mask(const char mask[]){
+
+  if(grouped()) gplan_[0].set_mask(mask);
+  mask_.clear();
+  mrow_.clear();
+  mrun_.clear();
+  nlive_ = 0;
+  set_sparse(0);
+  if(mask == NULL) return;
+
+  const size_t nmap = this->nmap(), nrow = nimage()*nside_;
+  mask_.resize(nmap);
+  mrow_.resize(nrow+1);
+  mrow_[0] = 0;
+  for(size_t nr=0; nr<nrow; nr++){
+    const char *mrow = mask + nside_*nr;
+    size_t xp = 0;
+    while(xp < nside_){
+      while(xp < nside_ && !mrow[xp]) xp++;
+      if(xp == nside_) break;
+      mrun_.push_back(xp);
+      while(xp < nside_ && mrow[xp]) xp++;
+      mrun_.push_back(xp);
+      nlive_ += mrun_.back() - mrun_[mrun_.size()-2];
+    }
+    mrow_[nr+1] = mrun_.size()/2;
+    for(xp=0; xp<nside_; xp++)
+      mask_[nside_*nr+xp] = mrow[xp] ? 1 : 0;
+  }
+}
+
+/** Copies the pixels of a map used by op and tr into a vector.
+ * \param map  the map, nmap() elements
+ * \param live the pixels in use, nlive() elements (returned)
+ */
+void Tomog::Plan::pack(const float map[], float live[]) const {
+  for(size_t nr=0, n=0; nr<nimage()*nside_; nr++)
+    for(int k=0; k<nrun(nr); k++)
+      for(size_t xp=run_first(nr,k); xp<run_last(nr,k); xp++)
+	live[n++] = map[nside_*nr+xp];
+}
+
+/** Copies a vector of the pixels used by op and tr into a map, the
+ * transpose of pack. The other pixels of the map are left alone.
+ * \param live the pixels in use, nlive() elements
+ * \param map  the map, nmap() elements
+ */
+void Tomog::Plan::unpack(const float live[], float map[]) const {
+  for(size_t nr=0, n=0; nr<nimage()*nside_; nr++)
+    for(int k=0; k<nrun(nr); k++)
+      for(size_t xp=run_first(nr,k); xp<run_last(nr,k); xp++)
+	map[nside_*nr+xp] = live[n++];
+}
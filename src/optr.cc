@@ -3,9 +3,77 @@
 //
 
 #include <iostream>
+#include <cstdlib>
+#include <cmath>
+#include <unistd.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include "trm_subs.h"
 #include "trm_constants.h"
 #include "trm_tomog.h"
+#include "tomog_kernels.h"
+
+// Number of threads set by set_nthread; 0 means not set.
+static int nthread_set = 0;
+
+/** Sets the number of threads used by op and tr. This overrides both
+ * the environment variable TOMOG_NTHREAD and the OpenMP default.
+ * \param nthread number of threads. 0 restores the default behaviour.
+ */
+void Tomog::set_nthread(int nthread){
+  nthread_set = std::max(0, nthread);
+}
+
+/** Returns the number of threads that op and tr will use. This is the value
+ * set by set_nthread if any, otherwise the value of the environment variable
+ * TOMOG_NTHREAD if defined, otherwise the OpenMP default. It is always 1 if 
+ * the library was compiled without OpenMP support.
+ */
+int Tomog::get_nthread(){
+#ifdef _OPENMP
+  if(nthread_set > 0) return nthread_set;
+  const char* env = getenv(TOMOG_NTHREAD);
+  if(env != NULL){
+    int nthread = atoi(env);
+    if(nthread > 0) return nthread;
+  }
+  return omp_get_max_threads();
+#else
+  return 1;
+#endif
+}
+
+// Cache size set by set_cache_size; 0 means not set.
+static size_t cache_set = 0;
+
+// Cache size assumed if it cannot be found from the system
+static const size_t CACHE_DEFAULT = 256*1024;
+
+/** Sets the cache size in bytes used to pick the block sizes of op. This
+ * overrides the value found from the system.
+ * \param nbytes the cache size. 0 restores the default behaviour.
+ */
+void Tomog::set_cache_size(size_t nbytes){
+  cache_set = nbytes;
+}
+
+/** Returns the cache size in bytes used to pick the block sizes of op. This
+ * is the value set by set_cache_size if any, otherwise the size of the level 2
+ * cache reported by the system, or failing that the level 3 cache, otherwise 
+ * 256 kB.
+ */
+size_t Tomog::get_cache_size(){
+  if(cache_set) return cache_set;
+  long nbytes = 0;
+#ifdef _SC_LEVEL2_CACHE_SIZE
+  nbytes = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+#ifdef _SC_LEVEL3_CACHE_SIZE
+  if(nbytes <= 0) nbytes = sysconf(_SC_LEVEL3_CACHE_SIZE);
+#endif
+  return nbytes > 0 ? size_t(nbytes) : CACHE_DEFAULT;
+}
 
 void Tomog::op(const float map[], const Subs::Array1D<double>& wave, 
 		 const Subs::Array1D<float>& gamma, size_t nside, float vpix, 
@@ -13,97 +81,689 @@ void Tomog::op(const float map[], const Subs::Array1D<double>& wave,
 		 float vpixd, double waved, const Subs::Array1D<double>& time, 
 		 const Subs::Array1D<float>& expose, double tzero, double period, float data[]){
 
-  int i, j, l, off;
-  
-  const int nfine = ndiv*npixd;   // number of pixels in fine pixel buffer.
-  double fine[nfine], tfine[nfine]; // fine buffers
+  Plan plan(wave, gamma, nside, vpix, fwhm, ndiv, ntdiv, npixd, nspec, 
+	    vpixd, waved, time, expose, tzero, period);
+  op(plan, map, data);
+}
+
+// Below this fine pixel step per map pixel in X for every sub-exposure, op
+// and tr project point-like rows as runs of pixels falling in the same
+// fine pixel, using prefix sums of the rows for op and difference arrays
+// for tr. Set by timing the two.
+static const float PREFIX_SCALE = 0.2f;
+
+// Whether op and tr of a single map use runs of pixels. Masked maps are
+// projected pixel by pixel.
+static bool prefix_rows(const Tomog::Plan& plan){
+  if(plan.projector() != Tomog::PROJ_POINT || plan.sparse() || plan.reproducible() || 
+     plan.masked()) return false;
+  for(int nt=0; nt<plan.nsub(); nt++)
+    if(std::abs(plan.pxscale(nt)) >= PREFIX_SCALE) return false;
+  return true;
+}
+
+// Projection of the spectra at positions k1 to k2-1 of the order given by
+// plan.pair_order, including all their sub-exposures, into their fine
+// buffers, spaced by fstep. The range must not split a pair. tfine is
+// workspace for one buffer per sub-exposure. The map is taken nrtile rows at
+// a time, counting rows continuously through the images, and each tile is
+// projected for every sub-exposure before moving on, so that it only has to
+// be read from memory once per block of spectra. The rows are still added
+// into each buffer in order so the result does not depend upon the block or
+// tile sizes. Reproducible point projection steps positions in fixed point.
+// Otherwise the sub-exposures of pairs of spectra from set_mirror are
+// projected two at a time with point projection. If the images are
+// snapped, point projection instead works out the fine pixels of each
+// row once for all the systemic velocities, using index, workspace of
+// nside elements; the tiles then hold rows at the same Y in each image.
+// If psum is not NULL, it holds the prefix sums of each row of the map,
+// nside+1 per row, for run-length projection. Only the runs of pixels of
+// each row left by any mask are projected. ONESUB is set if every
+// spectrum has a single sub-exposure, in which case the sub-exposures are
+// projected straight into the fine buffers, which are then scaled by their
+// weights, and tfine is not needed. SINGLE is set if the map has a single
+// image so that rows are not divided up between images. Both give results
+// identical to the general case.
+
+template <bool ONESUB, bool SINGLE>
+static void op_spectra(const Tomog::Plan& plan, int k1, int k2, size_t nrtile, 
+		       const float map[], const double psum[], double fine[], 
+		       double tfine[], size_t fstep, int index[]){
+
+  const int nfine    = plan.nfine();
+  const size_t nside = plan.nside();
+  const size_t nrow  = plan.nimage()*nside;
+  const bool foot    = plan.projector() == Tomog::PROJ_FOOTPRINT;
+  const bool dda     = !foot && plan.reproducible();
+  const bool shift   = !psum && !foot && !dda && plan.snapped();
+  const bool pair    = !psum && !foot && !dda && !shift;
+  float weight;
+  size_t nrow1, nrow2, nr, nim, yp, toff, x1, x2;
+  double *tf, *f;
+  int k, ns;
+
+  if(ONESUB) tfine = fine;
+
+  // This initialisation is needed per sub-spectrum
+  for(k=k1, toff=0; k<k2; k++){
+    ns = plan.pair_order(k);
+    for(int nt=plan.sfirst(ns); nt<plan.sfirst(ns+1); nt++, toff++){
+      tf = tfine + toff*fstep;
+      for(int j=0; j<nfine; j++) tf[j] = 0.;
+    }
+  }
+
+  // Tiles of rows at the same Y in every image
+  const int ngamma = plan.ngamma();
+  const size_t nytile = std::max(size_t(1), nrtile/plan.nimage());
+  for(size_t y1=0; shift && y1<nside; y1+=nytile){
+    const size_t y2 = std::min(nside, y1+nytile);
+    for(k=k1, toff=0; k<k2; k++){
+      ns = plan.pair_order(k);
+      for(int nt=plan.sfirst(ns); nt<plan.sfirst(ns+1); nt++, toff++){
+	const float pxscale = plan.pxscale(nt);
+	const float pyscale = plan.pyscale(nt);
+	tf = tfine + toff*fstep;
+	for(int nw=0; nw<plan.nwave(); nw++){
+	  for(yp=y1; yp<y2; yp++){
+	    Tomog::row_floor(nside, plan.fpcon(nt,ngamma*nw) + float(yp)*pyscale, pxscale, index);
+	    for(int ng=0; ng<ngamma; ng++){
+	      nr = nside*(ngamma*nw+ng)+yp;
+	      for(int nu=0; nu<plan.nrun(nr); nu++){
+		x1 = plan.run_first(nr,nu);
+		x2 = plan.run_last(nr,nu);
+		Tomog::shift_op_row(map + nside*nr + x1, index + x1, x2-x1, pxscale >= 0.f, 
+				    plan.gshift(ng), nfine, tf);
+	      }
+	    }
+	  }
+	}
+      }
+    }
+  }
+
+  // Loop over tiles, projecting a row at a time
+  for(nrow1=0; !shift && nrow1<nrow; nrow1+=nrtile){
+    nrow2 = std::min(nrow, nrow1+nrtile);
+    for(k=k1, toff=0; k<k2; k++){
+      ns = plan.pair_order(k);
+      const int ms = plan.mirror(ns);
+      if(pair && ms > ns){
 
-  // blurr array stuff
-  const int nblurr = int(3.*ndiv*fwhm/vpixd);
-  const int nbtot  = 2*nblurr+1;
-  float blurr[nbtot], sigma = fwhm/Constants::EFAC;
-  float efac = Subs::sqr(vpixd/ndiv/sigma)/2.;  
-  double sum=0.;
-  int k;
-  for(k = -nblurr; k<= nblurr; k++)
-    sum += (blurr[nblurr+k] = exp(-efac*k*k));
+	// A pair, which is next in order
+	const int nsub = plan.nsub(ns);
+	for(int nt=plan.sfirst(ns), mt=plan.sfirst(ms); nt<plan.sfirst(ns+1); nt++, mt++, toff++){
+	  const float pxscale = plan.pxscale(nt), mxscale = plan.pxscale(mt);
+	  const float pyscale = plan.pyscale(nt), myscale = plan.pyscale(mt);
+	  tf = tfine + toff*fstep;
+	  for(nr=nrow1; nr<nrow2; nr++){
+	    nim = SINGLE ? 0 : nr / nside;
+	    yp  = nr - nside*nim;
+	    const float fpcon1 = plan.fpcon(nt,nim) + float(yp)*pyscale;
+	    const float fpcon2 = plan.fpcon(mt,nim) + float(yp)*myscale;
+	    for(int nu=0; nu<plan.nrun(nr); nu++){
+	      x1 = plan.run_first(nr,nu);
+	      x2 = plan.run_last(nr,nu);
+	      Tomog::op_row_pair(map + nside*nr + x1, x2-x1, fpcon1 + float(x1)*pxscale, pxscale,
+				 fpcon2 + float(x1)*mxscale, mxscale, nfine, tf, tf + nsub*fstep);
+	    }
+	  }
+	}
+	toff += nsub;
+	k++;
+	continue;
+      }
 
-  for(k=0; k< nbtot; k++) 
-    blurr[k] /= sum;
+      for(int nt=plan.sfirst(ns); nt<plan.sfirst(ns+1); nt++, toff++){
+	const float pxscale = plan.pxscale(nt);
+	const float pyscale = plan.pyscale(nt);
+	tf = tfine + toff*fstep;
+	for(nr=nrow1; nr<nrow2; nr++){
+	  nim = SINGLE ? 0 : nr / nside;
+	  yp  = nr - nside*nim;
+	  const float fpcon = plan.fpcon(nt,nim) + float(yp)*pyscale;
+	  if(psum){
+	    Tomog::prefix_op_row(psum + (nside+1)*nr, nside, fpcon, pxscale, nfine, tf);
+	    continue;
+	  }
+	  for(int nu=0; nu<plan.nrun(nr); nu++){
+	    x1 = plan.run_first(nr,nu);
+	    x2 = plan.run_last(nr,nu);
+	    if(foot)
+	      Tomog::footprint_op_row(map + nside*nr + x1, x2-x1, fpcon + float(x1)*pxscale, 
+				      pxscale, pyscale, nfine, tf);
+	    else if(dda)
+	      Tomog::dda_op_row(map + nside*nr + x1, x2-x1, Tomog::dda_fixed(plan.fpcon(nt,nim)) + 
+				(long long)(yp)*Tomog::dda_fixed(pyscale) + (long long)(x1)*Tomog::dda_fixed(pxscale), 
+				Tomog::dda_fixed(pxscale), nfine, tf);
+	    else
+	      Tomog::op_row(map + nside*nr + x1, x2-x1, fpcon + float(x1)*pxscale, pxscale, nfine, tf);
+	  }
+	}
+      }
+    }
+  }
 
+  // Now add in with correct weight to fine buffers
+  if(ONESUB){
+    for(k=k1; k<k2; k++){
+      weight = plan.weight(plan.sfirst(plan.pair_order(k)));
+      f = fine + (k-k1)*fstep;
+      for(int j=0; j<nfine; j++) f[j] *= weight;
+    }
+    return;
+  }
+  for(k=k1, toff=0; k<k2; k++){
+    ns = plan.pair_order(k);
+    f = fine + (k-k1)*fstep;
+    for(int j=0; j<nfine; j++) f[j] = 0.;
+    for(int nt=plan.sfirst(ns); nt<plan.sfirst(ns+1); nt++, toff++){
+      weight = plan.weight(nt);
+      tf = tfine + toff*fstep;
+      for(int j=0; j<nfine; j++) f[j] += weight*tf[j];
+    }
+  }
+}
 
-  float scale  = ndiv*vpix/vpixd; // scale factor map/fine
-  float pxscale, pyscale;         // projected scale factors
-  double phase, cosp, sinp;       // phase, cosine and sine.
-  float fpcon;                    // fine pixel offset
+// Picks the version of op_spectra for a plan given the largest number of
+// sub-exposures of any spectrum
+typedef void (*Op_spectra)(const Tomog::Plan& plan, int k1, int k2, size_t nrtile, 
+			   const float map[], const double psum[], double fine[], 
+			   double tfine[], size_t fstep, int index[]);
 
-  size_t yp, xp;
-  int np;
-  float fpoff, weight;
+static Op_spectra op_spectra_kernel(const Tomog::Plan& plan, int maxsub){
+  if(maxsub == 1)
+    return plan.nimage() == 1 ? op_spectra<true,true> : op_spectra<true,false>;
+  return plan.nimage() == 1 ? op_spectra<false,true> : op_spectra<false,false>;
+}
 
-  // Loop through spectra
-  for(int ns=0, doff=0; ns<nspec; ns++){
+// Moves position k in the order given by plan.pair_order on by one if it is
+// the second of a pair, so that ranges starting there do not split pairs.
+static int pair_boundary(const Tomog::Plan& plan, int k){
+  if(k > 0 && k < plan.nspec() && plan.mirror(plan.pair_order(k)) == plan.pair_order(k-1)) k++;
+  return k;
+}
 
-    // This initialisation is needed per spectrum
-    for(k=0; k<nfine; k++) fine[k] = 0.;
+// Projection of spectrum ns for a batch of maps. The nbatch maps are interleaved, i.e.
+// the values of each pixel are stored together, as are those of the fine
+// buffers. The fine pixel of each map pixel is computed once and used for
+// all maps. index is workspace of nside elements.
 
-    for(int nt=0; nt<ntdiv; nt++){
+static void op_spectrum_batch(const Tomog::Plan& plan, int ns, int nbatch, const float map[], 
+			      double fine[], double tfine[], int index[]){
 
-      // This initialisation is needed per sub-spectrum
-      for(k=0; k<nfine; k++) tfine[k] = 0.;
+  const size_t nfine = size_t(nbatch)*plan.nfine();
+  const size_t nside = plan.nside();
+  float pxscale, pyscale, fpcon, weight;
+  size_t yp, xp, x1, x2, moff, k, nr;
+  int nb;
 
-      // Compute phase over uniformly spaced set from start to end of exposure. Times assumed
-      // to be mid-exposure
-      phase = (time[ns]+expose[ns]*(float(nt)-float(ntdiv-1)/2.)/std::max(ntdiv-1,1)-tzero)/period;
-      cosp  = cos(Constants::TWOPI*phase);
-      sinp  = sin(Constants::TWOPI*phase);
+  for(k=0; k<nfine; k++) fine[k] = 0.;
 
-      pxscale = -scale*cosp;
-      pyscale =  scale*sinp;
+  for(int nt=plan.sfirst(ns); nt<plan.sfirst(ns+1); nt++){
 
-      // Loop over images
-      for(int nwave=0, moff=0; nwave<wave.size(); nwave++){
-	for(int ngamma=0; ngamma<gamma.size(); ngamma++){
-	  
-	  // Compute fine pixel offset factor. This shows where
-	  // to add in to the fine pixel array. C = speed of light
-	  // Two other factor account for the centres of the arrays
-	  
-	  fpcon = ndiv*((npixd-1)/2. + gamma[ngamma]/vpixd + 
-			Constants::C*1.e-3*(1.-waved/wave[nwave]))
-	    -scale*(-cosp+sinp)*(nside-1)/2. + 0.5;
-	  
-	  // Finally carry out projection
-	  for(yp=0; yp<nside; yp++, fpcon += pyscale){
-	    for(xp=0, fpoff=fpcon; xp<nside; xp++, moff++, fpoff+=pxscale){
-	      np  = int(floor(fpoff));
-	      if(np >= 0 && np < nfine) tfine[np] += map[moff];
-	    }
-	  }    
-	}  
+    for(k=0; k<nfine; k++) tfine[k] = 0.;
+
+    pxscale = plan.pxscale(nt);
+    pyscale = plan.pyscale(nt);
+
+    for(int nim=0; nim<plan.nimage(); nim++){
+      for(yp=0; yp<nside; yp++){
+	nr = nside*nim+yp;
+	for(int nu=0; nu<plan.nrun(nr); nu++){
+	  moff  = nside*nr + plan.run_first(nr,nu);
+	  fpcon = plan.fpcon(nt,nim) + float(yp)*pyscale + float(plan.run_first(nr,nu))*pxscale;
+	  Tomog::clip_row(plan.run_last(nr,nu)-plan.run_first(nr,nu), fpcon, pxscale, plan.nfine(), x1, x2);
+	  Tomog::row_index(x1, x2, fpcon, pxscale, plan.nfine(), index);
+	  for(xp=x1; xp<x2; xp++){
+	    const float *mp = map + nbatch*(moff+xp);
+	    double *tf = tfine + nbatch*size_t(index[xp-x1]);
+	    for(nb=0; nb<nbatch; nb++)
+	      tf[nb] += mp[nb];
+	  }
+	}
+      }
+    }
+
+    weight = plan.weight(nt);
+    for(k=0; k<nfine; k++) fine[k] += weight*tfine[k];
+  }
+}
+
+// Number of threads used by op
+static int op_nthread(const Tomog::Plan& plan){
+  return std::max(1, std::min(Tomog::get_nthread(), plan.nspec()));
+}
+
+// Number of fine buffers per spectrum needed by op for a single map given
+// the largest number of sub-exposures of any spectrum, one for the spectrum
+// and one per sub-exposure unless there is only one.
+static int op_nbuff(int maxsub){
+  return maxsub > 1 ? maxsub+1 : 1;
+}
+
+// Number of spectra per block and map rows per tile used by op for a
+// single map, along with the largest number of sub-exposures of any
+// spectrum. Half the cache goes to the fine buffers of a block of 
+// spectra and half to a tile of the map. Each thread needs at least 
+// one block, and with pairs of spectra blocks have at least two spectra
+// and may have one more than nsblock as they do not split pairs.
+static void op_block(const Tomog::Plan& plan, int nthread, int& nsblock, 
+		     size_t& nrtile, int& maxsub){
+  const size_t ncache = Tomog::get_cache_size()/2;
+  maxsub = 1;
+  for(int ns=0; ns<plan.nspec(); ns++)
+    maxsub = std::max(maxsub, plan.nsub(ns));
+  const size_t nbspec = op_nbuff(maxsub)*Tomog::Workspace::stride<double>(plan.nfine())*sizeof(double);
+  nsblock = int(std::max(size_t(plan.paired() ? 2 : 1), 
+			 std::min(ncache/nbspec, size_t((plan.nspec()+nthread-1)/nthread))));
+  nrtile  = std::max(size_t(1), ncache/(plan.nside()*sizeof(float)));
+}
+
+// Number of doubles of fine buffer per thread needed by op. A single map
+// needs the fine buffers of op_nbuff for each spectrum of a block; a 
+// batch needs two interleaved ones plus one to extract each map's buffer 
+// for the blurring.
+static size_t op_fine_step(const Tomog::Plan& plan, int nbatch){
+  const size_t fstep = Tomog::Workspace::stride<double>(plan.nfine());
+  if(nbatch == 1){
+    int nsblock, maxsub;
+    size_t nrtile;
+    op_block(plan, op_nthread(plan), nsblock, nrtile, maxsub);
+    if(plan.paired()) nsblock++;
+    return nsblock*op_nbuff(maxsub)*fstep;
+  }
+  return 2*Tomog::Workspace::stride<double>(nbatch*size_t(plan.nfine())) + fstep;
+}
+
+// Above this number of bytes of extra memory, tr divides the map into
+// tiles of rows between its threads rather than giving each thread a 
+// private copy of the map.
+static const size_t TR_PRIVATE_MAX = 64*1024*1024;
+
+// Number of threads used by tr and whether each gets a private copy
+// of the maps. There are two ways to divide the work between threads. If
+// the maps are small, each thread handles a block of spectra and accumulates
+// into its own copy of the maps. These are added together at the end. If 
+// the copies would take up too much memory, each thread instead looks after
+// a block of rows of the maps and runs through all the spectra. The second
+// method gives results identical to a single thread, so it is the one used
+// for reproducible projections. It cannot be used with a sparse matrix, which
+// is therefore run single-threaded if the maps are big.
+static int tr_nthread(const Tomog::Plan& plan, int nbatch, bool& priv){
+  int nthread = std::max(1, Tomog::get_nthread());
+  priv = nthread > 1 && nthread <= plan.nspec() && !plan.reproducible() && 
+    (nthread-1)*nbatch*plan.nmap()*sizeof(float) <= TR_PRIVATE_MAX;
+  if(plan.sparse() && !priv) nthread = 1;
+  return nthread;
+}
+
+// Whether op_batch and tr_batch can project a batch of maps together with
+// the interleaved kernels. These only cover the usual point projection with
+// each image placed from its own offsets, or a sparse matrix. Reproducible
+// projections, footprints and snapped systemic velocities, whose single-map
+// kernels place the pixels differently, are handled a map at a time so that
+// a batch gives the same results as separate calls.
+static bool interleaved(const Tomog::Plan& plan){
+  return plan.sparse() || (plan.projector() == Tomog::PROJ_POINT && 
+			   !plan.reproducible() && !plan.snapped());
+}
+
+/** Makes sure that the buffers are large enough for op and tr, or op_batch and
+ * tr_batch, to run with a given Plan without allocating any memory. This depends 
+ * upon the number of threads, so should be called again if that is changed.
+ * \param plan   the Plan that will be passed to op and tr
+ * \param nbatch the number of maps or data sets per call of op_batch and tr_batch
+ */
+void Tomog::Workspace::reserve(const Plan& plan, int nbatch){
+
+  if(plan.grouped()){
+    get<float>(GROUP, nbatch*plan.group_plan().ndata());
+    reserve(plan.group_plan(), nbatch);
+    return;
+  }
+
+  if(plan.projector() == PROJ_FOURIER){
+    const size_t nthread = std::max(1, get_nthread());
+    get<double>(FINE, std::max(plan.nspec(), plan.nsub())*stride<double>(2*plan.nfreq()));
+    get<float>(FFT, nthread*stride<float>(plan.nfwork()));
+    get<float>(GRID, 2*plan.ngrid()*plan.ngrid());
+    return;
+  }
+
+  // See op_batch
+  if(!interleaved(plan)) nbatch = 1;
+
+  const size_t fstep = stride<double>(plan.nfine());
+  const size_t bstep = stride<double>(nbatch*size_t(plan.nfine()));
+  const size_t wstep = stride<float>(plan.nfft());
+  const size_t mstep = stride<float>(nbatch*plan.nmap());
+
+  bool priv;
+  const int nthop = op_nthread(plan), nthtr = tr_nthread(plan, nbatch, priv);
+  const int nthread = std::max(nthop, nthtr);
+  get<double>(FINE, std::max(nthop*op_fine_step(plan, nbatch), 
+			      plan.nspec()*bstep + nthtr*(bstep+fstep)));
+  get<float>(FFT, nthread*wstep);
+  if(nbatch > 1)
+    get<float>(BATCH, mstep);
+  if(nbatch > 1 || plan.snapped())
+    get<int>(INDEX, nthread*stride<int>(plan.nside()));
+  if(priv) get<float>(MAP, (nthtr-1)*mstep);
+  if(nbatch == 1 && prefix_rows(plan))
+    get<double>(PREFIX, plan.nimage()*plan.nside()*(plan.nside()+1));
+}
+
+void Tomog::op(const Plan& plan, const float map[], float data[]){
+  Workspace work;
+  op_batch(plan, 1, map, data, work);
+}
+
+void Tomog::op(const Plan& plan, const float map[], float data[], Workspace& work){
+  op_batch(plan, 1, map, data, work);
+}
+
+/** Computes model data from several maps with the same geometry. This is
+ * faster than calling op for each map in turn because the location of each
+ * map pixel in the spectra is worked out once for all of them, and the
+ * maps are interleaved so that the values of each pixel are next to
+ * each other in memory.
+ * \param plan   the geometry
+ * \param nbatch the number of maps
+ * \param map    the maps, one after the other, each of plan.nmap() pixels
+ * \param data   the data, one set per map, each of plan.ndata() pixels
+ * \param work   workspace
+ */
+void Tomog::op_batch(const Plan& plan, int nbatch, const float map[], float data[], Workspace& work){
+
+  // The row kernels must be chosen before any threads start
+  get_simd();
+
+  // Grouped spectra are projected once per group and copied to each member
+  if(plan.grouped()){
+    const Plan& gplan = plan.group_plan();
+    float *gdata = work.get<float>(Workspace::GROUP, nbatch*gplan.ndata());
+    op_batch(gplan, nbatch, map, gdata, work);
+    const int npixd = plan.npixd();
+    for(int nb=0; nb<nbatch; nb++){
+      for(int ns=0; ns<plan.nspec(); ns++){
+	const float *gp = gdata + gplan.ndata()*nb + size_t(npixd)*plan.group(ns);
+	float *dp = data + plan.ndata()*nb + size_t(npixd)*ns;
+	for(int np=0; np<npixd; np++) dp[np] = gp[np];
       }
+    }
+    return;
+  }
+
+  if(plan.projector() == PROJ_FOURIER){
+    for(int nb=0; nb<nbatch; nb++)
+      plan.fourier_op(map + plan.nmap()*nb, data + plan.ndata()*nb, work);
+    return;
+  }
+
+  // Maps that the interleaved projection does not cover are handled one at a time
+  if(nbatch > 1 && !interleaved(plan)){
+    for(int nb=0; nb<nbatch; nb++)
+      op_batch(plan, 1, map + plan.nmap()*nb, data + plan.ndata()*nb, work);
+    return;
+  }
+
+  const int nfine   = plan.nfine();   // number of pixels in fine pixel buffer.
+  const int npixd   = plan.npixd();
+  const int nspec   = plan.nspec();
+  const size_t nmap = plan.nmap();
+  const size_t ndat = plan.ndata();
+
+  // Spacing of the per-thread buffers, rounded up to keep them aligned
+  const size_t fstep = Workspace::stride<double>(nfine);
+  const size_t bstep = Workspace::stride<double>(nbatch*size_t(nfine));
+  const size_t tstep = op_fine_step(plan, nbatch);
+  const size_t wstep = Workspace::stride<float>(plan.nfft());
+  const size_t istep = Workspace::stride<int>(plan.nside());
+
+  // Spectra are independent of each other so they are divided in 
+  // contiguous blocks between the threads, each of which has its own
+  // fine buffers and FFT workspace. The buffers are obtained here
+  // rather than inside the parallel section so that any allocation 
+  // failure can be caught in the usual way.
+  const int nthread = op_nthread(plan);
+  double *fbuff = work.get<double>(Workspace::FINE, nthread*tstep);
+
+  // A single map is projected for blocks of spectra at a time
+  const bool blocked = nbatch == 1 && !plan.sparse();
+  int nsblock, maxsub;
+  size_t nrtile;
+  op_block(plan, nthread, nsblock, nrtile, maxsub);
+  const int nblock = blocked ? (nspec+nsblock-1)/nsblock : 0;
+  const int mxblock = plan.paired() ? nsblock+1 : nsblock;
+  const Op_spectra project = op_spectra_kernel(plan, maxsub);
+
+  // Prefix sums of the rows for run-length projection
+  const size_t nrow = plan.nimage()*plan.nside();
+  double *psum = blocked && prefix_rows(plan) ? 
+    work.get<double>(Workspace::PREFIX, nrow*(plan.nside()+1)) : NULL;
+
+  float  *wbuff = work.get<float>(Workspace::FFT, nthread*wstep);
+  int    *ibuff = NULL;
+  float  *mapi  = NULL;
+  if(nbatch > 1 && !plan.sparse()){
+    ibuff = work.get<int>(Workspace::INDEX, nthread*istep);
+    mapi  = work.get<float>(Workspace::BATCH, nbatch*nmap);
+  }else if(blocked && plan.snapped()){
+    ibuff = work.get<int>(Workspace::INDEX, nthread*istep);
+  }
+
+#ifdef _OPENMP
+#pragma omp parallel num_threads(nthread)
+#endif
+  {
+
+#ifdef _OPENMP
+    const int ithread = omp_get_thread_num();
+#else
+    const int ithread = 0;
+#endif
+    double *fine  = fbuff + tstep*ithread;
+    float  *fwork = wbuff + wstep*ithread;
+    int nb;
+
+    // Interleave the maps
+    if(mapi){
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+      for(size_t moff=0; moff<nmap; moff++)
+	for(nb=0; nb<nbatch; nb++)
+	  mapi[nbatch*moff+nb] = map[nmap*nb+moff];
+    }
+
+    if(psum){
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+      for(size_t nr=0; nr<nrow; nr++)
+	Tomog::row_prefix(map + plan.nside()*nr, plan.nside(), psum + (plan.nside()+1)*nr);
+    }
+
+    // Loop through blocks of spectra
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+    for(int nbl=0; nbl<nblock; nbl++){
+
+      const int k1 = pair_boundary(plan, std::min(nspec, nsblock*nbl));
+      const int k2 = pair_boundary(plan, std::min(nspec, nsblock*(nbl+1)));
+
+      // Projection into the fine buffers
+      project(plan, k1, k2, nrtile, map, psum, fine, maxsub > 1 ? fine + mxblock*fstep : NULL, 
+	      fstep, ibuff ? ibuff + istep*ithread : NULL);
+
+      // Blurr and bin into output spectra
+      for(int k=k1; k<k2; k++)
+	plan.blurr_op(fine + (k-k1)*fstep, data + size_t(npixd)*plan.pair_order(k), fwork);
+    }
+
+    // Loop through spectra
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+    for(int ns=0; ns<(blocked ? 0 : nspec); ns++){
+
+      if(plan.sparse()){
+
+	for(nb=0; nb<nbatch; nb++){
+	  plan.sparse_op(ns, map + nmap*nb, fine);
+	  plan.blurr_op(fine, data + ndat*nb + size_t(npixd)*ns, fwork);
+	}
 
-      // Now add in with correct weight to fine buffer
-      // The xpix squared factor is to give a similar intensity
-      // regardless of the pixel size. i.e. the pixel values are
-      // per 10^4 (km/s)**2
-      if(ntdiv > 1 && (nt == 0 || nt == ntdiv - 1)){
-	weight = Subs::sqr(vpix/100.)/(2*std::max(1,ntdiv-1));
       }else{
-	weight = 2.*Subs::sqr(vpix/100.)/(2*std::max(1,ntdiv-1));
+
+	double *dfine = fine + 2*bstep;
+	op_spectrum_batch(plan, ns, nbatch, mapi, fine, fine + bstep, ibuff + istep*ithread);
+	for(nb=0; nb<nbatch; nb++){
+	  for(int k=0; k<nfine; k++) dfine[k] = fine[nbatch*k+nb];
+	  plan.blurr_op(dfine, data + ndat*nb + size_t(npixd)*ns, fwork);
+	}
+      }
+    }
+  }
+}
+
+// Transpose of the projection of sub-exposure nt. Adds tfine into rows 
+// nrow1 to nrow2-1 of the map where rows are counted continuously through
+// all the images. If diff is true, the rows are difference arrays for
+// run-length projection. Reproducible point projection steps positions in
+// fixed point. Otherwise if the images are snapped, point projection works
+// out the fine pixels of each row once for all the systemic velocities,
+// using index, workspace of nside elements. Only the runs of pixels of
+// each row left by any mask are touched. SINGLE is set if the map has a
+// single image.
+
+template <bool SINGLE>
+static void tr_rows(const Tomog::Plan& plan, int nt, const double tfine[], 
+		    size_t nrow1, size_t nrow2, bool diff, float map[], int index[]){
+
+  const int nfine     = plan.nfine();
+  const size_t nside  = plan.nside();
+  const float pxscale = plan.pxscale(nt);
+  const float pyscale = plan.pyscale(nt);
+  const bool foot     = plan.projector() == Tomog::PROJ_FOOTPRINT;
+  size_t nim, yp, x1, x2;
+
+  if(!diff && !foot && plan.reproducible()){
+    for(size_t nrow=nrow1; nrow<nrow2; nrow++){
+      nim = SINGLE ? 0 : nrow / nside;
+      yp  = nrow - nside*nim;
+      for(int nu=0; nu<plan.nrun(nrow); nu++){
+	x1 = plan.run_first(nrow,nu);
+	x2 = plan.run_last(nrow,nu);
+	Tomog::dda_tr_row(tfine, x2-x1, Tomog::dda_fixed(plan.fpcon(nt,nim)) + 
+			  (long long)(yp)*Tomog::dda_fixed(pyscale) + (long long)(x1)*Tomog::dda_fixed(pxscale), 
+			  Tomog::dda_fixed(pxscale), nfine, map + nside*nrow + x1);
+      }
+    }
+    return;
+  }
+
+  if(!diff && !foot && plan.snapped()){
+    const int ngamma = plan.ngamma();
+    for(int nw=0; nw<plan.nwave(); nw++){
+      for(yp=0; yp<nside; yp++){
+	bool first = true;
+	for(int ng=0; ng<ngamma; ng++){
+	  const size_t nrow = nside*(ngamma*nw+ng)+yp;
+	  if(nrow < nrow1 || nrow >= nrow2) continue;
+	  if(first){
+	    Tomog::row_floor(nside, plan.fpcon(nt,ngamma*nw) + float(yp)*pyscale, pxscale, index);
+	    first = false;
+	  }
+	  for(int nu=0; nu<plan.nrun(nrow); nu++){
+	    x1 = plan.run_first(nrow,nu);
+	    x2 = plan.run_last(nrow,nu);
+	    Tomog::shift_tr_row(tfine, index + x1, x2-x1, pxscale >= 0.f, plan.gshift(ng), nfine, 
+				map + nside*nrow + x1);
+	  }
+	}
       }
-      for(k=0; k<nfine; k++) fine[k] += weight*tfine[k];
     }
+    return;
+  }
+
+  for(size_t nrow=nrow1; nrow<nrow2; nrow++){
+    nim = SINGLE ? 0 : nrow / nside;
+    yp  = nrow - nside*nim;
+    const float fpcon = plan.fpcon(nt,nim) + float(yp)*pyscale;
+    if(diff){
+      Tomog::prefix_tr_row(tfine, nside, fpcon, pxscale, nfine, map + nside*nrow);
+      continue;
+    }
+    for(int nu=0; nu<plan.nrun(nrow); nu++){
+      x1 = plan.run_first(nrow,nu);
+      x2 = plan.run_last(nrow,nu);
+      if(foot)
+	Tomog::footprint_tr_row(tfine, x2-x1, fpcon + float(x1)*pxscale, pxscale, 
+				pyscale, nfine, map + nside*nrow + x1);
+      else
+	Tomog::tr_row(tfine, x2-x1, fpcon + float(x1)*pxscale, pxscale, nfine, map + nside*nrow + x1);
+    }
+  }
+}
+
+// Version of tr_rows for sub-exposures nt and mt of a pair of spectra from
+// set_mirror, with fine buffers tfine1 and tfine2, taking each row once.
+
+template <bool SINGLE>
+static void tr_rows_pair(const Tomog::Plan& plan, int nt, int mt, const double tfine1[], 
+			 const double tfine2[], size_t nrow1, size_t nrow2, float map[]){
+
+  const int nfine     = plan.nfine();
+  const size_t nside  = plan.nside();
+  const float pxscale = plan.pxscale(nt), mxscale = plan.pxscale(mt);
+  const float pyscale = plan.pyscale(nt), myscale = plan.pyscale(mt);
+  size_t nim, yp, x1, x2;
+
+  for(size_t nrow=nrow1; nrow<nrow2; nrow++){
+    nim = SINGLE ? 0 : nrow / nside;
+    yp  = nrow - nside*nim;
+    const float fpcon1 = plan.fpcon(nt,nim) + float(yp)*pyscale;
+    const float fpcon2 = plan.fpcon(mt,nim) + float(yp)*myscale;
+    for(int nu=0; nu<plan.nrun(nrow); nu++){
+      x1 = plan.run_first(nrow,nu);
+      x2 = plan.run_last(nrow,nu);
+      Tomog::tr_row_pair(tfine1, tfine2, x2-x1, fpcon1 + float(x1)*pxscale, pxscale,
+			 fpcon2 + float(x1)*mxscale, mxscale, nfine, map + nside*nrow + x1);
+    }
+  }
+}
+
+// Batched version of tr_rows for nbatch interleaved fine buffers and maps.
+// index is workspace of nside elements.
 
-    // Blurr and bin into output spectrum
-    for(i=0; i<npixd; i++){
-      sum = 0.;
-      off = ndiv*i;
-      for(l=off; l<off+ndiv; l++){
-	for(k = 0, j=l-nblurr; k<nbtot; k++, j++)
-	  if(j >= 0 && j < nfine) sum += blurr[k]*fine[j];
+static void tr_rows_batch(const Tomog::Plan& plan, int nt, int nbatch, const double tfine[], 
+			  size_t nrow1, size_t nrow2, float map[], int index[]){
+
+  const int nfine     = plan.nfine();
+  const size_t nside  = plan.nside();
+  const float pxscale = plan.pxscale(nt);
+  const float pyscale = plan.pyscale(nt);
+  float fpcon;
+  size_t nim, yp, xp, x1, x2, moff;
+  int nb;
+
+  for(size_t nrow=nrow1; nrow<nrow2; nrow++){
+    nim   = nrow / nside;
+    yp    = nrow - nside*nim;
+    for(int nu=0; nu<plan.nrun(nrow); nu++){
+      moff  = nside*nrow + plan.run_first(nrow,nu);
+      fpcon = plan.fpcon(nt,nim) + float(yp)*pyscale + float(plan.run_first(nrow,nu))*pxscale;
+      Tomog::clip_row(plan.run_last(nrow,nu)-plan.run_first(nrow,nu), fpcon, pxscale, nfine, x1, x2);
+      Tomog::row_index(x1, x2, fpcon, pxscale, nfine, index);
+      for(xp=x1; xp<x2; xp++){
+	float *mp = map + nbatch*(moff+xp);
+	const double *tf = tfine + nbatch*size_t(index[xp-x1]);
+	for(nb=0; nb<nbatch; nb++)
+	  mp[nb] += tf[nb];
       }
-      data[doff++] = sum;
     }
   }
 }
@@ -113,110 +773,245 @@ void Tomog::tr(const float data[], const Subs::Array1D<double>& wave,
 		 float fwhm, int ndiv, int ntdiv, int npixd, int nspec, float vpixd, 
 		 double waved, const Subs::Array1D<double>& time, const Subs::Array1D<float>& expose, 
 		 double tzero, double period, float map[]){
-  
-  
-  int i, j, l, off;
-
-  const int nfine = ndiv*npixd;   // number of pixels in fine pixel buffer.
-  double fine[nfine], tfine[nfine]; // fine buffers
-  
-  // blurr array stuff
-  const int nblurr = int(3.*ndiv*fwhm/vpixd);
-  const int nbtot = 2*nblurr+1;
-  float blurr[nbtot], sigma = fwhm/Constants::EFAC;
-  float efac = Subs::sqr(vpixd/ndiv/sigma)/2., add;
-  
-  int k;
-  double sum = 0.;
-  for(k = -nblurr; k<= nblurr; k++)
-    sum += (blurr[nblurr+k] = exp(-efac*k*k));
-
-  for(k=0; k< nbtot; k++)
-    blurr[k] /= sum;
-
-
-  // Loop through spectra
-  float scale  = ndiv*vpix/vpixd; // scale factor map/fine
-  float pxscale, pyscale;         // projected scale factors
-  double phase, cosp, sinp;       // phase, cosine and sine.
-  float fpcon;             // fine pixel offset
-
-  size_t xp, yp;
-  int np;
-  float fpoff, weight;
-
-  for(int nwave=0, moff=0; nwave<wave.size(); nwave++){
-    for(int ngamma=0; ngamma<gamma.size(); ngamma++){
-      for(xp=0; xp<nside; xp++){
-	for(yp=0; yp<nside; yp++){
-	  map[moff++] = 0.;
-	}
+
+  Plan plan(wave, gamma, nside, vpix, fwhm, ndiv, ntdiv, npixd, nspec, 
+	    vpixd, waved, time, expose, tzero, period);
+  tr(plan, data, map);
+}
+
+void Tomog::tr(const Plan& plan, const float data[], float map[]){
+  Workspace work;
+  tr_batch(plan, 1, data, map, work);
+}
+
+void Tomog::tr(const Plan& plan, const float data[], float map[], Workspace& work){
+  tr_batch(plan, 1, data, map, work);
+}
+
+/** Transposed version of op_batch.
+ * \param plan   the geometry
+ * \param nbatch the number of data sets
+ * \param data   the data sets, one after the other, each of plan.ndata() pixels
+ * \param map    the maps, one per data set, each of plan.nmap() pixels
+ * \param work   workspace
+ */
+void Tomog::tr_batch(const Plan& plan, int nbatch, const float data[], float map[], Workspace& work){
+
+  // The row kernels must be chosen before any threads start
+  get_simd();
+
+  // The members of each group of spectra are added together first
+  if(plan.grouped()){
+    const Plan& gplan = plan.group_plan();
+    float *gdata = work.get<float>(Workspace::GROUP, nbatch*gplan.ndata());
+    for(size_t k=0; k<nbatch*gplan.ndata(); k++) gdata[k] = 0.;
+    const int npixd = plan.npixd();
+    for(int nb=0; nb<nbatch; nb++){
+      for(int ns=0; ns<plan.nspec(); ns++){
+	float *gp = gdata + gplan.ndata()*nb + size_t(npixd)*plan.group(ns);
+	const float *dp = data + plan.ndata()*nb + size_t(npixd)*ns;
+	for(int np=0; np<npixd; np++) gp[np] += dp[np];
       }
     }
+    tr_batch(gplan, nbatch, gdata, map, work);
+    return;
+  }
+
+  if(plan.projector() == PROJ_FOURIER){
+    for(int nb=0; nb<nbatch; nb++)
+      plan.fourier_tr(data + plan.ndata()*nb, map + plan.nmap()*nb, work);
+    return;
   }
-  
-  for(int ns=0, doff=0; ns<nspec; ns++){
-
-    // This initialisation is needed per spectrum
-    for(k=0; k<nfine; k++) fine[k] = 0.;
-
-    // Transpose of blurr and bin section
-    for(i=0; i<npixd; i++){
-      add = data[doff++];
-      off = ndiv*i;
-      for(l=off; l<off+ndiv; l++){
-	for(k = 0, j=l-nblurr; k<nbtot; k++, j++)
-	  if(j >= 0 && j < nfine) fine[j] += blurr[k]*add;
-      }
-    }
 
-    // Now finite exposure loop
-    for(int nt=0; nt<ntdiv; nt++){
+  // As in op_batch
+  if(nbatch > 1 && !interleaved(plan)){
+    for(int nb=0; nb<nbatch; nb++)
+      tr_batch(plan, 1, data + plan.ndata()*nb, map + plan.nmap()*nb, work);
+    return;
+  }
 
-      // Compute phase over uniformly spaced set from start to end of exposure. Times assumed
-      // to be mid-exposure
-      phase = (time[ns]+expose[ns]*(float(nt)-float(ntdiv-1)/2.)/std::max(ntdiv-1,1)-tzero)/period;
+  const int nfine   = plan.nfine();   // number of pixels in fine pixel buffer.
+  const int npixd   = plan.npixd();
+  const int nspec   = plan.nspec();
+  const size_t nmap = plan.nmap();
+  const size_t ndat = plan.ndata();
+  const size_t nrow = plan.nimage()*plan.nside();
 
-      cosp  = cos(Constants::TWOPI*phase);
-      sinp  = sin(Constants::TWOPI*phase);
+  // With more than one data set, the fine buffers and maps are interleaved
+  // unless a sparse matrix is in use.
+  const bool inter  = nbatch > 1 && !plan.sparse();
 
-      pxscale = -scale*cosp;
-      pyscale =  scale*sinp;
+  // Spacing of the buffers, rounded up to keep them aligned
+  const size_t fstep = Workspace::stride<double>(nfine);
+  const size_t bstep = Workspace::stride<double>(nbatch*size_t(nfine));
+  const size_t wstep = Workspace::stride<float>(plan.nfft());
+  const size_t mstep = Workspace::stride<float>(nbatch*nmap);
+  const size_t istep = Workspace::stride<int>(plan.nside());
 
-      // Now add in with correct weight to fine buffer
-      // The xpix squared factor is to give a similar intensity
-      // regardless of the pixel size. i.e. the pixel values are
-      // per 10^4 (km/s)**2
-      if(ntdiv > 1 && (nt == 0 || nt == ntdiv - 1)){
-	weight = Subs::sqr(vpix/100.)/(2*std::max(1,ntdiv-1));
-      }else{
-	weight = 2.*Subs::sqr(vpix/100.)/(2*std::max(1,ntdiv-1));
+  bool priv;
+  const int nthread = tr_nthread(plan, nbatch, priv);
+
+  // With a single sub-exposure per spectrum, the weights are applied as
+  // the fine buffers are made rather than once per sub-exposure. A sparse
+  // matrix has the weights in it already.
+  bool onesub = !plan.sparse();
+  for(int ns=0; ns<nspec && onesub; ns++)
+    onesub = plan.nsub(ns) == 1;
+  const bool single = plan.nimage() == 1;
+
+  // Whether the maps are built up as difference arrays along their rows
+  const bool diff = !inter && prefix_rows(plan);
+
+  // Transpose of blurr and bin section, one fine buffer per spectrum
+  // and data set. Extra buffers are needed for weighting each sub-exposure
+  // and for interleaving.
+  double *fine  = work.get<double>(Workspace::FINE, nspec*bstep + nthread*(bstep+fstep));
+  float  *wbuff = work.get<float>(Workspace::FFT, nthread*wstep);
+  float  *mbuff = priv ? work.get<float>(Workspace::MAP, (nthread-1)*mstep) : NULL;
+  int    *ibuff = inter || plan.snapped() ? work.get<int>(Workspace::INDEX, nthread*istep) : NULL;
+  float  *mapi  = inter ? work.get<float>(Workspace::BATCH, nbatch*nmap) : map;
+
+  for(size_t moff=0; moff<nbatch*nmap; moff++)
+    mapi[moff] = 0.;
+
+#ifdef _OPENMP
+#pragma omp parallel num_threads(nthread)
+#endif
+  {
+
+#ifdef _OPENMP
+    const int ithread = omp_get_thread_num();
+#else
+    const int ithread = 0;
+#endif
+
+    int k, nb;
+    float weight;
+    double *sfine, *tfine = fine + nspec*bstep + (bstep+fstep)*ithread;
+    double *dfine = tfine + bstep;
+
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+    for(int ns=0; ns<nspec; ns++){
+      sfine = fine + ns*bstep;
+      weight = plan.weight(plan.sfirst(ns));
+      for(nb=0; nb<nbatch; nb++){
+	if(inter){
+	  plan.blurr_tr(data + ndat*nb + size_t(npixd)*ns, dfine, wbuff + wstep*ithread);
+	  if(onesub)
+	    for(k=0; k<nfine; k++) sfine[nbatch*k+nb] = weight*dfine[k];
+	  else
+	    for(k=0; k<nfine; k++) sfine[nbatch*k+nb] = dfine[k];
+	}else{
+	  plan.blurr_tr(data + ndat*nb + size_t(npixd)*ns, sfine + fstep*nb, wbuff + wstep*ithread);
+	  if(onesub)
+	    for(k=0; k<nfine; k++) sfine[fstep*nb+k] *= weight;
+	}
       }
+    }
 
-      for(k=0; k<nfine; k++) tfine[k] = weight*fine[k];
+    // Work out which spectra and rows this thread is responsible for. The
+    // spectra are taken in the order given by pair_order.
+    int k1 = 0, k2 = nspec;
+    size_t nrow1 = 0, nrow2 = nrow;
+    float *tmap = mapi;
+    if(priv){
+      k1 = pair_boundary(plan, (nspec*ithread)/nthread);
+      k2 = pair_boundary(plan, (nspec*(ithread+1))/nthread);
+      if(ithread){
+	tmap = mbuff + (ithread-1)*mstep;
+	for(size_t moff=0; moff<nbatch*nmap; moff++)
+	  tmap[moff] = 0.;
+      }
+    }else{
+      nrow1 = (nrow*ithread)/nthread;
+      nrow2 = (nrow*(ithread+1))/nthread;
+    }
 
-      // Transpose of projection section
-      for(int nwave=0, moff=0; nwave<wave.size(); nwave++){
-	for(int ngamma=0; ngamma<gamma.size(); ngamma++){
-	  
-	  // Compute fine pixel offset factor. This shows where
-	  // to add in to the fine pixel array. C = speed of light
-	  // Two other factor account for the centres of the arrays
-	  
-	  fpcon = ndiv*((npixd-1)/2. + gamma[ngamma]/vpixd + 
-			Constants::C*1.e-3*(1.-waved/wave[nwave]))
-	    -scale*(-cosp+sinp)*(nside-1)/2. + 0.5;
-	  
-	  for(yp=0; yp<nside; yp++, fpcon+=pyscale){
-	    for(xp=0, fpoff=fpcon; xp<nside; xp++, moff++, fpoff+=pxscale){
-	      np  = int(floor(fpoff));
-	      if(np >= 0 && np < nfine) map[moff] += tfine[np];
+    for(int kp=k1; kp<k2; kp++){
+
+      const int ns = plan.pair_order(kp), ms = plan.mirror(ns);
+      sfine = fine + ns*bstep;
+
+      if(plan.sparse()){
+	for(nb=0; nb<nbatch; nb++)
+	  plan.sparse_tr(ns, sfine + fstep*nb, tmap + nmap*nb);
+	continue;
+      }
+
+      // A pair, which is next in order, with point projection of a single
+      // data set. dfine is free to hold the partner's weighted buffer.
+      if(ms > ns && !inter && !diff && plan.projector() == PROJ_POINT && !plan.snapped() && 
+	 !plan.reproducible()){
+	const double *mfine = fine + ms*bstep;
+	for(int nt=plan.sfirst(ns), mt=plan.sfirst(ms); nt<plan.sfirst(ns+1); nt++, mt++){
+	  const double *tf1 = sfine, *tf2 = mfine;
+	  if(!onesub){
+	    const float mweight = plan.weight(mt);
+	    weight = plan.weight(nt);
+	    for(k=0; k<nfine; k++){
+	      tfine[k] = weight*sfine[k];
+	      dfine[k] = mweight*mfine[k];
 	    }
+	    tf1 = tfine;
+	    tf2 = dfine;
 	  }
-	}      
+	  if(single)
+	    tr_rows_pair<true>(plan, nt, mt, tf1, tf2, nrow1, nrow2, tmap);
+	  else
+	    tr_rows_pair<false>(plan, nt, mt, tf1, tf2, nrow1, nrow2, tmap);
+	}
+	kp++;
+	continue;
+      }
+
+      // Now finite exposure loop
+      for(int nt=plan.sfirst(ns); nt<plan.sfirst(ns+1); nt++){
+
+	// Add in with correct weight to fine buffer
+	const double *tf = sfine;
+	if(!onesub){
+	  weight = plan.weight(nt);
+	  for(k=0; k<nbatch*nfine; k++) tfine[k] = weight*sfine[k];
+	  tf = tfine;
+	}
+
+	// Transpose of projection section
+	if(inter){
+	  tr_rows_batch(plan, nt, nbatch, tf, nrow1, nrow2, tmap, ibuff + istep*ithread);
+	}else if(single){
+	  tr_rows<true>(plan, nt, tf, nrow1, nrow2, diff, tmap, ibuff ? ibuff + istep*ithread : NULL);
+	}else{
+	  tr_rows<false>(plan, nt, tf, nrow1, nrow2, diff, tmap, ibuff ? ibuff + istep*ithread : NULL);
+	}
+      }
+    }
+
+    // Convert difference arrays back to maps
+    if(diff){
+      for(size_t nr=nrow1; nr<nrow2; nr++)
+	Tomog::row_integrate(tmap + plan.nside()*nr, plan.nside());
+    }
+
+    // Add in the private maps and undo any interleaving
+    if(priv || inter){
+#ifdef _OPENMP
+#pragma omp barrier
+#pragma omp for schedule(static)
+#endif
+      for(size_t moff=0; moff<nmap; moff++){
+	for(nb=0; nb<nbatch; nb++){
+	  const size_t off = inter ? nbatch*moff+nb : nmap*nb+moff;
+	  float sum = mapi[off];
+	  for(int n=0; n<nthread-1 && priv; n++)
+	    sum += mbuff[n*mstep+off];
+	  map[nmap*nb+moff] = sum;
+	}
       }
     }
   }
+
 }
 
 // Computes gaussian default image. This blurrs by fwhm pixels
@@ -225,6 +1020,13 @@ void Tomog::tr(const float data[], const Subs::Array1D<double>& wave,
 
 void Tomog::gaussdef(const float input[], size_t nwave, size_t ngamma, 
 		       size_t nside, float fwhm, float gfwhm, float output[]){
+  Workspace work;
+  gaussdef(input, nwave, ngamma, nside, fwhm, gfwhm, output, work);
+}
+
+void Tomog::gaussdef(const float input[], size_t nwave, size_t ngamma, 
+		       size_t nside, float fwhm, float gfwhm, float output[],
+		       Workspace& work){
 
   // copy input to output
   size_t npix = nside*nside;
@@ -242,8 +1044,9 @@ void Tomog::gaussdef(const float input[], size_t nwave, size_t ngamma,
   ntotg  = size_t(pow(2.,int(log(float(ntotg))/log(2.))+1));
 
   // grab space for larger of two 
-  float* work1 = new float[std::max(ntoti,ntotg)];
-  float* work2 = new float[std::max(ntoti,ntotg)];
+  const size_t nstep = Workspace::stride<float>(std::max(ntoti,ntotg));
+  float* work1 = work.get<float>(Workspace::GAUSS, 2*nstep);
+  float* work2 = work1 + nstep;
 
   // Prepare transform of gaussian convolution function for
   // image FFTs
@@ -401,10 +1204,6 @@ void Tomog::gaussdef(const float input[], size_t nwave, size_t ngamma,
       }
     }
   }
-
-  // clean up
-  delete[] work1;
-  delete[] work2;
 }
 
     
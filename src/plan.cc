@@ -0,0 +1,541 @@
+//
+// Tomog::Plan, the geometry shared by op and tr
+//
+
+#include <cmath>
+#include <algorithm>
+#include <vector>
+#include <utility>
+#include "trm_subs.h"
+#include "trm_constants.h"
+#include "trm_tomog.h"
+
+// Largest difference from a whole number of fine pixels between the
+// systemic velocities for them to count as snapped
+static const double SNAP_TOL = 1.e-3;
+
+/** Computes everything that op and tr need which does not depend upon the
+ * pixel values.
+ * \param wave   the rest wavelengths of the map
+ * \param gamma  the systemic velocities of the map (km/s)
+ * \param nside  number of pixels along each side of the images
+ * \param vpix   km/s/pixel of the map
+ * \param fwhm   FWHM of the local line profile (km/s)
+ * \param ndiv   over-sampling factor of the fine buffers
+ * \param ntdiv  number of sub-exposures per spectrum
+ * \param npixd  number of pixels per spectrum
+ * \param nspec  number of spectra
+ * \param vpixd  km/s/pixel of the spectra
+ * \param waved  rest wavelength of the spectra
+ * \param time   mid-exposure times of the spectra
+ * \param expose exposure times of the spectra
+ * \param tzero  zero point of the ephemeris
+ * \param period period of the ephemeris
+ */
+Tomog::Plan::Plan(const Subs::Array1D<double>& wave, const Subs::Array1D<float>& gamma, 
+		  size_t nside, float vpix, float fwhm, int ndiv, int ntdiv, int npixd, 
+		  int nspec, float vpixd, double waved, const Subs::Array1D<double>& time, 
+		  const Subs::Array1D<float>& expose, double tzero, double period) : 
+  nside_(nside), nwave_(wave.size()), ngamma_(gamma.size()), ndiv_(ndiv), 
+  npixd_(npixd), nspec_(nspec), nfine_(ndiv*npixd),
+  sigma_(ndiv*fwhm/Constants::EFAC/vpixd), proj_(PROJ_POINT), repro_(false), fgrid_(0), fline_(0), 
+  fos_(0), fsign_(1), flen_(0.), nlive_(0) {
+
+  std::vector<int> nsub(nspec, ntdiv);
+  init(wave, gamma, vpix, fwhm, vpixd, waved, &nsub[0], time, expose, tzero, period);
+}
+
+/** Version of the constructor in which each spectrum has its own number of
+ * sub-exposures, e.g. as chosen by sub_exposures.
+ * \param wave   the rest wavelengths of the map
+ * \param gamma  the systemic velocities of the map (km/s)
+ * \param nside  number of pixels along each side of the images
+ * \param vpix   km/s/pixel of the map
+ * \param fwhm   FWHM of the local line profile (km/s)
+ * \param ndiv   over-sampling factor of the fine buffers
+ * \param ntdiv  number of sub-exposures of each spectrum, nspec values of at least 1
+ * \param npixd  number of pixels per spectrum
+ * \param nspec  number of spectra
+ * \param vpixd  km/s/pixel of the spectra
+ * \param waved  rest wavelength of the spectra
+ * \param time   mid-exposure times of the spectra
+ * \param expose exposure times of the spectra
+ * \param tzero  zero point of the ephemeris
+ * \param period period of the ephemeris
+ */
+Tomog::Plan::Plan(const Subs::Array1D<double>& wave, const Subs::Array1D<float>& gamma, 
+		  size_t nside, float vpix, float fwhm, int ndiv, const Subs::Array1D<int>& ntdiv, 
+		  int npixd, int nspec, float vpixd, double waved, const Subs::Array1D<double>& time, 
+		  const Subs::Array1D<float>& expose, double tzero, double period) : 
+  nside_(nside), nwave_(wave.size()), ngamma_(gamma.size()), ndiv_(ndiv), 
+  npixd_(npixd), nspec_(nspec), nfine_(ndiv*npixd),
+  sigma_(ndiv*fwhm/Constants::EFAC/vpixd), proj_(PROJ_POINT), repro_(false), fgrid_(0), fline_(0), 
+  fos_(0), fsign_(1), flen_(0.), nlive_(0) {
+
+  if(ntdiv.size() != nspec)
+    throw Tomog_Error("Tomog::Plan -- number of sub-exposure counts does not match the number of spectra");
+  std::vector<int> nsub(nspec);
+  for(int ns=0; ns<nspec; ns++){
+    if(ntdiv[ns] < 1)
+      throw Tomog_Error("Tomog::Plan -- every spectrum needs at least one sub-exposure");
+    nsub[ns] = ntdiv[ns];
+  }
+  init(wave, gamma, vpix, fwhm, vpixd, waved, &nsub[0], time, expose, tzero, period);
+}
+
+/** Does the work of the constructors, whose arguments these are
+ * except that ntdiv has the number of sub-exposures of each spectrum.
+ */
+void Tomog::Plan::init(const Subs::Array1D<double>& wave, const Subs::Array1D<float>& gamma, 
+		       float vpix, float fwhm, float vpixd, double waved, const int ntdiv[], 
+		       const Subs::Array1D<double>& time, const Subs::Array1D<float>& expose, 
+		       double tzero, double period){
+
+  const int ndiv = ndiv_, nspec = nspec_;
+  period_ = period;
+  vpixd_  = vpixd;
+
+  // blurr array stuff
+  const int nblurr = int(3.*ndiv*fwhm/vpixd);
+  const int nbtot  = 2*nblurr+1;
+  float sigma = fwhm/Constants::EFAC;
+  float efac = Subs::sqr(vpixd/ndiv/sigma)/2.;  
+  double sum=0.;
+  int k;
+  blurr_.resize(nbtot);
+  for(k = -nblurr; k<= nblurr; k++)
+    sum += (blurr_[nblurr+k] = exp(-efac*k*k));
+
+  for(k=0; k< nbtot; k++) 
+    blurr_[k] /= sum;
+
+  // Fold the binning of ndiv fine pixels per data pixel into the blurring
+  // so that each data pixel is a single sum over the fine buffer.
+  bkern_.resize(nbtot+ndiv-1, 0.f);
+  for(k=0; k<nbtot; k++)
+    for(int l=0; l<ndiv; l++)
+      bkern_[k+l] += blurr_[k];
+
+  set_fft_blurr(fft_cheaper());
+
+  float scale  = ndiv*vpix/vpixd; // scale factor map/fine
+  double phase, cosp, sinp;
+  scale_ = scale;
+
+  // Velocity offsets of the wavelengths. C = speed of light
+  vwave_.resize(nwave_);
+  for(int nwave=0; nwave<nwave_; nwave++)
+    vwave_[nwave] = Constants::C*1.e-3*(1.-waved/wave[nwave]);
+
+  // Sub-exposures, stored spectrum by spectrum
+  int ntot = 0;
+  for(int ns=0; ns<nspec; ns++) ntot += ntdiv[ns];
+  sfirst_.resize(nspec+1);
+  cosp_.resize(ntot);
+  sinp_.resize(ntot);
+  phase_.resize(ntot);
+  pxscale_.resize(ntot);
+  pyscale_.resize(ntot);
+  weight_.resize(ntot);
+
+  int nsub = 0;
+  for(int ns=0; ns<nspec; ns++){
+    sfirst_[ns] = nsub;
+    const int nt1 = ntdiv[ns];
+    for(int nt=0; nt<nt1; nt++, nsub++){
+
+      // Compute phase over uniformly spaced set from start to end of exposure. Times assumed
+      // to be mid-exposure
+      phase = (time[ns]+expose[ns]*(float(nt)-float(nt1-1)/2.)/std::max(nt1-1,1)-tzero)/period;
+      cosp  = cos(Constants::TWOPI*phase);
+      sinp  = sin(Constants::TWOPI*phase);
+
+      cosp_[nsub]    = cosp;
+      sinp_[nsub]    = sinp;
+      phase_[nsub]   = phase;
+      pxscale_[nsub] = -scale*cosp;
+      pyscale_[nsub] =  scale*sinp;
+
+      // The xpix squared factor is to give a similar intensity
+      // regardless of the pixel size. i.e. the pixel values are
+      // per 10^4 (km/s)**2
+      if(nt1 > 1 && (nt == 0 || nt == nt1 - 1)){
+	weight_[nsub] = Subs::sqr(vpix/100.)/(2*std::max(1,nt1-1));
+      }else{
+	weight_[nsub] = 2.*Subs::sqr(vpix/100.)/(2*std::max(1,nt1-1));
+      }
+    }
+  }
+  sfirst_[nspec] = nsub;
+
+  set_offsets(gamma);
+}
+
+// Computes the fine pixel offset factor of each image for every sub-exposure.
+// This shows where to add in to the fine pixel array. Two other factors account
+// for the centres of the arrays. Also computes the offsets of the systemic
+// velocities from the first for set_snap, and removes any snapping.
+void Tomog::Plan::set_offsets(const Subs::Array1D<float>& gamma){
+
+  const size_t nside = nside_;
+  const int ndiv = ndiv_, npixd = npixd_;
+  const float vpixd = vpixd_, scale = scale_;
+
+  gfine_.resize(ngamma_);
+  for(int ng=0; ng<ngamma_; ng++)
+    gfine_[ng] = ndiv*(double(gamma[ng])-gamma[0])/vpixd;
+  gshift_.clear();
+  fpsave_.clear();
+
+  fpcon_.resize(size_t(nsub())*nimage());
+  for(int nt=0; nt<nsub(); nt++){
+    const double cosp = cosp_[nt], sinp = sinp_[nt];
+    for(int nwave=0, nim=0; nwave<nwave_; nwave++){
+      for(int ngamma=0; ngamma<ngamma_; ngamma++, nim++){
+	fpcon_[size_t(nimage())*nt+nim] = 
+	  ndiv*((npixd-1)/2. + gamma[ngamma]/vpixd + vwave_[nwave])
+	  -scale*(-cosp+sinp)*(nside-1)/2. + 0.5;
+      }
+    }
+  }
+}
+
+/** Selects how map pixels are projected onto the fine buffers. Any sparse matrix
+ * is removed since it depends upon the method, so set_sparse must be called after this.
+ * PROJ_FOURIER cannot be stored as a sparse matrix.
+ * \param proj the projection method
+ */
+void Tomog::Plan::set_projector(Projector proj){
+  if(grouped()) gplan_[0].set_projector(proj);
+  proj_ = proj;
+  set_sparse(0);
+  if(proj_ == PROJ_FOURIER){
+    set_fourier();
+  }else{
+    fgrid_ = fline_ = 0;
+    fkern_.clear();
+    fdeap_.clear();
+    fwfac_.clear();
+  }
+}
+
+/** Selects reproducible projections, which give the same bits whatever the
+ * number of threads, the instruction set or the machine. The positions of
+ * pixels for point projection are then stepped along each row, and from
+ * row to row, in 64-bit fixed point with 32 bits after the binary point,
+ * starting from the single precision offsets and steps of the Plan. Integer
+ * arithmetic has no rounding to vary, so the pixels land in the same fine
+ * pixels whatever the compiler does with floating point. op adds into each
+ * fine pixel in a fixed order already; tr has each thread look after its own
+ * rows of the map rather than adding up private copies of it, which makes
+ * the order of the additions fixed too. Maps are projected one at a time,
+ * the short-cuts of set_mirror and snapped systemic velocities are not used,
+ * and sparse matrices are not allowed, so the projections are a little slower
+ * than usual. They also differ slightly from those of the usual point projection
+ * because positions within rounding of the edge of a fine pixel can land either
+ * side. The other projection methods are unchanged. The Plan's setup uses the
+ * maths library, so the same version of it is needed to get the same bits.
+ * Any sparse matrix is removed.
+ * \param repro true for reproducible projections
+ */
+void Tomog::Plan::set_reproducible(bool repro){
+  if(grouped()) gplan_[0].set_reproducible(repro);
+  repro_ = repro;
+  set_sparse(0);
+}
+
+/** Shares the pattern of fine pixels that the images of each wavelength land
+ * in between their systemic velocities, if these are a whole number of fine
+ * pixels apart to within 0.001 fine pixels, as dinit's gsnap can arrange.
+ * Point projection then works out where the pixels of each row land once for
+ * all the systemic velocities and shifts them, which leaves only an integer
+ * addition per pixel for the rest. To keep every method consistent with this,
+ * the offsets of the images of the other systemic velocities are replaced by
+ * those of the first plus their whole number of fine pixels, which moves them
+ * by less than the tolerance. The original offsets are restored if snapping
+ * is turned off. Any sparse matrix is removed.
+ * \param snap true to share the patterns if the systemic velocities allow it
+ * \return true if the systemic velocities are snapped
+ */
+bool Tomog::Plan::set_snap(bool snap){
+
+  if(grouped()) gplan_[0].set_snap(snap);
+  set_sparse(0);
+
+  if(snapped()){
+    fpcon_.swap(fpsave_);
+    fpsave_.clear();
+    gshift_.clear();
+  }
+
+  if(snap && ngamma_ > 1){
+    std::vector<int> gshift(ngamma_);
+    bool ok = true;
+    for(int ng=0; ng<ngamma_ && ok; ng++){
+      gshift[ng] = int(floor(gfine_[ng]+0.5));
+      ok = std::abs(gfine_[ng]-gshift[ng]) < SNAP_TOL;
+    }
+    if(ok){
+      gshift_.swap(gshift);
+      fpsave_ = fpcon_;
+      const size_t nimage = this->nimage();
+      for(size_t nt=0; nt<size_t(nsub()); nt++)
+	for(int nwave=0, nim=0; nwave<nwave_; nwave++)
+	  for(int ngamma=0; ngamma<ngamma_; ngamma++, nim++)
+	    if(ngamma > 0)
+	      fpcon_[nimage*nt+nim] = fpcon_[nimage*nt+nim-ngamma] + float(gshift_[ngamma]);
+    }
+  }
+
+  if(proj_ == PROJ_FOURIER) set_fourier_line();
+  return snapped();
+}
+
+/** Changes the systemic velocities of the images, keeping everything else, which
+ * is much quicker than building a new Plan when only they change, as when searching
+ * over them. The offsets of the images are computed as by the constructor, so
+ * the projections are the same as for a new Plan. Systemic velocities that were
+ * snapped by set_snap are snapped again if the new ones allow it. Any sparse
+ * matrix is removed.
+ * \param gamma the new systemic velocities (km/s), as many as before
+ */
+void Tomog::Plan::set_gamma(const Subs::Array1D<float>& gamma){
+
+  if(gamma.size() != ngamma_)
+    throw Tomog_Error("Tomog::Plan::set_gamma -- number of systemic velocities does not match the Plan");
+
+  if(grouped()) gplan_[0].set_gamma(gamma);
+  set_sparse(0);
+
+  const bool snap = snapped();
+  set_offsets(gamma);
+  if(snap)
+    set_snap(true);
+  else if(proj_ == PROJ_FOURIER)
+    set_fourier_line();
+}
+
+// Phase in cycles, from 0 to 1, of sub-exposure nt
+static double sub_phase(const Tomog::Plan& plan, int nt){
+  const double phase = atan2(plan.sinp(nt), plan.cosp(nt))/Constants::TWOPI;
+  return phase < 0. ? phase + 1. : phase;
+}
+
+// Whether spectra ns1 and ns2 have the same sub-exposures to within dphase cycles,
+// or if mirror is true, sub-exposures half a cycle apart
+static bool same_geometry(const Tomog::Plan& plan, int ns1, int ns2, double dphase, bool mirror=false){
+  if(plan.nsub(ns1) != plan.nsub(ns2)) return false;
+  const double dmax = Constants::TWOPI*dphase, sign = mirror ? -1. : 1.;
+  for(int nt1=plan.sfirst(ns1), nt2=plan.sfirst(ns2); nt1<plan.sfirst(ns1+1); nt1++, nt2++){
+    const double c1 = plan.cosp(nt1), s1 = plan.sinp(nt1);
+    const double c2 = sign*plan.cosp(nt2), s2 = sign*plan.sinp(nt2);
+    if(std::abs(atan2(s1*c2-c1*s2, c1*c2+s1*s2)) > dmax) return false;
+  }
+  return true;
+}
+
+/** Groups spectra whose sub-exposures all lie at the same orbital phases to
+ * within a tolerance, as happens when a long campaign covers the same phases 
+ * in many orbits. The projection of a map depends upon nothing else, so op and tr
+ * then project one spectrum per group and apply it to every member of the group:
+ * op copies the spectrum to each member, while tr adds the members together before
+ * the transpose of the projection. The exposure times only matter through the
+ * phases of the sub-exposures, so spectra with a single sub-exposure group 
+ * whatever their exposures. Each group is represented by the first of its
+ * spectra in order of phase, and a spectrum joins a group if it matches the 
+ * representative. With a tolerance greater than 0 the results are therefore
+ * approximate, the error being as for moving each spectrum by up to dphase
+ * in phase. Any sparse matrix and any pairs from set_mirror are removed, so
+ * set_sparse and set_mirror must be called after this.
+ * \param dphase tolerance in phase (cycles). Negative to remove the groups.
+ * \return the number of groups
+ */
+int Tomog::Plan::set_groups(double dphase){
+
+  set_sparse(0);
+  group_.clear();
+  gplan_.clear();
+  mirror_.clear();
+  porder_.clear();
+  if(dphase < 0. || nspec_ == 0) return nspec_;
+
+  // Sort the spectra by the phase of their first sub-exposure
+  std::vector<std::pair<double,int> > order(nspec_);
+  for(int ns=0; ns<nspec_; ns++)
+    order[ns] = std::make_pair(sub_phase(*this, sfirst_[ns]), ns);
+  std::sort(order.begin(), order.end());
+
+  // Sweep up in phase. Only representatives within dphase of the phase of a
+  // spectrum need checking, which near phase 1 includes those just above 0. 
+  std::vector<int> rep;
+  std::vector<int> grp(nspec_);
+  for(int i=0; i<nspec_; i++){
+    const double phase = order[i].first;
+    const int ns = order[i].second;
+    int ng = -1;
+    for(int j=int(rep.size())-1; ng<0 && j>=0 && sub_phase(*this, sfirst_[rep[j]]) >= phase-dphase; j--)
+      if(same_geometry(*this, rep[j], ns, dphase)) ng = j;
+    for(int j=0; ng<0 && j<int(rep.size()) && sub_phase(*this, sfirst_[rep[j]]) <= phase+dphase-1.; j++)
+      if(same_geometry(*this, rep[j], ns, dphase)) ng = j;
+    if(ng < 0){
+      ng = rep.size();
+      rep.push_back(ns);
+    }
+    grp[ns] = ng;
+  }
+
+  // Number the groups in the order of their representatives
+  const int ngroup = rep.size();
+  std::vector<std::pair<int,int> > rorder(ngroup);
+  for(int ng=0; ng<ngroup; ng++)
+    rorder[ng] = std::make_pair(rep[ng], ng);
+  std::sort(rorder.begin(), rorder.end());
+  std::vector<int> renum(ngroup);
+  for(int ng=0; ng<ngroup; ng++)
+    renum[rorder[ng].second] = ng;
+
+  group_.resize(nspec_);
+  for(int ns=0; ns<nspec_; ns++)
+    group_[ns] = renum[grp[ns]];
+
+  // The Plan of the representatives, which is this one cut down to their sub-exposures
+  Plan gplan(*this);
+  gplan.nspec_ = ngroup;
+  gplan.sfirst_.resize(ngroup+1);
+  gplan.cosp_.clear();
+  gplan.sinp_.clear();
+  gplan.phase_.clear();
+  gplan.pxscale_.clear();
+  gplan.pyscale_.clear();
+  gplan.weight_.clear();
+  gplan.fpcon_.clear();
+  gplan.fpsave_.clear();
+  const size_t nimage = this->nimage();
+  for(int ng=0; ng<ngroup; ng++){
+    const int ns = rorder[ng].first;
+    gplan.sfirst_[ng] = gplan.cosp_.size();
+    for(int nt=sfirst_[ns]; nt<sfirst_[ns+1]; nt++){
+      gplan.cosp_.push_back(cosp_[nt]);
+      gplan.sinp_.push_back(sinp_[nt]);
+      gplan.phase_.push_back(phase_[nt]);
+      gplan.pxscale_.push_back(pxscale_[nt]);
+      gplan.pyscale_.push_back(pyscale_[nt]);
+      gplan.weight_.push_back(weight_[nt]);
+      gplan.fpcon_.insert(gplan.fpcon_.end(), fpcon_.begin()+nimage*nt, fpcon_.begin()+nimage*(nt+1));
+      if(snapped())
+	gplan.fpsave_.insert(gplan.fpsave_.end(), fpsave_.begin()+nimage*nt, fpsave_.begin()+nimage*(nt+1));
+    }
+  }
+  gplan.sfirst_[ngroup] = gplan.cosp_.size();
+  gplan.group_.clear();
+  if(proj_ == PROJ_FOURIER) gplan.set_fourier();
+  gplan_.push_back(gplan);
+
+  return ngroup;
+}
+
+/** Pairs spectra whose sub-exposures lie half an orbit apart to within a
+ * tolerance. Each map pixel then projects to mirror-image positions in the
+ * two, so the ranges of pixels of each row landing in their fine buffers 
+ * match, and op and tr handle both in one pass along each row of the map
+ * rather than two. This applies to point projection of single maps without
+ * a sparse matrix or snapped systemic velocities; other cases take the spectra
+ * of a pair one after the other.
+ * Each sub-exposure keeps its own geometry, so the pairing does not change
+ * where pixels land and op gives identical results with or without it. In tr
+ * the two are added into the map together, which only affects rounding. For
+ * data covering whole orbits this halves the number of passes over the map.
+ * If the spectra have been grouped by set_groups, the representatives of the
+ * groups are paired.
+ * \param dphase tolerance in phase (cycles). Negative to remove the pairs.
+ * \return the number of pairs
+ */
+int Tomog::Plan::set_mirror(double dphase){
+
+  if(grouped()) return gplan_[0].set_mirror(dphase);
+
+  mirror_.clear();
+  porder_.clear();
+  if(dphase < 0. || nspec_ < 2) return 0;
+
+  std::vector<std::pair<double,int> > order(nspec_);
+  for(int ns=0; ns<nspec_; ns++)
+    order[ns] = std::make_pair(sub_phase(*this, sfirst_[ns]), ns);
+  std::sort(order.begin(), order.end());
+
+  // Look for an unpaired partner of each spectrum in turn, starting from the
+  // one nearest half a cycle on and working outwards within the tolerance
+  std::vector<int> mirror(nspec_, -1);
+  int npair = 0;
+  for(int ns=0; ns<nspec_; ns++){
+    if(mirror[ns] >= 0) continue;
+    double target = sub_phase(*this, sfirst_[ns]) + 0.5;
+    if(target >= 1.) target -= 1.;
+    const int k0 = std::lower_bound(order.begin(), order.end(), std::make_pair(target, -1)) - order.begin();
+    for(int dk=0; dk<nspec_; dk++){
+      const int kup = (k0+dk) % nspec_, kdown = (k0-1-dk+2*nspec_) % nspec_;
+      const double dup = order[kup].first - target, ddown = target - order[kdown].first;
+      const bool up   = std::min(std::abs(dup),   1.-std::abs(dup))   <= dphase;
+      const bool down = std::min(std::abs(ddown), 1.-std::abs(ddown)) <= dphase;
+      if(!up && !down) break;
+      int ms = -1;
+      if(up && order[kup].second != ns && mirror[order[kup].second] < 0 && 
+	 same_geometry(*this, ns, order[kup].second, dphase, true))
+	ms = order[kup].second;
+      else if(down && order[kdown].second != ns && mirror[order[kdown].second] < 0 && 
+	      same_geometry(*this, ns, order[kdown].second, dphase, true))
+	ms = order[kdown].second;
+      if(ms >= 0){
+	mirror[ns] = ms;
+	mirror[ms] = ns;
+	npair++;
+	break;
+      }
+    }
+  }
+  if(npair == 0) return 0;
+
+  // Order the spectra with each pair together, led by its first spectrum
+  mirror_.swap(mirror);
+  porder_.reserve(nspec_);
+  for(int ns=0; ns<nspec_; ns++){
+    if(mirror_[ns] < 0){
+      porder_.push_back(ns);
+    }else if(mirror_[ns] > ns){
+      porder_.push_back(ns);
+      porder_.push_back(mirror_[ns]);
+    }
+  }
+  return npair;
+}
+
+/** Chooses the number of sub-exposures of each spectrum so that the projected
+ * position of any pixel of the map moves by no more than a given amount from one
+ * sub-exposure to the next. The fastest moving pixels are those in the corners,
+ * (nside-1)/sqrt(2) pixels from the centre, which move by 2*pi*(nside-1)/sqrt(2)
+ * pixels per cycle. A spectrum whose whole exposure moves them by no more than
+ * the tolerance gets a single sub-exposure. A tolerance of 0 or less gives every
+ * spectrum nmax sub-exposures, as for the Plan constructor with a single ntdiv.
+ * \param expose exposure times of the spectra
+ * \param period period of the ephemeris, in the same units as expose
+ * \param nside  number of pixels along each side of the images
+ * \param smear  tolerance on the movement between sub-exposures, in map pixels
+ * \param nmax   maximum number of sub-exposures per spectrum
+ * \return the number of sub-exposures of each spectrum, for the Plan constructor
+ */
+Subs::Array1D<int> Tomog::sub_exposures(const Subs::Array1D<float>& expose, double period, 
+					size_t nside, float smear, int nmax){
+
+  const double rate = Constants::TWOPI*(nside-1)/sqrt(2.)/period;
+  Subs::Array1D<int> ntdiv(expose.size());
+  for(int ns=0; ns<expose.size(); ns++){
+    if(smear > 0.f){
+      const double move = rate*fabs(expose[ns]);
+      ntdiv[ns] = move <= smear ? 1 : int(std::min(double(nmax), 1.+ceil(move/smear)));
+    }else{
+      ntdiv[ns] = nmax;
+    }
+    ntdiv[ns] = std::max(1, ntdiv[ns]);
+  }
+  return ntdiv;
+}
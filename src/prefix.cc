@@ -0,0 +1,99 @@
+//
+// Run-length projection of rows for maps with pixels smaller than the
+// fine pixels. Consecutive pixels of a row then fall in the same fine
+// pixel, so rather than visiting every pixel, op differences prefix sums
+// of the row at the ends of each run, and tr adds the value of each run's
+// fine pixel into a difference array, which is integrated once all the
+// sub-exposures are done. Pixels land in exactly the same fine pixels as
+// they do with op_row and tr_row.
+//
+
+#include <cmath>
+#include <algorithm>
+#include "trm_tomog.h"
+#include "tomog_kernels.h"
+
+#ifdef __GNUC__
+// Fused multiply-adds would move pixels to other fine pixels than clip_row
+#pragma GCC optimize ("fp-contract=off")
+#endif
+
+// Clips the fine pixel of the first or last run to the fine buffer. Like
+// clip_top in kernels.cc, it has no effect unless the compiler has
+// evaluated the positions differently from clip_row.
+static inline int clip_fine(int np, int nfine){
+  return std::max(0, std::min(np, nfine-1));
+}
+
+/** Computes the prefix sums of a row, as needed by prefix_op_row.
+ * \param row   the row
+ * \param nside number of pixels in the row
+ * \param psum  the prefix sums, nside+1 elements, psum[x] being the sum of
+ * pixels 0 to x-1 (returned)
+ */
+void Tomog::row_prefix(const float row[], size_t nside, double psum[]){
+  double sum = 0.;
+  psum[0] = sum;
+  for(size_t xp=0; xp<nside; xp++)
+    psum[xp+1] = (sum += row[xp]);
+}
+
+/** Run-length version of op_row.
+ * \param psum    the prefix sums of the row from row_prefix
+ * \param nside   number of pixels in the row
+ * \param fpcon   fine pixel position of the first pixel
+ * \param pxscale fine pixel step per pixel
+ * \param nfine   number of fine pixels
+ * \param tfine   the fine buffer to add to
+ */
+void Tomog::prefix_op_row(const double psum[], size_t nside, float fpcon, float pxscale,
+			  int nfine, double tfine[]){
+  size_t x1, x2;
+  clip_row(nside, fpcon, pxscale, nfine, x1, x2);
+  if(x2 == x1) return;
+  const Runs runs(fpcon, pxscale, x1, x2);
+  const int nlast = clip_fine(runs.last(), nfine), step = runs.step();
+  size_t xs = x1, xe;
+  for(int np=clip_fine(runs.first(), nfine); np!=nlast; np+=step, xs=xe){
+    xe = runs.start(np+step);
+    tfine[np] += psum[xe] - psum[xs];
+  }
+  tfine[nlast] += psum[x2] - psum[xs];
+}
+
+/** Run-length version of tr_row. Rather than adding into the row, this adds
+ * into its difference array, which row_integrate converts back.
+ * \param tfine   the fine buffer
+ * \param nside   number of pixels in the row
+ * \param fpcon   fine pixel position of the first pixel
+ * \param pxscale fine pixel step per pixel
+ * \param nfine   number of fine pixels
+ * \param diff    the difference array of the row to add to
+ */
+void Tomog::prefix_tr_row(const double tfine[], size_t nside, float fpcon, float pxscale,
+			  int nfine, float diff[]){
+  size_t x1, x2;
+  clip_row(nside, fpcon, pxscale, nfine, x1, x2);
+  if(x2 == x1) return;
+  const Runs runs(fpcon, pxscale, x1, x2);
+  const int nlast = clip_fine(runs.last(), nfine), step = runs.step();
+  double prev = 0.;
+  size_t xs = x1;
+  for(int np=clip_fine(runs.first(), nfine); np!=nlast; np+=step){
+    diff[xs] += tfine[np] - prev;
+    prev = tfine[np];
+    xs = runs.start(np+step);
+  }
+  diff[xs] += tfine[nlast] - prev;
+  if(x2 < nside) diff[x2] -= tfine[nlast];
+}
+
+/** Converts a difference array made by prefix_tr_row into the row it represents.
+ * \param row   the difference array on input, the row on output
+ * \param nside number of pixels in the row
+ */
+void Tomog::row_integrate(float row[], size_t nside){
+  double sum = 0.;
+  for(size_t xp=0; xp<nside; xp++)
+    row[xp] = (sum += row[xp]);
+}
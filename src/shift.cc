@@ -0,0 +1,91 @@
+//
+// Projection of rows for maps whose systemic velocities are a whole number
+// of fine pixels apart. The fine pixels that the pixels of a row land in
+// are then the same for every systemic velocity apart from a fixed shift,
+// so they are computed once with row_floor and applied to the rows of all
+// the images of a wavelength, leaving only an integer addition per pixel.
+// The rows of the first systemic velocity land in exactly the same fine
+// pixels as they do with op_row; the others can differ from op_row only
+// for pixels within rounding of the edge of a fine pixel.
+//
+
+#include <cmath>
+#include <algorithm>
+#include <functional>
+#include "trm_tomog.h"
+#include "tomog_kernels.h"
+
+#ifdef __GNUC__
+// Fused multiply-adds would put rows in other fine pixels than op_row does
+#pragma GCC optimize ("fp-contract=off")
+#endif
+
+/** Computes the fine pixels of every pixel of a row, rounded down, whether
+ * or not they lie within the fine buffer. They run up with the pixels if
+ * pxscale >= 0 and down if not.
+ * \param nside   number of pixels in the row
+ * \param fpcon   fine pixel position of the first pixel
+ * \param pxscale fine pixel step per pixel
+ * \param index   the fine pixel of each pixel (returned)
+ */
+void Tomog::row_floor(size_t nside, float fpcon, float pxscale, int index[]){
+  for(size_t xp=0; xp<nside; xp++)
+    index[xp] = int(std::floor(fine_position(fpcon, pxscale, xp)));
+}
+
+/** Works out the range of pixels of a row whose fine pixels from row_floor,
+ * shifted by a given amount, lie within the fine buffer.
+ * \param index   the fine pixels from row_floor
+ * \param nside   number of pixels in the row
+ * \param up      true if the fine pixels run up with the pixels (pxscale >= 0)
+ * \param shift   shift to add to the fine pixels
+ * \param nfine   number of fine pixels
+ * \param x1      first pixel in range (returned)
+ * \param x2      one more than the last pixel in range (returned)
+ */
+void Tomog::shift_range(const int index[], size_t nside, bool up, int shift, int nfine,
+			size_t& x1, size_t& x2){
+  const int lo = -shift, hi = nfine - shift;
+  if(up){
+    x1 = std::lower_bound(index, index+nside, lo) - index;
+    x2 = std::lower_bound(index, index+nside, hi) - index;
+  }else{
+    x1 = std::lower_bound(index, index+nside, hi-1, std::greater<int>()) - index;
+    x2 = std::lower_bound(index, index+nside, lo-1, std::greater<int>()) - index;
+  }
+  if(x2 < x1) x2 = x1;
+}
+
+/** Shifted version of op_row.
+ * \param row    the row
+ * \param index  the fine pixels of the row from row_floor
+ * \param nside  number of pixels in the row
+ * \param up     true if the fine pixels run up with the pixels (pxscale >= 0)
+ * \param shift  shift to add to the fine pixels
+ * \param nfine  number of fine pixels
+ * \param tfine  the fine buffer to add to
+ */
+void Tomog::shift_op_row(const float row[], const int index[], size_t nside, bool up,
+			 int shift, int nfine, double tfine[]){
+  size_t x1, x2;
+  shift_range(index, nside, up, shift, nfine, x1, x2);
+  for(size_t xp=x1; xp<x2; xp++)
+    tfine[index[xp]+shift] += row[xp];
+}
+
+/** Shifted version of tr_row, the transpose of shift_op_row.
+ * \param tfine  the fine buffer
+ * \param index  the fine pixels of the row from row_floor
+ * \param nside  number of pixels in the row
+ * \param up     true if the fine pixels run up with the pixels (pxscale >= 0)
+ * \param shift  shift to add to the fine pixels
+ * \param nfine  number of fine pixels
+ * \param row    the row to add to
+ */
+void Tomog::shift_tr_row(const double tfine[], const int index[], size_t nside, bool up,
+			 int shift, int nfine, float row[]){
+  size_t x1, x2;
+  shift_range(index, nside, up, shift, nfine, x1, x2);
+  for(size_t xp=x1; xp<x2; xp++)
+    row[xp] += tfine[index[xp]+shift];
+}
@@ -0,0 +1,224 @@
+//
+// Sparse matrix form of op and tr
+//
+
+#include <cmath>
+#include <algorithm>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "trm_tomog.h"
+#include "tomog_kernels.h"
+
+// Largest column step that can be stored in one entry
+static const size_t MAX_DELTA = 65535;
+
+/** For small maps and trails the projection of the map into the fine buffers
+ * of each spectrum carried out by op amounts to multiplication by a fixed sparse
+ * matrix, with one row per fine pixel of each spectrum and one column per map
+ * pixel. This routine computes that matrix, with the sub-exposures and their
+ * weights folded in, so that the projection steps of op and tr reduce to a sparse 
+ * matrix-vector product and its transpose. The blurring and binning stays separate
+ * because folding it in would multiply the number of elements by the width of the
+ * blurring function in data pixels. Each non-zero element is stored as a float value
+ * and a 16-bit step from the previous column of its row. Steps too large for
+ * 16 bits are made with extra zero-valued elements. Before building the matrix
+ * an upper limit to the memory needed is computed, including that used while
+ * building it; if it exceeds maxmem the matrix is not built and op and tr carry
+ * on computing the projections on the fly. The results
+ * differ from those of the on-the-fly projection only through rounding. The
+ * matrix is built for the projection method set when this is called, but not
+ * for reproducible projections (set_reproducible). If the spectra have been
+ * grouped, only the spectra representing the groups are stored. Pixels
+ * excluded by set_mask are left out.
+ * \param maxmem maximum number of bytes to use. 0 to remove an existing matrix.
+ * \return true if the matrix has been built.
+ */
+bool Tomog::Plan::set_sparse(size_t maxmem){
+
+  srow_.clear();
+  sdelta_.clear();
+  sval_.clear();
+  if(grouped()) return gplan_[0].set_sparse(maxmem);
+  if(maxmem == 0 || nspec_ == 0 || proj_ == PROJ_FOURIER || repro_) return false;
+
+  const size_t nmap  = this->nmap();
+  const size_t nrows = size_t(nspec_)*nfine_;
+
+  // Upper limit on the number of elements of each spectrum: one per map pixel
+  // per sub-exposure, or as many as a footprint can cover, plus those needed
+  // for big steps. Each spectrum is given a slot of this size in the matrix.
+  const bool foot = proj_ == PROJ_FOOTPRINT;
+  const size_t nbig = size_t(nfine_)*(nmap/MAX_DELTA + 1);
+  std::vector<size_t> slot(nspec_+1);
+  size_t nmost = 0;
+  int maxw = 1;
+  slot[0] = 0;
+  for(int ns=0; ns<nspec_; ns++){
+    size_t nsum = 0;
+    for(int nt=sfirst_[ns]; nt<sfirst_[ns+1]; nt++){
+      const int nw = foot ? Footprint(pxscale_[nt], pyscale_[nt]).max_width() : 1;
+      nsum += nw;
+      maxw  = std::max(maxw, nw);
+    }
+    nmost = std::max(nmost, nlive()*nsum);
+    slot[ns+1] = slot[ns] + nlive()*nsum + nbig;
+  }
+  const size_t nnz = slot[nspec_];
+
+  // Besides the matrix, each thread lists the columns and values of the rows
+  // of one spectrum at a time, which can take up to twice their size as the
+  // lists grow.
+  const int nthread = std::max(1, std::min(get_nthread(), nspec_));
+  if(nnz*(sizeof(float)+sizeof(unsigned short)) + (nrows+nspec_+2)*sizeof(size_t) + 
+     2*nthread*nmost*(sizeof(size_t)+sizeof(float)) > maxmem)
+    return false;
+
+  // The elements of each spectrum are written into its slot and the number
+  // in each row into srow_, then the gaps are closed up.
+  srow_.resize(nrows+1);
+  sdelta_.resize(nnz);
+  sval_.resize(nnz);
+
+#ifdef _OPENMP
+#pragma omp parallel num_threads(nthread)
+#endif
+  {
+    // Per-row lists of columns and values for one spectrum
+    std::vector<std::vector<size_t> > rcol(nfine_);
+    std::vector<std::vector<float> > rval(nfine_);
+
+    std::vector<Footprint> footv;
+    std::vector<double> w(maxw);
+    float fpoff;
+    int np, j, j1, nw, k;
+    size_t moff, xp, yp;
+
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+    for(int ns=0; ns<nspec_; ns++){
+
+      const int nt1 = sfirst_[ns], nsb = nsub(ns);
+      for(j=0; j<nfine_; j++){
+	rcol[j].clear();
+	rval[j].clear();
+      }
+      footv.clear();
+      if(foot)
+	for(int nt=0; nt<nsb; nt++)
+	  footv.push_back(Footprint(pxscale_[nt1+nt], pyscale_[nt1+nt]));
+
+      // Locate the map pixels exactly as op does, but with all the
+      // sub-exposures of the spectrum at once.
+      for(int nim=0; nim<nimage(); nim++){
+	for(yp=0; yp<nside_; yp++){
+	  moff = nside_*(nside_*nim+yp);
+	  for(xp=0; xp<nside_; xp++, moff++){
+	    if(!live(moff)) continue;
+	    for(int nt=0; nt<nsb; nt++){
+	      fpoff = fine_position(fpcon(nt1+nt,nim) + float(yp)*pyscale_[nt1+nt], pxscale_[nt1+nt], xp);
+	      if(foot){
+		nw = footv[nt].weights(fpoff, nfine_, j1, &w[0]);
+	      }else if(fpoff >= 0.f && fpoff < nfine_){
+		nw   = 1;
+		j1   = int(fpoff);
+		w[0] = 1.;
+	      }else{
+		nw = 0;
+	      }
+	      for(k=0; k<nw; k++){
+		if(w[k] == 0.) continue;
+		np = j1 + k;
+		if(rcol[np].size() && rcol[np].back() == moff){
+		  rval[np].back() += weight_[nt1+nt]*w[k];
+		}else{
+		  rcol[np].push_back(moff);
+		  rval[np].push_back(weight_[nt1+nt]*w[k]);
+		}
+	      }
+	    }
+	  }
+	}
+      }
+
+      // Encode the columns as steps
+      size_t nout = slot[ns];
+      for(j=0; j<nfine_; j++){
+	size_t prev = 0, gap, n0 = nout;
+	for(size_t n=0; n<rcol[j].size(); n++){
+	  gap = rcol[j][n] - prev;
+	  while(gap > MAX_DELTA){
+	    sdelta_[nout] = MAX_DELTA;
+	    sval_[nout++] = 0.f;
+	    gap  -= MAX_DELTA;
+	    prev += MAX_DELTA;
+	  }
+	  sdelta_[nout] = gap;
+	  sval_[nout++] = rval[j][n];
+	  prev = rcol[j][n];
+	}
+	srow_[size_t(nfine_)*ns+j+1] = nout - n0;
+      }
+    }
+  }
+
+  // Close up the gaps between the slots and turn the counts into starts.
+  // The matrix keeps the memory of the upper limit.
+  srow_[0] = 0;
+  for(int ns=0; ns<nspec_; ns++){
+    const size_t n1 = size_t(nfine_)*ns, nstart = srow_[n1];
+    for(int j=0; j<nfine_; j++)
+      srow_[n1+j+1] += srow_[n1+j];
+    std::copy(sdelta_.begin()+slot[ns], sdelta_.begin()+slot[ns]+(srow_[n1+nfine_]-nstart), 
+	      sdelta_.begin()+nstart);
+    std::copy(sval_.begin()+slot[ns], sval_.begin()+slot[ns]+(srow_[n1+nfine_]-nstart), 
+	      sval_.begin()+nstart);
+  }
+  sdelta_.resize(srow_[nrows]);
+  sval_.resize(srow_[nrows]);
+  return true;
+}
+
+/** Sparse matrix equivalent of the projection of op for one spectrum. 
+ * This includes the sub-exposures and their weights.
+ * \param ns   the spectrum
+ * \param map  the map
+ * \param fine the fine buffer to be set, nfine() elements
+ */
+void Tomog::Plan::sparse_op(int ns, const float map[], double fine[]) const {
+
+  const size_t *row = &srow_[size_t(nfine_)*ns];
+  double sum;
+  size_t col;
+  for(int j=0; j<nfine_; j++){
+    sum = 0.;
+    col = 0;
+    for(size_t k=row[j]; k<row[j+1]; k++){
+      col += sdelta_[k];
+      sum += sval_[k]*map[col];
+    }
+    fine[j] = sum;
+  }
+}
+
+/** Sparse matrix equivalent of the transposed projection of tr for
+ * one spectrum. 
+ * \param ns   the spectrum
+ * \param fine the fine buffer, nfine() elements
+ * \param map  the map to add into
+ */
+void Tomog::Plan::sparse_tr(int ns, const double fine[], float map[]) const {
+
+  const size_t *row = &srow_[size_t(nfine_)*ns];
+  double add;
+  size_t col;
+  for(int j=0; j<nfine_; j++){
+    add = fine[j];
+    col = 0;
+    for(size_t k=row[j]; k<row[j+1]; k++){
+      col += sdelta_[k];
+      map[col] += sval_[k]*add;
+    }
+  }
+}
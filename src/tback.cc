@@ -4,7 +4,7 @@
 !!title  Back-projects a trailed spectrum
 !!author T.R.Marsh
 !!created 13 September 2000
-!!revised 22 June 2003
+!!revised 17 October 2026
 !!root   tback
 !!index  tback
 !!descr  Back-projects a trailed spectrum
@@ -14,11 +14,17 @@
 !!class  Doppler images
 !!head1  tback - back-projects a trailed spectrum
 
-!!emph{tback} computes the back-projection of a trailed spectrum.
+!!emph{tback} computes the back-projection of a trailed spectrum. It can either
+make a single image or take its wavelengths, systemic velocities, size and pixel size
+from a template map, such as made by !!ref{dinit.html}{dinit}, in which case every image
+of the map is back-projected for its own wavelength and systemic velocity in a single
+pass through the trail. The values of the template are ignored. The rows of the
+output are divided between threads. See also !!ref{tfbp.html}{tfbp} which filters
+and back-projects in one step by a faster method.
 
 !!head2 Invocation
 
-tback trail tzero period nside vpix wzero gamma output!!break
+tback trail tzero period template (map)/(nside vpix wzero gamma) output!!break
 
 !!head2 Arguments
 
@@ -26,11 +32,15 @@ tback trail tzero period nside vpix wzero gamma output!!break
 !!arg{ trail  }{ trailed spectrum.}
 !!arg{ tzero  }{ ephemeris zero-point.}
 !!arg{ period }{ orbital period.}
-!!arg{ nside  }{ number of pixels on a side in the output.}
-!!arg{ vpix   }{ km/s/pixel.}
-!!arg{ wzero  }{ rest wavelength.}
-!!arg{ gamma  }{ systemic velocity (km/s).}
+!!arg{template}{ true to take the form of the output from a template map.}
+!!arg{ map    }{ template map, if template is true.}
+!!arg{ nside  }{ number of pixels on a side in the output, if template is false.}
+!!arg{ vpix   }{ km/s/pixel, if template is false.}
+!!arg{ wzero  }{ rest wavelength, if template is false.}
+!!arg{ gamma  }{ systemic velocity (km/s), if template is false.}
 !!arg{ output }{ output image.}
+!!arg{nthread}{number of threads to use, 0 for the default, as in !!ref{dtmem.html}{dtmem}.
+Hidden parameter, default 0.}
 !!table
 
 !!end
@@ -41,6 +51,8 @@ tback trail tzero period nside vpix wzero gamma output!!break
 #include <cmath>
 #include <cfloat>
 #include <iostream>
+#include <vector>
+#include <algorithm>
 #include "trm_subs.h"
 #include "trm_constants.h"
 #include "trm_input.h"
@@ -48,6 +60,33 @@ tback trail tzero period nside vpix wzero gamma output!!break
 #include "trm_trail.h"
 #include "trm_dmap.h"
 
+// Adds the value of a spectrum at position pvr to a pixel by linear
+// interpolation.
+static inline void back_pixel(float pvr, const float spec[], int npixd, float& pixel){
+  const int ilow = int(floor(pvr));
+  if(ilow >= -1 && ilow < npixd){
+    if(ilow >= 0)      pixel += (1+ilow-pvr)*spec[ilow];
+    if(ilow+1 < npixd) pixel += (pvr-ilow)*spec[ilow+1];
+  }
+}
+
+// Range of pixels ixa to ixb-1 of a row, with positions p0 + ix*dp in the
+// spectrum, that are at least half a pixel inside both ends, with a margin
+// of a pixel to allow for rounding.
+static void interior(double p0, double dp, int nside, int npixd, int& ixa, int& ixb){
+  ixa = ixb = 0;
+  if(dp != 0.){
+    double xa = (0.5-p0)/dp, xb = (npixd-1.5-p0)/dp;
+    if(xa > xb) std::swap(xa, xb);
+    xa  = std::max(0., std::min(double(nside), ceil(xa)+1.));
+    xb  = std::max(xa, std::min(double(nside), floor(xb)-1.));
+    ixa = int(xa);
+    ixb = int(xb);
+  }else if(p0 >= 0.5 && p0 < npixd-1.5){
+    ixb = nside;
+  }
+}
+
 int main(int argc, char *argv[]){
 
   try{
@@ -56,14 +95,17 @@ int main(int argc, char *argv[]){
     Subs::Input input(argc, argv, Tomog::TOMOG_ENV, Tomog::TOMOG_DIR);
 
     // Define inputs
-    input.sign_in("trail",   Subs::Input::GLOBAL, Subs::Input::PROMPT);
-    input.sign_in("tzero",   Subs::Input::GLOBAL, Subs::Input::PROMPT);
-    input.sign_in("period",  Subs::Input::GLOBAL, Subs::Input::PROMPT);
-    input.sign_in("nside",   Subs::Input::LOCAL,  Subs::Input::PROMPT);
-    input.sign_in("vpix",    Subs::Input::LOCAL,  Subs::Input::PROMPT);
-    input.sign_in("wzero",   Subs::Input::LOCAL,  Subs::Input::PROMPT);
-    input.sign_in("gamma",   Subs::Input::LOCAL,  Subs::Input::PROMPT);
-    input.sign_in("output",  Subs::Input::LOCAL,  Subs::Input::PROMPT);
+    input.sign_in("trail",    Subs::Input::GLOBAL, Subs::Input::PROMPT);
+    input.sign_in("tzero",    Subs::Input::GLOBAL, Subs::Input::PROMPT);
+    input.sign_in("period",   Subs::Input::GLOBAL, Subs::Input::PROMPT);
+    input.sign_in("template", Subs::Input::LOCAL,  Subs::Input::PROMPT);
+    input.sign_in("map",      Subs::Input::GLOBAL, Subs::Input::PROMPT);
+    input.sign_in("nside",    Subs::Input::LOCAL,  Subs::Input::PROMPT);
+    input.sign_in("vpix",     Subs::Input::LOCAL,  Subs::Input::PROMPT);
+    input.sign_in("wzero",    Subs::Input::LOCAL,  Subs::Input::PROMPT);
+    input.sign_in("gamma",    Subs::Input::LOCAL,  Subs::Input::PROMPT);
+    input.sign_in("output",   Subs::Input::LOCAL,  Subs::Input::PROMPT);
+    input.sign_in("nthread",  Subs::Input::LOCAL,  Subs::Input::NOPROMPT);
 
     std::string intrail;
     input.get_value("trail", intrail, "trail", "input trailed spectrum");
@@ -72,54 +114,100 @@ int main(int argc, char *argv[]){
     input.get_value("tzero",  tzero, 0.,  -DBL_MAX, DBL_MAX, "zero-crossing time");
     double period;
     input.get_value("period", period, 0.1, 1.e-6, DBL_MAX, "period");
-    size_t nside;
-    input.get_value("nside", nside, size_t(100), size_t(1), size_t(10000), "number of pixels along a side");
-    float vpix;
-    input.get_value("vpix", vpix, 50.f, 0.0001f, 10000.f, "number of km/s per pixel");
-    double wzero;
-    input.get_value("wzero", wzero, 5000., 0.0001, 1000000., "rest wavelength");
-    float gamma;
-    input.get_value("gamma", gamma, 0.f, -FLT_MAX, FLT_MAX, "systemic velocity (km/s)");
+    bool templ;
+    input.get_value("template", templ, false, "take the form of the output from a template map?");
+    Dmap map;
+    if(templ){
+      std::string inmap;
+      input.get_value("map", inmap, "map", "template Doppler map");
+      map = Dmap(inmap);
+    }else{
+      size_t nside;
+      input.get_value("nside", nside, size_t(100), size_t(1), size_t(10000), "number of pixels along a side");
+      float vpix;
+      input.get_value("vpix", vpix, 50.f, 0.0001f, 10000.f, "number of km/s per pixel");
+      double wzero;
+      input.get_value("wzero", wzero, 5000., 0.0001, 1000000., "rest wavelength");
+      float gamma;
+      input.get_value("gamma", gamma, 0.f, -FLT_MAX, FLT_MAX, "systemic velocity (km/s)");
+      map = Dmap(nside,vpix,gamma,wzero);
+    }
     std::string outfile;
     input.get_value("output", outfile, "map", "output Doppler map");
+    int nthread;
+    input.get_value("nthread", nthread, 0, 0, 1024, "number of threads (0 for default)");
+    Tomog::set_nthread(nthread);
 
     // get trail info, compute cosines and sines
-    int    nspec  = trail.nspec();
-    int    npixd  = trail.npix();
-    float  vpixd  = trail.vpix();
-    double wzerod = trail.wzero();
+    const int    nspec  = trail.nspec();
+    const int    npixd  = trail.npix();
+    const float  vpixd  = trail.vpix();
+    const double wzerod = trail.wzero();
     Subs::Array1D<double> cosp(nspec), sinp(nspec);
 
     cosp = cos(Constants::TWOPI*(trail.time()-tzero)/period);
     sinp = sin(Constants::TWOPI*(trail.time()-tzero)/period);
 
-    // create map (single image)
-    Dmap map(nside,vpix,gamma,wzero);
-
-    int ilow, ns;
-    float pvx, pvy, pvr, sum;
-    float poff =  (Constants::C*1.e-3*(1.-wzerod/wzero)+gamma)/vpixd + (npixd-1)/2. + 0.5;
-
-    for(size_t iy=0; iy < nside; iy++){
-      pvy   = vpix*(iy-(nside-1)/2.)/vpixd;
-      for(size_t ix=0; ix < nside; ix++){
-	pvx   = vpix*(ix-(nside-1)/2.)/vpixd;
-        for(ns=0, sum=0.; ns < nspec; ns++){
-          pvr   = poff - pvx*cosp[ns] + pvy*sinp[ns];
-          ilow  = int(floor(pvr));
-	  if(ilow >= -1 && ilow < npixd){
-	    if(ilow >= 0)      sum += (1+ilow-pvr)*trail.data()[ns][ilow];
-	    if(ilow+1 < npixd) sum += (pvr-ilow)*trail.data()[ns][ilow+1];
+    const int   nside  = map.nside();
+    const int   nimage = map.nwave()*map.ngamma();
+    const float vpix   = map.vpix();
+    const size_t npix  = size_t(nside)*nside;
+
+    // Offset of each image
+    std::vector<float> poff(nimage);
+    for(int nw=0, nim=0; nw<map.nwave(); nw++)
+      for(int ng=0; ng<map.ngamma(); ng++, nim++)
+	poff[nim] = (Constants::C*1.e-3*(1.-wzerod/map.wzero(nw))+map.gamma(ng))/vpixd + (npixd-1)/2. + 0.5;
+
+    std::vector<float> pvxv(nside);
+    for(int ix=0; ix<nside; ix++)
+      pvxv[ix] = vpix*(ix-(nside-1)/2.)/vpixd;
+
+    std::vector<float> datav(trail.size()), outv(map.size(), 0.f);
+    trail.get_data(&datav[0]);
+    const float *data = &datav[0], *pvx = &pvxv[0];
+    float *out = &outv[0];
+
+    // Each thread does whole rows. For each row the spectra are taken in
+    // turn and added into the row of every image, so that the inner loop
+    // runs along a spectrum and along a row of the output.
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) num_threads(std::max(1, Tomog::get_nthread()))
+#endif
+    for(int iy=0; iy < nside; iy++){
+      const float pvy = vpix*(iy-(nside-1)/2.)/vpixd;
+      int ix, ixa, ixb, ilow;
+      float pvr;
+      for(int ns=0; ns < nspec; ns++){
+	const float  *spec = data + size_t(npixd)*ns;
+	const double cs = cosp[ns], ss = sinp[ns];
+	for(int nim=0; nim<nimage; nim++){
+	  float *row = out + npix*nim + size_t(nside)*iy;
+
+	  // Pixels from ixa to ixb-1 lie well inside the spectrum, so
+	  // need no checks
+	  interior(poff[nim] + pvy*ss - pvx[0]*cs, -vpix/vpixd*cs, nside, npixd, ixa, ixb);
+
+	  for(ix=0; ix < ixa; ix++)
+	    back_pixel(poff[nim] - pvx[ix]*cs + pvy*ss, spec, npixd, row[ix]);
+
+	  for(; ix < ixb; ix++){
+	    pvr   = poff[nim] - pvx[ix]*cs + pvy*ss;
+	    ilow  = int(pvr);
+	    row[ix] += (1+ilow-pvr)*spec[ilow];
+	    row[ix] += (pvr-ilow)*spec[ilow+1];
 	  }
+
+	  for(; ix < nside; ix++)
+	    back_pixel(poff[nim] - pvx[ix]*cs + pvy*ss, spec, npixd, row[ix]);
 	}
-	map[0][0][iy][ix] = sum;
       }
     }
 
+    map.set(out);
     map.write(outfile);
 
   }
-
   catch(const Dmap::Dmap_Error& err){
     std::cerr << "Dmap::Dmap_Error exception: " << err << std::endl;
     exit(EXIT_FAILURE);
@@ -86,7 +86,9 @@ int main(int argc, char* argv[]){
     // array for counting choices
 
     int ntot = nspec*npix;
-    int count[ntot], i, j, off;
+    Tomog::Workspace work;
+    int *count = work.get<int>(Tomog::Workspace::USER, ntot);
+    int i, j, off;
 
     tout = trail;
     for(int n=0; n<nout; n++){
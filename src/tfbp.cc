@@ -0,0 +1,157 @@
+/*
+
+!!begin
+!!title  Filtered back-projection of a trailed spectrum
+!!author T.R.Marsh
+!!created 17 October 2026
+!!root   tfbp
+!!index  tfbp
+!!descr  Filtered back-projection of a trailed spectrum
+!!css   style.css
+!!class  Trailed spectra
+!!class  Inversion
+!!class  Doppler images
+!!head1  tfbp - filtered back-projection of a trailed spectrum
+
+!!emph{tfbp} computes the filtered back-projection of a trailed spectrum in one
+step, doing the work of !!ref{tfilt.html}{tfilt} followed by !!ref{tback.html}{tback}
+without writing the filtered spectra to disk. The spectra are filtered in memory
+and back-projected by Fourier slices (the transpose of the 's' projection method of
+!!ref{dtmem.html}{dtmem}), which costs of order N**2 log N for N by N images
+plus a term proportional to the number of spectra times their length, rather
+than the N**2 times the number of spectra of !!emph{tback}. Both stages run
+in parallel. It is intended for quick-look maps.
+
+The wavelengths, systemic velocities, size and pixel size of the output are
+taken from a template map such as made by !!ref{dinit.html}{dinit}, so that
+a single run can back-project several lines (rest wavelengths) and several
+systemic velocities at once; each image of the map is the back-projection of
+the trail for its own wavelength and systemic velocity. The values of the
+template are ignored. The output is scaled to be an estimate of the map that
+would reproduce the data, in the same units as !!ref{dtmem.html}{dtmem}
+uses, so it can serve as a starting map too.
+
+!!head2 Invocation
+
+tfbp trail map tzero period fwhm output!!break
+
+!!head2 Arguments
+
+!!table
+!!arg{ trail  }{ trailed spectrum.}
+!!arg{ map    }{ template Doppler map, defining the output images.}
+!!arg{ tzero  }{ ephemeris zero-point.}
+!!arg{ period }{ orbital period.}
+!!arg{ fwhm   }{ FWHM of noise suppression filter window, as in !!ref{tfilt.html}{tfilt}.
+This is scaled in units of cycles/pixel in which the Nyquist frequency is 0.5. Thus
+FWHM = 10 has little effect, while FWHM = 0.1 has a strong effect}
+!!arg{ output }{ output map.}
+!!arg{nthread}{number of threads to use, 0 for the default, as in !!ref{dtmem.html}{dtmem}.
+Hidden parameter, default 0.}
+!!table
+
+!!head2 Related commands
+
+!!ref{tfilt.html}{tfilt}, !!ref{tback.html}{tback}, !!ref{dinit.html}{dinit}
+
+!!end
+
+*/
+
+#include <cstdlib>
+#include <cfloat>
+#include <iostream>
+#include "trm_subs.h"
+#include "trm_constants.h"
+#include "trm_input.h"
+#include "trm_tomog.h"
+#include "trm_trail.h"
+#include "trm_dmap.h"
+
+int main(int argc, char *argv[]){
+
+  try{
+
+    // Construct Input object
+    Subs::Input input(argc, argv, Tomog::TOMOG_ENV, Tomog::TOMOG_DIR);
+
+    // Define inputs
+    input.sign_in("trail",   Subs::Input::GLOBAL, Subs::Input::PROMPT);
+    input.sign_in("map",     Subs::Input::GLOBAL, Subs::Input::PROMPT);
+    input.sign_in("tzero",   Subs::Input::GLOBAL, Subs::Input::PROMPT);
+    input.sign_in("period",  Subs::Input::GLOBAL, Subs::Input::PROMPT);
+    input.sign_in("fwhm",    Subs::Input::GLOBAL, Subs::Input::PROMPT);
+    input.sign_in("output",  Subs::Input::LOCAL,  Subs::Input::PROMPT);
+    input.sign_in("nthread", Subs::Input::LOCAL,  Subs::Input::NOPROMPT);
+
+    std::string intrail;
+    input.get_value("trail", intrail, "trail", "input trailed spectrum");
+    Trail trail(intrail);
+    std::string inmap;
+    input.get_value("map", inmap, "map", "template Doppler map");
+    Dmap dmap(inmap);
+    double tzero;
+    input.get_value("tzero",  tzero, 0.,  -DBL_MAX, DBL_MAX, "zero-crossing time");
+    double period;
+    input.get_value("period", period, 0.1, 1.e-6, DBL_MAX, "period");
+    float fwhm;
+    input.get_value("fwhm", fwhm, 0.5f, 0.00001f, 1000000.f, "FWHM of noise suppression filter (cycles/pixel)");
+    std::string outfile;
+    input.get_value("output", outfile, "map", "output Doppler map");
+    int nthread;
+    input.get_value("nthread", nthread, 0, 0, 1024, "number of threads (0 for default)");
+    Tomog::set_nthread(nthread);
+
+    int   npixd = trail.npix();
+    int   nspec = trail.nspec();
+    float vpix  = dmap.vpix();
+    float vpixd = trail.vpix();
+
+    // Back-projection is the transpose of projection. A line profile one
+    // data pixel wide smooths about as much as the linear interpolation of
+    // tback. There are no sub-exposures, as in tback.
+    Tomog::Plan plan(dmap.wave(), dmap.gamma(), dmap.nside(), vpix, vpixd, 1, 1,
+		     npixd, nspec, vpixd, trail.wzero(), trail.time(), trail.expose(),
+		     tzero, period);
+    plan.set_projector(Tomog::PROJ_FOURIER);
+    Tomog::Workspace work(plan);
+
+    float *data = work.get<float>(Tomog::Workspace::USER,   trail.size());
+    float *map  = work.get<float>(Tomog::Workspace::USER+1, dmap.size());
+    trail.get_data(data);
+
+    Tomog::fbp_filter(data, npixd, nspec, fwhm);
+    Tomog::tr(plan, data, map, work);
+
+    // tr adds weight times the filtered data at each pixel's velocity
+    // from every spectrum. With spectra spread around the orbit, the
+    // inverse Radon transform is pi/nspec times the sum of the filtered
+    // projections in velocity units, and the projections are the data
+    // divided by weight*vpixd/vpix**2, which gives the scale factor.
+    const float weight = plan.weight(0);
+    const float scale  = Constants::PI*Subs::sqr(vpix/vpixd)/nspec/Subs::sqr(weight);
+    for(int i=0; i<dmap.size(); i++)
+      map[i] *= scale;
+
+    dmap.set(map);
+    dmap.write(outfile);
+
+  }
+
+  catch(const Dmap::Dmap_Error& err){
+    std::cerr << "Dmap::Dmap_Error exception: " << err << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  catch(const Trail::Trail_Error& err){
+    std::cerr << "Trail::Trail_Error exception: " << err << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  catch(const std::string& err){
+    std::cerr << "string exception: " << err << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  exit(EXIT_SUCCESS);
+}
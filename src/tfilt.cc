@@ -34,7 +34,7 @@ while FWHM = 0.1 has a stroing effect}
 
 !!head2 Related commands
 
-!!ref{tback.html}{tback}, !!ref{dtmem.html}{dtmem}
+!!ref{tback.html}{tback}, !!ref{tfbp.html}{tfbp}, !!ref{dtmem.html}{dtmem}
 
 !!end
 
@@ -68,114 +68,16 @@ int main(int argc, char *argv[]){
     std::string outfile;
     input.get_value("output", outfile, "output", "output file");
 
-    // compute size of buffers needed 
-
     Trail trail(intrail);
-    int npix   = trail.npix();
-    int nspec  = trail.nspec();
-    int nmin   = int(floor(pow(2,ceil(log(float(2*npix-1))/log(2.)))+0.1));
-    int ntot   = 2*nmin;
-   
-    float *filter = new float[ntot];
-    float *dbuff  = new float[ntot];
-    float *data   = new float[npix*nspec];
+    float *data = new float[trail.size()];
     trail.get_data(data);
 
-    const float PI2  = -1./Subs::sqr(Constants::PI);
-    const float efac =  Subs::sqr(Constants::EFAC/fwhm)/2.;
-
-    // Set convolving function which is FT of ABS(S) truncated at
-    // Nyquist frequency and sampled onto same period as data. 
-    // This has values 0.25 for zero frequency, 0 for
-    // all even frequencies and -1/pi**2/k**2 for all odd k.
-    // It is a real array. The maximum lag is dims[0]-1.
-    // Note that the more obvious direct implementation is
-    // avoided because of Rowland's work
-
-    filter[0]   = 0.25;
-    filter[1]   = 0.;
-    float dummy;
-    int i2;
-    for(int ix = 1; ix < npix; ix++){
-      if(2*(ix/2) == ix){
-        dummy = 0.;
-      }else{
-        dummy = PI2/(ix*ix);
-      }
-      i2 = 2*ix;
-      filter[i2]        = dummy; // Real part, +ve lag 
-      filter[i2+1]      = 0.;    // Imaginary part, +ve lag
-      filter[ntot-i2]   = dummy; // Real part, -ve lag 
-      filter[ntot-i2+1] = 0.;    // Imaginary part, -ve lag 
-    }
-
-    // fill in remainder with zeroes
-    for(int ix = 2*npix; ix < ntot-2*(npix-1); ix++)
-      filter[ix] = 0.;
-
-    // FFT of convolving function to get filter function
-    Subs::fft(filter, ntot, 1);
-
-    // Fold in Gaussian window function. The filter is real and symmetrical
-    // so most of it is ignored
-    float x;
-    for(int ix = 1; ix <= nmin/2; ix++){
-      i2 = 2*ix;
-      x  = i2/float(nmin);
-      filter[i2] *= exp(-efac*x*x);
-    }
-
-    // Now loop through spectra
-
-    int off;
-    float fac;
-    
-    for(int ns = 0; ns < nspec; ns++){
-
-      // Transfer data, pad with zeroes and FFT
-      
-      off = ns*npix;
-
-      for(int ix = 0; ix < npix; ix++){
-	i2 = 2*ix;
-	dbuff[i2]   = data[off+ix];
-	dbuff[i2+1] = 0.;
-      }
-      for(int ix = 2*npix; ix < ntot; ix++) dbuff[ix] = 0.;
-
-      Subs::fft(dbuff, ntot, 1);
-      
-      // Apply filter (which is real and symmetric) with gaussian 
-      // window function, then inverse fft. First deal with zero and
-      // Nyquist frequencies
-
-      dbuff[0]      *= filter[0];
-      dbuff[1]      *= filter[0];
-      dbuff[nmin]   *= filter[nmin];
-      dbuff[nmin+1] *= filter[nmin];
-
-      for(int ix = 1; ix < nmin/2; ix++){
-	i2    = 2*ix;
-	fac   = filter[i2];
-	dbuff[i2]        *= fac;
-	dbuff[i2+1]      *= fac;
-	dbuff[ntot-i2]   *= fac;
-	dbuff[ntot-i2+1] *= fac;
-      }
-      Subs::fft(dbuff,ntot,-1);
-
-      // transfer data back 
-      for(int ix = 0; ix < npix; ix++)
-	data[off+ix] = dbuff[2*ix]/nmin;
-
-    }
-    
+    Tomog::fbp_filter(data, trail.npix(), trail.nspec(), fwhm);
+
     trail.set_data(data);
     trail.write(outfile);
 
     delete[] data;
-    delete[] dbuff;
-    delete[] filter;
   }
 
   catch(const Trail::Trail_Error& err){
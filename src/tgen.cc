@@ -18,7 +18,8 @@ does so by calling exactly the same routine as is used
 by !!ref{dtmem.html}{dtmem} during the mem inversion. !!emph{tgen}
 prompts for all the parameters needed to define a trail on a regular
 set of orbital phases. It stores the phases as times 
-effectively assuming tzero=0, period=1.
+effectively assuming tzero=0, period=1. If the map has a mask
+(see !!ref{dmask.html}{dmask}), only the pixels within it contribute.
 
 !!head2 Invocation
 
@@ -39,6 +40,22 @@ tgen map vpix wzero npix nspec phase1 phase2 ndiv fwhm file!!break
 !!arg{ ntdiv   }{ number of points per spectrum to simulate finite exposure lengths }
 !!arg{ fwhm    }{ fwhm (km/s) blurring. }
 !!arg{ output  }{ output file name. }
+!!arg{ project }{ projection method, as in !!ref{dtmem.html}{dtmem}. Hidden parameter, default 'p'.}
+!!arg{ smear   }{smearing tolerance (pixels) for choosing the number of points per exposure, as in
+!!ref{dtmem.html}{dtmem}. Hidden parameter, default 0 to use ntdiv points for every exposure.}
+!!arg{ dphase  }{tolerance in phase (cycles) for projecting spectra at the same phases once, as in
+!!ref{dtmem.html}{dtmem}. Hidden parameter, default -1 to project every spectrum.}
+!!arg{ mirror  }{tolerance in phase (cycles) for pairing spectra half an orbit apart, as in
+!!ref{dtmem.html}{dtmem}. Hidden parameter, default -1 to leave the spectra unpaired.}
+!!arg{reproducible}{if true, point projections give the same bits on any machine, as in
+!!ref{dtmem.html}{dtmem}. Hidden parameter, default false.}
+!!arg{ snap    }{if true, systemic velocities a whole number of fine pixels apart share their pattern
+of fine pixels, as in !!ref{dtmem.html}{dtmem}. Hidden parameter, default false.}
+!!arg{ list    }{name of a file listing further Doppler images of the same format as map, such as
+noise realisations from !!ref{dnadd.html}{dnadd}. These are projected through the same geometry as
+map, several at a time, which costs much less than running tgen on each in turn. Their trails
+are numbered as by !!ref{dnadd.html}{dnadd}: thus if 100 maps are listed, they are written to
+files named output_001, output_002 etc. Hidden parameter, default 'none'.}
 !!table
 
 !!end
@@ -48,7 +65,11 @@ tgen map vpix wzero npix nspec phase1 phase2 ndiv fwhm file!!break
 #include <cstdlib>
 #include <cmath>
 #include <cfloat>
+#include <string>
+#include <vector>
+#include <fstream>
 #include <iostream>
+#include <algorithm>
 #include "trm_subs.h"
 #include "trm_input.h"
 #include "trm_array1d.h"
@@ -56,6 +77,9 @@ tgen map vpix wzero npix nspec phase1 phase2 ndiv fwhm file!!break
 #include "trm_dmap.h"
 #include "trm_trail.h"
 
+// Largest number of maps projected together
+static const int NBATCH = 16;
+
 int main(int argc, char* argv[]){
 
   try{
@@ -76,6 +100,13 @@ int main(int argc, char* argv[]){
     input.sign_in("ntdiv",   Subs::Input::GLOBAL,  Subs::Input::PROMPT);
     input.sign_in("fwhm",    Subs::Input::GLOBAL,  Subs::Input::PROMPT);
     input.sign_in("output",  Subs::Input::LOCAL,   Subs::Input::PROMPT);
+    input.sign_in("project", Subs::Input::LOCAL,   Subs::Input::NOPROMPT);
+    input.sign_in("smear",   Subs::Input::LOCAL,   Subs::Input::NOPROMPT);
+    input.sign_in("dphase",  Subs::Input::LOCAL,   Subs::Input::NOPROMPT);
+    input.sign_in("mirror",  Subs::Input::LOCAL,   Subs::Input::NOPROMPT);
+    input.sign_in("reproducible", Subs::Input::LOCAL,   Subs::Input::NOPROMPT);
+    input.sign_in("snap",    Subs::Input::LOCAL,   Subs::Input::NOPROMPT);
+    input.sign_in("list",    Subs::Input::LOCAL,   Subs::Input::NOPROMPT);
 
     std::string inmap;
     input.get_value("map",     inmap,   "map",   "input Doppler map");
@@ -101,21 +132,41 @@ int main(int argc, char* argv[]){
     input.get_value("ntdiv",   ntdiv, 1, 1, 200, "number of points/spectrum to simulate finite exposures");
     std::string outfile;
     input.get_value("output",  outfile, "trail", "output trail");
+    char project;
+    input.get_value("project", project, 'p', "pPfFsS", "projection method [p(oint), f(ootprint), s(lice)]");
+    project = toupper(project);
+    float smear;
+    input.get_value("smear", smear, 0.f, 0.f, FLT_MAX, "maximum smearing between sub-exposures (pixels), 0 for ntdiv every time");
+    double dphase;
+    input.get_value("dphase", dphase, -1., -1., 0.5, "tolerance in phase for projecting spectra together (cycles), -1 to disable");
+    double mirror;
+    input.get_value("mirror", mirror, -1., -1., 0.5, "tolerance in phase for pairing spectra half a cycle apart (cycles), -1 to disable");
+    bool repro;
+    input.get_value("reproducible", repro, false, "reproducible projections?");
+    bool snap;
+    input.get_value("snap", snap, false, "share fine pixel patterns between systemic velocities?");
+    std::string flist;
+    input.get_value("list", flist, "none", "list of further maps to project, 'none' for none");
+
+    // Read in list of file names
+    std::vector<std::string> fname;
+    if(flist != "none"){
+      std::ifstream list(flist.c_str());
+      if(!list)
+	throw Tomog::Input_Error("Could not open " + flist);
+      std::string file;
+      while(list >> file){
+	fname.push_back(file);
+      }
+      list.close();
+      if(fname.size() == 0)
+	throw Tomog::Input_Error("No file names loaded from " + flist);
+    }
 
     Dmap map(inmap);
 
-    // Create buffers for data and model. We work with these
-    // rather than Trail and Dmap objects for compatibility
-    // with the single-large-array nature of memsys.
-
-    float mapbuf[map.size()];
-    float datbuf[npixd*nspec];
     float vpix   = map.vpix();
     size_t nside = map.nside();
-
-    // Transfer map data
-
-    map.get(mapbuf);
     Subs::Array1D<float>  gamma = map.gamma();
     Subs::Array1D<double> wave  = map.wave();
 
@@ -132,14 +183,22 @@ int main(int argc, char* argv[]){
       expose[i] = exposure;
     }
 
-    Tomog::op(mapbuf, wave, gamma, nside, vpix, fwhm, ndiv, ntdiv, npixd, 
-		nspec, vpixd, wzerod, time, expose, 0., 1., datbuf);
-
-    // Create and set trail
+    const Subs::Array1D<int> nsub = Tomog::sub_exposures(expose, 1., nside, smear, ntdiv);
+    Tomog::Plan plan(wave, gamma, nside, vpix, fwhm, ndiv, nsub, npixd, 
+		     nspec, vpixd, wzerod, time, expose, 0., 1.);
+    if(project == 'F') plan.set_projector(Tomog::PROJ_FOOTPRINT);
+    else if(project == 'S') plan.set_projector(Tomog::PROJ_FOURIER);
+    if(dphase >= 0.)
+      std::cerr << "Number of distinct spectrum geometries = " << plan.set_groups(dphase) << std::endl;
+    plan.set_mirror(mirror);
+    plan.set_reproducible(repro);
+    plan.set_snap(snap);
+    plan.set_mask(map.mask());
+
+    // Create trail
     Trail trail(npixd,nspec,vpixd,wzerod);
     trail.time()   = time;
     trail.expose() = expose;
-    trail.set_data(datbuf);
     
     // set errors negative to indicate no noise
     for(unsigned int i = 0; i < trail.nspec(); i++){
@@ -147,7 +206,52 @@ int main(int argc, char* argv[]){
 	trail.error()[i][j]  = -1.;
       }
     }
-    trail.write(outfile);
+
+    // Create buffers for data and model. We work with these
+    // rather than Trail and Dmap objects for compatibility
+    // with the single-large-array nature of memsys. The map and
+    // any listed maps are projected up to NBATCH at a time.
+
+    const int nmaps  = 1 + fname.size();
+    const int nbatch = std::min(nmaps, NBATCH);
+    const size_t nmap = map.size(), ndat = size_t(npixd)*nspec;
+    Tomog::Workspace work(plan, nbatch);
+    float *mapbuf = work.get<float>(Tomog::Workspace::USER,   nbatch*nmap);
+    float *datbuf = work.get<float>(Tomog::Workspace::USER+1, nbatch*ndat);
+
+    int tnum = 10, ndg = 1;
+    while(tnum <= nmaps-1){
+      tnum *= 10;
+      ndg++;
+    }
+
+    Dmap dummy;
+    for(int n1=0; n1<nmaps; n1+=nbatch){
+      const int nb = std::min(nbatch, nmaps-n1);
+
+      // Transfer map data
+      for(int k=0; k<nb; k++){
+	if(n1+k == 0){
+	  map.get(mapbuf);
+	}else{
+	  dummy.read(fname[n1+k-1]);
+	  if(!match(map, dummy))
+	    throw Tomog::Input_Error(fname[n1+k-1] + " does not match " + inmap);
+	  dummy.get(mapbuf + nmap*k);
+	}
+      }
+
+      Tomog::op_batch(plan, nb, mapbuf, datbuf, work);
+
+      for(int k=0; k<nb; k++){
+	trail.set_data(datbuf + ndat*k);
+	if(n1+k == 0){
+	  trail.write(outfile);
+	}else{
+	  trail.write(outfile + "_" + Subs::str(n1+k, ndg));
+	}
+      }
+    }
   }
 
   catch(const Dmap::Dmap_Error& err){
@@ -0,0 +1,358 @@
+/*
+
+!!begin
+!!title  Grid search in ephemeris and systemic velocity
+!!author T.R.Marsh
+!!created 17 October 2026
+!!root   tgrid
+!!index  tgrid
+!!descr  Grid search in ephemeris and systemic velocity
+!!css   style.css
+!!class  Trailed spectra
+!!class  Doppler images
+!!head1  tgrid - grid search in ephemeris and systemic velocity
+
+!!emph{tgrid} evaluates a figure of merit of a trailed spectrum over a grid of
+periods, zero points and shifts of the systemic velocity, for screening candidate
+ephemerides without running !!ref{tback.html}{tback}, !!ref{tgen.html}{tgen} or
+!!ref{dtscl.html}{dtscl} over and over in shell loops. The trail and map are read
+once, and the grid points are divided between threads, each of which re-uses its
+own workspace from one point to the next, and its set-up of the projections between
+shifts of the systemic velocity at the same period and zero point, so it pays to
+have ngamma large compared to the other two. There are two figures of merit:
+
+!!emph{Sharpness} ('s'): the trail is filtered once as by !!ref{tfbp.html}{tfbp}
+and back-projected for each grid point, and the figure of merit is the variance
+of the pixels of the back-projection, which is largest when the ephemeris brings
+the features of the spectra together. The map gives the form of the back-projection
+as for !!ref{tfbp.html}{tfbp}; its values are ignored.
+
+!!emph{Chi-squared} ('c'): the map is projected for each grid point, as by
+!!ref{tgen.html}{tgen}, scaled to fit the data as by !!ref{dtscl.html}{dtscl},
+and the figure of merit is the reduced chi**2 of the fit, which is smallest for
+the best ephemeris. Data with negative errors are ignored.
+
+In both cases the systemic velocities of the map are shifted by the same amount at
+each grid point, and any mask (see !!ref{dmask.html}{dmask}) is respected.
+
+The output is an ASCII file with a line for each grid point listing the period,
+zero point, shift in systemic velocity and figure of merit, with the shift varying
+fastest and the period slowest, after a comment line giving the numbers of periods,
+zero points and shifts so that it can be read back as a cube. The best grid point
+is reported at the end.
+
+!!head2 Invocation
+
+tgrid trail map method (fwhm ndiv ntdiv)/(ffwhm) period1 period2 nperiod tzero1 tzero2 ntzero
+gamma1 gamma2 ngamma output!!break
+
+!!head2 Arguments
+
+!!table
+!!arg{ trail  }{ trailed spectrum.}
+!!arg{ map    }{ Doppler map: the fixed map to project for 'c', the template of the
+back-projection for 's'.}
+!!arg{ method }{ figure of merit: 's' for sharpness of the back-projection, 'c' for chi-squared.}
+!!arg{ fwhm   }{ FWHM of the local line profile (km/s), for 'c'.}
+!!arg{ ndiv   }{ sub-divison factor (>0), for 'c'.}
+!!arg{ ntdiv  }{ time sub-divison factor (>0), for 'c'.}
+!!arg{ ffwhm  }{ FWHM of the noise suppression filter (cycles/pixel) for 's', as in
+!!ref{tfilt.html}{tfilt}.}
+!!arg{ period1 }{ first period.}
+!!arg{ period2 }{ last period.}
+!!arg{ nperiod }{ number of periods.}
+!!arg{ tzero1  }{ first zero point.}
+!!arg{ tzero2  }{ last zero point.}
+!!arg{ ntzero  }{ number of zero points.}
+!!arg{ gamma1  }{ first shift of the systemic velocities (km/s).}
+!!arg{ gamma2  }{ last shift of the systemic velocities (km/s).}
+!!arg{ ngamma  }{ number of shifts.}
+!!arg{ output }{ output ASCII file.}
+!!arg{ project}{projection method for 'c', as in !!ref{dtscl.html}{dtscl}. Hidden parameter, default 'p'.}
+!!arg{nthread}{number of threads to use, 0 for the default, as in !!ref{dtmem.html}{dtmem}.
+Hidden parameter, default 0.}
+!!table
+
+!!head2 Related commands
+
+!!ref{tfbp.html}{tfbp}, !!ref{dtscl.html}{dtscl}
+
+!!end
+
+*/
+
+#include <cstdlib>
+#include <cfloat>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <new>
+#include <algorithm>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "trm_subs.h"
+#include "trm_input.h"
+#include "trm_tomog.h"
+#include "trm_trail.h"
+#include "trm_dmap.h"
+
+// Value of a grid axis running from v1 to v2 in n steps
+static double grid_value(double v1, double v2, int n, int i){
+  return n > 1 ? v1 + (v2-v1)*i/(n-1) : v1;
+}
+
+int main(int argc, char *argv[]){
+
+  try{
+
+    // Construct Input object
+    Subs::Input input(argc, argv, Tomog::TOMOG_ENV, Tomog::TOMOG_DIR);
+
+    // Define inputs
+    input.sign_in("trail",   Subs::Input::GLOBAL, Subs::Input::PROMPT);
+    input.sign_in("map",     Subs::Input::GLOBAL, Subs::Input::PROMPT);
+    input.sign_in("method",  Subs::Input::LOCAL,  Subs::Input::PROMPT);
+    input.sign_in("fwhm",    Subs::Input::LOCAL,  Subs::Input::PROMPT);
+    input.sign_in("ndiv",    Subs::Input::GLOBAL, Subs::Input::PROMPT);
+    input.sign_in("ntdiv",   Subs::Input::GLOBAL, Subs::Input::PROMPT);
+    input.sign_in("ffwhm",   Subs::Input::LOCAL,  Subs::Input::PROMPT);
+    input.sign_in("period1", Subs::Input::LOCAL,  Subs::Input::PROMPT);
+    input.sign_in("period2", Subs::Input::LOCAL,  Subs::Input::PROMPT);
+    input.sign_in("nperiod", Subs::Input::LOCAL,  Subs::Input::PROMPT);
+    input.sign_in("tzero1",  Subs::Input::LOCAL,  Subs::Input::PROMPT);
+    input.sign_in("tzero2",  Subs::Input::LOCAL,  Subs::Input::PROMPT);
+    input.sign_in("ntzero",  Subs::Input::LOCAL,  Subs::Input::PROMPT);
+    input.sign_in("gamma1",  Subs::Input::LOCAL,  Subs::Input::PROMPT);
+    input.sign_in("gamma2",  Subs::Input::LOCAL,  Subs::Input::PROMPT);
+    input.sign_in("ngamma",  Subs::Input::LOCAL,  Subs::Input::PROMPT);
+    input.sign_in("output",  Subs::Input::LOCAL,  Subs::Input::PROMPT);
+    input.sign_in("project", Subs::Input::LOCAL,  Subs::Input::NOPROMPT);
+    input.sign_in("nthread", Subs::Input::LOCAL,  Subs::Input::NOPROMPT);
+
+    std::string intrail;
+    input.get_value("trail", intrail, "trail", "input trailed spectrum");
+    Trail trail(intrail);
+    std::string inmap;
+    input.get_value("map", inmap, "map", "Doppler map");
+    Dmap dmap(inmap);
+    char method;
+    input.get_value("method", method, 's', "sScC", "figure of merit [s(harpness), c(hi-squared)]");
+    method = toupper(method);
+    float fwhm = trail.vpix(), ffwhm = 0.5f;
+    int ndiv = 1, ntdiv = 1;
+    if(method == 'C'){
+      input.get_value("fwhm", fwhm, 100.f, 0.0001f, 100000.f, "FWHM of local line profile (km/s)");
+      input.get_value("ndiv", ndiv, 1, 1, 200, "over-sampling factor for map/data computations");
+      input.get_value("ntdiv", ntdiv, 1, 1, 200, "number of points per time point to simulate finite exposures");
+    }else{
+      input.get_value("ffwhm", ffwhm, 0.5f, 0.00001f, 1000000.f, "FWHM of noise suppression filter (cycles/pixel)");
+    }
+    double period1, period2;
+    input.get_value("period1", period1, 0.1, 1.e-6, DBL_MAX, "first period");
+    input.get_value("period2", period2, period1, 1.e-6, DBL_MAX, "last period");
+    int nperiod;
+    input.get_value("nperiod", nperiod, 1, 1, 1000000, "number of periods");
+    double tzero1, tzero2;
+    input.get_value("tzero1", tzero1, 0., -DBL_MAX, DBL_MAX, "first zero point");
+    input.get_value("tzero2", tzero2, tzero1, -DBL_MAX, DBL_MAX, "last zero point");
+    int ntzero;
+    input.get_value("ntzero", ntzero, 1, 1, 1000000, "number of zero points");
+    float gamma1, gamma2;
+    input.get_value("gamma1", gamma1, 0.f, -FLT_MAX, FLT_MAX, "first shift of systemic velocities (km/s)");
+    input.get_value("gamma2", gamma2, gamma1, -FLT_MAX, FLT_MAX, "last shift of systemic velocities (km/s)");
+    int ngamma;
+    input.get_value("ngamma", ngamma, 1, 1, 1000000, "number of shifts of systemic velocities");
+    std::string outfile;
+    input.get_value("output", outfile, "grid.dat", "output ASCII file");
+    char project;
+    input.get_value("project", project, 'p', "pPfFsS", "projection method [p(oint), f(ootprint), s(lice)]");
+    project = toupper(project);
+    int nthread;
+    input.get_value("nthread", nthread, 0, 0, 1024, "number of threads (0 for default)");
+
+    // The grid points are shared between the threads, so op and tr run
+    // single-threaded
+    Tomog::set_nthread(nthread);
+    nthread = std::max(1, Tomog::get_nthread());
+    Tomog::set_nthread(1);
+
+    const size_t ndat = trail.size();
+    std::vector<float> data(ndat), errors(ndat);
+    trail.get_data(&data[0]);
+    trail.get_error(&errors[0]);
+    if(method == 'S')
+      Tomog::fbp_filter(&data[0], trail.npix(), trail.nspec(), ffwhm);
+
+    std::vector<float> model(dmap.size());
+    dmap.get(&model[0]);
+
+    const long long ngrid = (long long)(nperiod)*ntzero*ngamma;
+    std::vector<double> merit(ngrid);
+    // Exceptions cannot leave the loop, so the first is recorded and the
+    // rest of the grid skipped before it is thrown again
+    std::string error;
+    bool failed = false, nomem = false;
+
+#ifdef _OPENMP
+    // The grid is shared out in runs along gamma, so that each thread can
+    // mostly keep its Plan and just change the systemic velocities, while
+    // leaving enough runs to go round the threads
+    const int nchunk = int(std::max(1LL, std::min((long long)(ngamma), ngrid/(4*nthread))));
+#pragma omp parallel num_threads(nthread)
+#endif
+    {
+      Tomog::Workspace work;
+      Tomog::Plan plan;
+      Subs::Array1D<float> gamma(dmap.gamma());
+      int ipplan = -1, itplan = -1;
+
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic, nchunk)
+#endif
+      for(long long ng=0; ng<ngrid; ng++){
+
+	bool skip;
+#ifdef _OPENMP
+#pragma omp critical(tgrid_error)
+#endif
+	skip = failed;
+	if(skip) continue;
+
+	try{
+	  const int ig = int(ng % ngamma), it = int((ng / ngamma) % ntzero), ip = int(ng / ngamma / ntzero);
+	  const double period = grid_value(period1, period2, nperiod, ip);
+	  const double tzero  = grid_value(tzero1, tzero2, ntzero, it);
+	  const float  dgamma = float(grid_value(gamma1, gamma2, ngamma, ig));
+	  for(int i=0; i<gamma.size(); i++)
+	    gamma[i] = dmap.gamma()[i] + dgamma;
+
+	  if(ip == ipplan && it == itplan){
+	    plan.set_gamma(gamma);
+	  }else{
+	    // New ephemeris, so a new Plan
+	    ipplan = itplan = -1;
+	    plan = Tomog::Plan(dmap.wave(), gamma, dmap.nside(), dmap.vpix(), fwhm, ndiv, ntdiv,
+			       trail.npix(), trail.nspec(), trail.vpix(), trail.wzero(), trail.time(),
+			       trail.expose(), tzero, period);
+	    if(method == 'S' || project == 'S')
+	      plan.set_projector(Tomog::PROJ_FOURIER);
+	    else if(project == 'F')
+	      plan.set_projector(Tomog::PROJ_FOOTPRINT);
+	    plan.set_mask(dmap.mask());
+	    ipplan = ip;
+	    itplan = it;
+	  }
+
+	  if(method == 'S'){
+
+	    // Variance of the back-projection over the pixels in use
+	    float *map = work.get<float>(Tomog::Workspace::USER, plan.nmap());
+	    Tomog::tr(plan, &data[0], map, work);
+	    double sum1 = 0., sum2 = 0.;
+	    for(size_t i=0; i<plan.nmap(); i++){
+	      if(plan.live(i)){
+		sum1 += map[i];
+		sum2 += Subs::sqr(double(map[i]));
+	      }
+	    }
+	    const double nlive = plan.nlive();
+	    merit[ng] = nlive > 0 ? sum2/nlive - Subs::sqr(sum1/nlive) : 0.;
+
+	  }else{
+
+	    // Reduced chi**2 of the scaled projection of the map
+	    float *calc = work.get<float>(Tomog::Workspace::USER, ndat);
+	    Tomog::op(plan, &model[0], calc, work);
+	    double sum1 = 0., sum2 = 0., sum3 = 0., wgt;
+	    size_t nused = 0;
+	    for(size_t i=0; i<ndat; i++){
+	      if(errors[i] > 0.){
+		wgt   = 1./Subs::sqr(double(errors[i]));
+		sum1 += wgt*data[i]*calc[i];
+		sum2 += wgt*calc[i]*calc[i];
+		sum3 += wgt*data[i]*data[i];
+		nused++;
+	      }
+	    }
+	    const double chisq = sum2 > 0. ? sum3 - sum1*sum1/sum2 : sum3;
+	    merit[ng] = nused > 0 ? chisq/nused : 0.;
+	  }
+	}
+
+	catch(const std::string& err){
+#ifdef _OPENMP
+#pragma omp critical(tgrid_error)
+#endif
+	  if(!failed){
+	    failed = true;
+	    error  = err;
+	  }
+	}
+
+	catch(const std::bad_alloc&){
+#ifdef _OPENMP
+#pragma omp critical(tgrid_error)
+#endif
+	  if(!failed){
+	    failed = true;
+	    nomem  = true;
+	  }
+	}
+      }
+    }
+    if(nomem) throw std::bad_alloc();
+    if(failed) throw error;
+
+    // Write out the cube and report the best point
+    std::ofstream fout(outfile.c_str());
+    if(!fout)
+      throw std::string("Failed to open ") + outfile;
+    fout << "# tgrid " << (method == 'S' ? "sharpness" : "chi-squared") << " of " << intrail
+	 << " with " << inmap << std::endl;
+    fout << "# " << nperiod << " " << ntzero << " " << ngamma << std::endl;
+    fout << "# period tzero gamma merit" << std::endl;
+    long long nbest = 0;
+    for(long long ng=0; ng<ngrid; ng++){
+      const int ig = int(ng % ngamma), it = int((ng / ngamma) % ntzero), ip = int(ng / ngamma / ntzero);
+      fout << std::setprecision(12) << grid_value(period1, period2, nperiod, ip) << " "
+	   << grid_value(tzero1, tzero2, ntzero, it) << " " << std::setprecision(7)
+	   << grid_value(gamma1, gamma2, ngamma, ig) << " " << merit[ng] << std::endl;
+      if(method == 'S' ? merit[ng] > merit[nbest] : merit[ng] < merit[nbest]) nbest = ng;
+    }
+    if(!fout)
+      throw std::string("Failed to write ") + outfile;
+
+    const int ig = int(nbest % ngamma), it = int((nbest / ngamma) % ntzero), ip = int(nbest / ngamma / ntzero);
+    std::cout << "Best " << (method == 'S' ? "sharpness = " : "Chi**2/N = ") << merit[nbest]
+	      << " at period = " << std::setprecision(12) << grid_value(period1, period2, nperiod, ip)
+	      << ", tzero = " << grid_value(tzero1, tzero2, ntzero, it)
+	      << ", gamma shift = " << std::setprecision(7) << grid_value(gamma1, gamma2, ngamma, ig)
+	      << " km/s" << std::endl;
+
+  }
+
+  catch(const Dmap::Dmap_Error& err){
+    std::cerr << "Dmap::Dmap_Error exception: " << err << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  catch(const Trail::Trail_Error& err){
+    std::cerr << "Trail::Trail_Error exception: " << err << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  catch(const std::string& err){
+    std::cerr << "string exception: " << err << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  catch(const std::bad_alloc&){
+    std::cerr << "Memory allocation error" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  exit(EXIT_SUCCESS);
+}
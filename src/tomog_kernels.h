@@ -0,0 +1,167 @@
+#ifndef TOMOG_KERNELS_H
+#define TOMOG_KERNELS_H
+
+//
+// Row kernels shared by the projection routines. Not installed.
+//
+
+#include <cstddef>
+#include <cmath>
+
+namespace Tomog {
+
+  //! Fine pixel position of pixel x along a row
+
+  /** Every kernel uses this expression so that they all place pixels
+   * in the same fine pixels whatever instruction set is in use.
+   */
+  inline float fine_position(float fpcon, float pxscale, size_t x){
+    return fpcon + float(x)*pxscale;
+  }
+
+  //! Range of pixels along a row that fall within the fine buffer
+  void clip_row(size_t nside, float fpcon, float pxscale, int nfine, size_t& x1, size_t& x2);
+
+  //! Fine pixels of pixels x1 to x2-1 of a row, as used by op_row and tr_row
+  void row_index(size_t x1, size_t x2, float fpcon, float pxscale, int nfine, int index[]);
+
+  //! Adds a row of a map into a fine buffer
+  void op_row(const float row[], size_t nside, float fpcon, float pxscale, int nfine, double tfine[]);
+
+  //! Adds a fine buffer into a row of a map
+  void tr_row(const double tfine[], size_t nside, float fpcon, float pxscale, int nfine, float row[]);
+
+  //! Adds a row of a map into the fine buffers of two sub-exposures in one pass
+  void op_row_pair(const float row[], size_t nside, float fpcon1, float pxscale1, 
+		   float fpcon2, float pxscale2, int nfine, double tfine1[], double tfine2[]);
+
+  //! Adds the fine buffers of two sub-exposures into a row of a map in one pass
+  void tr_row_pair(const double tfine1[], const double tfine2[], size_t nside, float fpcon1, 
+		   float pxscale1, float fpcon2, float pxscale2, int nfine, float row[]);
+
+  //! Runs of pixels along a row that fall in the same fine pixel
+
+  /** Where each run starts is computed from where the row crosses the edge
+   * of its fine pixel and then checked against fine_position so that pixels
+   * land in the same fine pixels as they do with op_row. The starts of
+   * different runs are independent of each other.
+   */
+  class Runs {
+  public:
+
+    //! Constructor from the row position and the range from clip_row, which must not be empty
+    Runs(float fpcon, float pxscale, size_t x1, size_t x2) : 
+      fpcon_(fpcon), pxscale_(pxscale), rscale_(pxscale == 0.f ? 0. : 1./pxscale), 
+      x1_(int(x1)), x2_(int(x2)), up_(pxscale >= 0.f) {}
+
+    //! Fine pixel of pixel x in the range from clip_row; as fine_position but quicker to convert
+    int fine(int x) const {return int(fpcon_ + float(x)*pxscale_);}
+
+    //! Fine pixel of the first run
+    int first() const {return fine(x1_);}
+
+    //! Fine pixel of the last run
+    int last() const {return fine(x2_-1);}
+
+    //! Step in fine pixel from one run to the next, +1 or -1
+    int step() const {return up_ ? 1 : -1;}
+
+    //! First pixel of the run in fine pixel np, for np from first()+step() to last()
+    int start(int np) const {
+      const double edge = up_ ? np : np + 1;
+      double xe = (edge - fpcon_)*rscale_;
+      xe = xe < x1_ ? x1_ : (xe > x2_ ? x2_ : xe);
+      int x = int(xe);
+      if(up_ ? x < xe : x < x2_) x++;
+      while(x > x1_ && past(x-1, np)) x--;
+      while(x < x2_ && !past(x, np)) x++;
+      return x;
+    }
+
+  private:
+    bool past(int x, int np) const {return up_ ? fine(x) >= np : fine(x) <= np;}
+    float fpcon_, pxscale_;
+    double rscale_;
+    int x1_, x2_;
+    bool up_;
+  };
+
+  //! Prefix sums of a row
+  void row_prefix(const float row[], size_t nside, double psum[]);
+
+  //! Run-length version of op_row, working from the prefix sums of the row
+  void prefix_op_row(const double psum[], size_t nside, float fpcon, float pxscale, 
+		     int nfine, double tfine[]);
+
+  //! Run-length version of tr_row, adding into the difference array of the row
+  void prefix_tr_row(const double tfine[], size_t nside, float fpcon, float pxscale, 
+		     int nfine, float diff[]);
+
+  //! Converts a difference array back into a row
+  void row_integrate(float row[], size_t nside);
+
+  //! Fine pixels of all the pixels of a row, rounded down
+  void row_floor(size_t nside, float fpcon, float pxscale, int index[]);
+
+  //! Range of pixels along a row that fall within the fine buffer after a shift
+  void shift_range(const int index[], size_t nside, bool up, int shift, int nfine, 
+		   size_t& x1, size_t& x2);
+
+  //! Version of op_row for rows of images a whole number of fine pixels apart
+  void shift_op_row(const float row[], const int index[], size_t nside, bool up, 
+		    int shift, int nfine, double tfine[]);
+
+  //! Version of tr_row for rows of images a whole number of fine pixels apart
+  void shift_tr_row(const double tfine[], const int index[], size_t nside, bool up, 
+		    int shift, int nfine, float row[]);
+
+  //! Number of bits after the binary point of the fixed-point positions of the dda kernels
+  const int DDA_BITS = 32;
+
+  //! Converts a position or step in fine pixels to fixed point
+  long long dda_fixed(float value);
+
+  //! Range of pixels along a row that fall within the fine buffer, for fixed-point positions
+  void dda_clip(size_t nside, long long pos, long long step, int nfine, size_t& x1, size_t& x2);
+
+  //! Fixed-point version of op_row, for reproducible projections
+  void dda_op_row(const float row[], size_t nside, long long pos, long long step, 
+		  int nfine, double tfine[]);
+
+  //! Fixed-point version of tr_row, for reproducible projections
+  void dda_tr_row(const double tfine[], size_t nside, long long pos, long long step, 
+		  int nfine, float row[]);
+
+  //! Footprint of a map pixel projected onto the fine pixels
+
+  /** A square map pixel projects to a trapezoid of unit area: the convolution
+   * of boxcars with the widths of its sides projected onto the velocity axis.
+   */
+  class Footprint {
+  public:
+
+    //! Constructor from the projected scale factors
+    Footprint(float pxscale, float pyscale);
+
+    //! Maximum number of fine pixels that a footprint can overlap
+    int max_width() const {return int(ceil(2.*s_)) + 1;}
+
+    //! Fractions of a footprint centred at p falling in each fine pixel
+    int weights(double p, int nfine, int& j1, double w[]) const;
+
+  private:
+    double cdf(double u) const;
+    double a_, b_, s_, d_, f_;
+  };
+
+  //! Footprint version of op_row
+  void footprint_op_row(const float row[], size_t nside, float fpcon, float pxscale,
+			float pyscale, int nfine, double tfine[]);
+
+  //! Footprint version of tr_row
+  void footprint_tr_row(const double tfine[], size_t nside, float fpcon, float pxscale,
+			float pyscale, int nfine, float row[]);
+
+}
+
+#endif
@@ -1,3 +1,5 @@
+#include <cstdio>
+#include <algorithm>
 #include <fstream>
 #include <string>
 #include "trm_subs.h"
@@ -114,6 +116,14 @@ void Dmap::write(std::ostream& ostr) const{
   for(int i=0; i<nwave(); i++)
     for(int j=0; j<ngamma(); j++)
       image_[i][j].write(ostr);
+
+  // The mask, if any, goes at the end so that maps without one are
+  // unchanged and readers that know nothing of masks can still read them.
+  if(masked()){
+    int mflag = mask_flag;
+    ostr.write((char*)&mflag,sizeof(mflag));
+    ostr.write(&mask_[0],mask_.size());
+  }
 }
 
 void Dmap::read(std::istream& istr){
@@ -130,6 +140,59 @@ void Dmap::read(std::istream& istr){
     for(int j=0; j<ngamma(); j++)
       image_[i][j].read(istr);
 
+  // Only a mask flag starts a mask. Anything else, such as another map
+  // following this one, is left in the stream for whatever reads it next.
+  mask_.clear();
+  if(istr.peek() != EOF){
+    const std::streampos pos = istr.tellg();
+    int mflag;
+    istr.read((char*)&mflag,sizeof(mflag));
+    if(istr && mflag == mask_flag){
+      mask_.resize(size());
+      istr.read(&mask_[0],mask_.size());
+      if(!istr) throw Dmap_Error("read(std::istream&) -- failed to read the mask");
+    }else{
+      istr.clear();
+      if(pos == std::streampos(-1) || !istr.seekg(pos))
+	throw Dmap_Error("read(std::istream&) -- could not step back over the data after the images");
+    }
+  }
+}
+
+/** Restricts the map to the pixels whose velocities lie within an annulus 
+ * centred on the origin, e.g. to leave out the corners beyond the largest
+ * velocity of the system. The same mask applies to every image.
+ * \param vmin inner radius (km/s), 0 for a circle
+ * \param vmax outer radius (km/s)
+ */
+void Dmap::set_mask(float vmin, float vmax){
+  const int n    = nside();
+  const float vc = (n-1)/2.;
+  std::vector<char> image(n*n);
+  float vsq;
+  for(int iy=0; iy<n; iy++){
+    for(int ix=0; ix<n; ix++){
+      vsq = Subs::sqr(vpix_)*(Subs::sqr(ix-vc) + Subs::sqr(iy-vc));
+      image[n*iy+ix] = vsq >= Subs::sqr(vmin) && vsq <= Subs::sqr(vmax);
+    }
+  }
+  mask_.resize(size());
+  for(int i=0; i<nwave()*ngamma(); i++)
+    std::copy(image.begin(), image.end(), mask_.begin()+n*n*i);
+}
+
+/** Restricts the map to the pixels where another map of the same format
+ * is positive.
+ * \param mask the map defining the mask
+ */
+void Dmap::set_mask(const Dmap& mask){
+  if(!match(*this, mask))
+    throw Dmap_Error("Dmap::set_mask(const Dmap&) -- mask does not match the map");
+  std::vector<float> values(size());
+  mask.get(&values[0]);
+  mask_.resize(size());
+  for(int i=0; i<size(); i++)
+    mask_[i] = values[i] > 0.f;
 }
 
 void Dmap::operator+=(float con){
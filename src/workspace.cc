@@ -0,0 +1,45 @@
+//
+// Tomog::Workspace, re-usable memory for op, tr and gaussdef
+//
+
+#include <cstdlib>
+#include <new>
+#include "trm_tomog.h"
+
+Tomog::Workspace::~Workspace(){
+  for(size_t i=0; i<buff_.size(); i++)
+    free(buff_[i]);
+}
+
+/** Returns the buffer of a given slot, enlarging it if need be. The contents
+ * are not preserved when a buffer is enlarged.
+ * \param slot   the slot number
+ * \param nbytes the minimum number of bytes needed
+ * \return pointer to the buffer, aligned to ALIGN bytes
+ */
+void* Tomog::Workspace::get_bytes(int slot, size_t nbytes){
+
+  if(size_t(slot) >= buff_.size()){
+    buff_.resize(slot+1, NULL);
+    nbytes_.resize(slot+1, 0);
+  }
+
+  if(nbytes > nbytes_[slot]){
+    free(buff_[slot]);
+    buff_[slot]   = NULL;
+    nbytes_[slot] = 0;
+    void *ptr;
+    if(posix_memalign(&ptr, ALIGN, nbytes))
+      throw std::bad_alloc();
+    buff_[slot]   = ptr;
+    nbytes_[slot] = nbytes;
+  }
+  return buff_[slot];
+}
+
+size_t Tomog::Workspace::nbytes() const {
+  size_t ntot = 0;
+  for(size_t i=0; i<nbytes_.size(); i++)
+    ntot += nbytes_[i];
+  return ntot;
+}